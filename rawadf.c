@@ -19,10 +19,57 @@
 ** You should have received a copy of the GNU General Public License
 ** along with this program.  If not, see <http://www.gnu.org/licenses/>.
 **
-** $VER: rawadf.c 0.4 (30.07.2010)
+** $VER: rawadf.c 0.5 (18.10.2026)
 **
 ** Changelog:
 **
+** 0.5 (18.10.2026):
+**     - Add the --manifest option to write CRC-32 checksums of
+**       merged, replaced and split images
+**     - Add the diff and patch commands
+**     - Add the similar command
+**     - Add the --stats option to report I/O counts and timings
+**     - Add the consensus command
+**     - Add the toadf command
+**     - Add the fromadf command
+**     - Add the assemble command
+**     - Allow split to write several destinations in one pass
+**     - Add the side1, side2 and cylinder (e.g. c10-20) TRACKSPECs
+**     - Add the pipeline command
+**     - Copy runs of adjacent tracks in one piece when merging
+**     - Add the index command and show the sync layout of RAW
+**       tracks in info, which writes the index when it has to scan
+**     - Classify tracks as empty, noise, formatted or data, and
+**       have merge prefer the better class. merge now reads the RAW
+**       tracks of both sources once to classify them before copying,
+**       unless they have an up to date sync index
+**     - Add the bundle command to pack images into one file, and let
+**       every command read an image in a bundle as BUNDLE#NAME
+**     - Add the identify command to label known tracks from a
+**       database of track signatures
+**     - Add the sectormerge command to rebuild DOS tracks from the
+**       good sectors of several dumps
+**     - Add the canonicalize command to rotate RAW tracks to the
+**       first sector after the track gap and trim them to one
+**       revolution
+**     - Size track tables to each image, allowing up to 1024 tracks
+**     - Add the batch command to run many commands in one process,
+**       resuming an interrupted run from its journal
+**     - Add the extract command to write tracks to files of their own
+**     - Add the check command to find truncated or damaged images from
+**       their headers alone
+**     - Read AmigaDOS blocks of an image through a cache of decoded
+**       tracks, decoding only the tracks which are needed
+**     - Add the catalog command to list the files on AmigaDOS disks
+**     - Read and write images through an I/O backend, which may be a
+**       file or a buffer in memory
+**     - Fix compare reading past the track table of the shorter image
+**     - Add the tohfe and toscp commands to convert images for floppy
+**       emulators and flux hardware
+**     - When built with HAVE_PTHREAD defined, copy the tracks of merged
+**       and assembled images with several threads using pread() and
+**       pwrite()
+**
 ** 0.4 (30.07.2010):
 **     - Add the split command
 **
@@ -33,27 +80,205 @@
 **     - Initial release
 */
 
+/*
+** Define HAVE_PTHREAD (and link with -pthread) on POSIX systems to copy
+** the tracks of merged and assembled images with several threads.
+*/
+#ifdef HAVE_PTHREAD
+#define _XOPEN_SOURCE 500
+#endif
+
+#include <limits.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-#define VERSION "0.4"
+#if defined(unix) || defined(__unix__) || defined(__APPLE__)
+#include <sys/time.h>
+#define HAVE_GETTIMEOFDAY
+#endif
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#define VERSION "0.5"
 
 /* Amiga version string */
-const char AMI_VERSION[] = "$VER: rawadf " VERSION " (30.07.2010)";
+const char AMI_VERSION[] = "$VER: rawadf " VERSION " (18.10.2026)";
 const char USAGE[] = "rawadf: Type 'rawadf help' for usage.";
 
 /*
-** Constants related to the extended ADF file format
+** Constants related to the extended ADF file format. EADF_MAXTRACKS is
+** only a sanity limit, far above any real disk, so that a corrupt
+** track count is rejected before its track table is allocated.
 */
-#define EADF_MAXTRACKS 166
+#define EADF_MAXTRACKS 1024
 #define EADF_BYTESPERRECORD 12
 #define EADF_HEADERSIZE 2004
 #define EADF_MAGICLEN 8
 #define EADF_BUFSIZE 1024
+#define EADF_COPYBUFSIZE 32768
+#define EADF_COPYTHREADS 4
 
 const char EADF_MAGIC[] = "UAE-1ADF";
 
+/*
+** Constants related to the delta files written by the diff command
+*/
+#define EADFDELTA_HEADERSIZE 20
+#define EADFDELTA_BYTESPERRECORD 28
+#define EADFDELTA_MINGAP 8
+
+const char EADFDELTA_MAGIC[] = "RADFDLT1";
+
+/*
+** Constants related to the bundles written by the bundle command. A
+** bundle starts with a header and an index of fixed-size entries sorted
+** by image name, followed by the images themselves, each starting on an
+** EADFBUNDLE_ALIGN byte boundary.
+*/
+#define EADFBUNDLE_HEADERSIZE 16
+#define EADFBUNDLE_ENTRYSIZE 64
+#define EADFBUNDLE_NAMELEN 48
+#define EADFBUNDLE_ALIGN 512
+
+const char EADFBUNDLE_MAGIC[] = "RADFBNDL";
+
+enum EADFDeltaOp {
+    EADFDELTAOP_COPY,
+    EADFDELTAOP_RUNS,
+    EADFDELTAOP_FULL
+};
+
+/*
+** Constants related to the MinHash signatures of RAW tracks used to
+** find similar images. The signature is split into bands of rows for
+** locality sensitive hashing; images sharing any band are compared.
+*/
+#define EADF_MINHASHES 64
+#define EADF_MINHASHBITS 6
+#define EADF_MINHASHBANDS 16
+#define EADF_MINHASHROWS 4
+#define EADF_MINHASHEMPTY 0xffffffffUL
+#define EADF_MINHASHSIMILARITY 50
+
+/*
+** The AmigaDOS sync word, and limits on the number of images the
+** consensus command can vote between (its counts are held in
+** EADF_CONSENSUSPLANES bits).
+*/
+#define EADF_SYNCWORD 0x4489
+#define EADF_MAXCONSENSUS 255
+#define EADF_CONSENSUSPLANES 8
+
+/*
+** Constants related to standard ADF images and the AmigaDOS track
+** format. An MFM encoded sector is two sync words followed by the
+** info, label, header checksum, data checksum and data, each stored
+** as odd bits followed by even bits.
+*/
+#define ADF_NUMTRACKS 160
+#define ADF_SECTORSPERTRACK 11
+#define ADF_SECTORSIZE 512
+#define ADF_TRACKSIZE (ADF_SECTORSPERTRACK * ADF_SECTORSIZE)
+#define ADF_ALLSECTORS 0x7ffUL
+#define ADF_MFMSECTORBITS ((2 + 4 + 16 + 4 + 4 + ADF_SECTORSIZE) * 16)
+#define MFM_DATAMASK 0x55555555UL
+
+/*
+** Constants of the AmigaDOS filesystem (OFS and FFS) on a floppy disk.
+** Header and list blocks hold a table of ADFS_HASHSIZE longs: the hash
+** table of a directory, or the data blocks of a file (last entry
+** first). Offsets are in bytes from the start of a block. OFS data
+** blocks start with a header of their own; FFS data blocks are all
+** data.
+*/
+#define ADFS_NUMBLOCKS (ADF_NUMTRACKS * ADF_SECTORSPERTRACK)
+#define ADFS_ROOTBLOCK 880
+#define ADFS_HASHSIZE 72
+#define ADFS_MAXNAME 30
+#define ADFS_MAXDEPTH 32
+#define ADFS_T_HEADER 2
+#define ADFS_T_DATA 8
+#define ADFS_T_LIST 16
+#define ADFS_ST_USERDIR 2
+#define ADFS_ST_FILE 0xfffffffdUL
+#define ADFS_HIGHSEQ 8
+#define ADFS_DATASIZE 12
+#define ADFS_TABLE 24
+#define ADFS_OFSDATA 24
+#define ADFS_FILESIZE 324
+#define ADFS_NAME 432
+#define ADFS_HASHCHAIN 496
+#define ADFS_EXTENSION 504
+#define ADFS_SECTYPE 508
+
+/* Size of a RAW track as written by the Amiga's trackdisk.device */
+#define EADF_RAWTRACKSIZE 12668
+
+/*
+** Constants of the HFE (version 1) images of HxC and Gotek floppy
+** emulators. The header and the track list each start a block of
+** HFE_BLOCKSIZE bytes. The bit cells of the two sides of a cylinder
+** are stored in turn, half a block at a time, with the first cell of
+** each byte in bit 0, and are played at one fixed rate.
+*/
+#define HFE_MAGIC "HXCPICFE"
+#define HFE_BLOCKSIZE 512
+#define HFE_MAXCYLINDERS 255
+#define HFE_BITRATE 250
+#define HFE_RPM 300
+#define HFE_AMIGADD 4
+#define HFE_AMIGAMFM 1
+
+/*
+** Constants of SuperCard Pro (SCP) flux images, whose flux times are
+** counted in ticks of 25ns. A revolution at 300 RPM takes
+** SCP_REVOLUTION ticks, which holds SCP_REVOLUTIONCELLS double
+** density bit cells of 2us; a drive running slow can write at most
+** SCP_MAXCELLS. The flags mark an image as starting each track at the
+** index, for a 96 TPI drive, and not read from a disk.
+*/
+#define SCP_MAGIC "SCP"
+#define SCP_HEADERSIZE 16
+#define SCP_MAXTRACKS 168
+#define SCP_VERSION 0x22
+#define SCP_AMIGA 0x04
+#define SCP_FLAGS 0x0b
+#define SCP_TRACKHEADERSIZE 16
+#define SCP_REVOLUTION 8000000UL
+#define SCP_REVOLUTIONCELLS 100000UL
+#define SCP_MAXCELLS 110000UL
+
+/*
+** The number of sync word positions kept per track when scanning a
+** track's layout, and the length above which a track is longer than
+** a drive can normally write (usually a sign of copy protection).
+*/
+#define EADF_MAXSYNCS 64
+#define EADF_LONGTRACKBITS 102400
+
+/*
+** The shortest revolution looked for in a RAW track read over more
+** than one revolution, and the number of bits after a sync word which
+** must repeat for it to count as the start of the next revolution.
+*/
+#define EADF_MINREVOLUTIONBITS 90000
+#define EADF_REVOLUTIONCHECK 256
+
+/*
+** A RAW track is empty if one byte value repeats for at least
+** EADF_EMPTYRUN percent of it, and noise if more than EADF_NOISEBYTES
+** percent of its bytes have two adjacent 1 bits, which MFM never does
+** but random data does in most bytes.
+*/
+#define EADF_EMPTYRUN 75
+#define EADF_NOISEBYTES 25
+
 enum EADFTrackType {
     EADFTRACKTYPE_DOS,
     EADFTRACKTYPE_RAW
@@ -61,15 +286,41 @@ enum EADFTrackType {
 typedef enum EADFTrackType EADFTrackType;
 const char *EADFTRACKTYPE_NAMES[] = { "DOS", "RAW" };
 
+/*
+** An unsigned type of at least 32 bits, used for the fields of the
+** track table so that it is no larger than it needs to be on hosts
+** with 64-bit longs.
+*/
+#if UINT_MAX >= 0xffffffffUL
+typedef unsigned int EADFUInt32;
+#else
+typedef unsigned long EADFUInt32;
+#endif
+
+/*
+** The header of an extended ADF file. The track table is sized for
+** the file's number of tracks and taken from the arena by
+** eadfHeaderAlloc(), one array per field; maxTracks is the number of
+** tracks it has room for. A header must be zeroed before first use.
+*/
 typedef struct {
     char magic[EADF_MAGICLEN + 1];
     unsigned long numTracks;
-    EADFTrackType trackType[EADF_MAXTRACKS];
-    unsigned long trackSizeBytes[EADF_MAXTRACKS];
-    unsigned long trackSizeBits[EADF_MAXTRACKS];
-    unsigned long trackOffset[EADF_MAXTRACKS];
+    unsigned long maxTracks;
+    unsigned char *trackType;
+    EADFUInt32 *trackSizeBytes;
+    EADFUInt32 *trackSizeBits;
+    EADFUInt32 *trackOffset;
 } EADFHeader;
 
+typedef struct {
+    char name[EADFBUNDLE_NAMELEN + 1];
+    unsigned long offset;
+    unsigned long size;
+    unsigned long numTracks;
+    unsigned long headerCrc;
+} EADFBundleEntry;
+
 enum EADFStatus {
     EADFSTATUS_SUCCESS,
     EADFSTATUS_FAILURE
@@ -92,11 +343,45 @@ enum EADFError {
     EADFERROR_WRITEERROR,
     EADFERROR_SEEKERROR,
     EADFERROR_EOFERROR,
+    EADFERROR_NOMEMORY,
+    EADFERROR_INVALIDDELTA,
+    EADFERROR_DELTAMISMATCH,
+    EADFERROR_TOOMANYSOURCES,
+    EADFERROR_INVALIDADF,
+    EADFERROR_NOTABUNDLE,
+    EADFERROR_NOSUCHIMAGE,
+    EADFERROR_BUNDLETOOLARGE,
+    EADFERROR_BUNDLEMISMATCH,
+    EADFERROR_BADSECTOR,
+    EADFERROR_TOOMANYTRACKS,
+    EADFERROR_TRACKTOOLONG,
     EADFERROR_UNKNOWNERROR
 };
 
 enum EADFError eadf_errno;
 
+/*
+** The arena from which track tables and other per-track arrays are
+** allocated. Memory is handed out from large blocks, which are all
+** freed together by eadfArenaFree() once a command has finished.
+*/
+#define EADF_ARENABLOCKSIZE 16384
+
+typedef union {
+    long l;
+    double d;
+    void *p;
+} EADFArenaAlign;
+
+typedef struct EADFArenaBlock {
+    struct EADFArenaBlock *next;
+    size_t size;
+    size_t used;
+    EADFArenaAlign data[1];
+} EADFArenaBlock;
+
+EADFArenaBlock *eadf_arena = NULL;
+
 const char *EADFERROR_MESSAGES[] = {
     /* EADFERROR_NOERROR */
     "No error",
@@ -122,65 +407,461 @@ const char *EADFERROR_MESSAGES[] = {
     /* EADFERROR_EOFERROR */
     "Premature end-of-file",
 
+    /* EADFERROR_NOMEMORY */
+    "Memory error (out of memory?)",
+
+    /* EADFERROR_INVALIDDELTA */
+    "Invalid or corrupt delta file",
+
+    /* EADFERROR_DELTAMISMATCH */
+    "Delta does not apply to this file",
+
+    /* EADFERROR_TOOMANYSOURCES */
+    "Too many source files",
+
+    /* EADFERROR_INVALIDADF */
+    "Invalid size for a standard ADF image",
+
+    /* EADFERROR_NOTABUNDLE */
+    "Not a bundle",
+
+    /* EADFERROR_NOSUCHIMAGE */
+    "No such image in bundle",
+
+    /* EADFERROR_BUNDLETOOLARGE */
+    "Bundle would be too large",
+
+    /* EADFERROR_BUNDLEMISMATCH */
+    "Image does not match the bundle's index",
+
+    /* EADFERROR_BADSECTOR */
+    "Sector missing or could not be decoded",
+
+    /* EADFERROR_TOOMANYTRACKS */
+    "Too many tracks for the output format",
+
+    /* EADFERROR_TRACKTOOLONG */
+    "Track too long for the output format",
+
     /* EADFERROR_UNKNOWNERROR */
     "Unknown error"
 };
 
+/*
+** Counts of the I/O performed on extended ADF files and the time
+** spent in each phase of a command, reported by the --stats option.
+*/
+enum EADFPhase {
+    EADFPHASE_HEADER,
+    EADFPHASE_PLANNING,
+    EADFPHASE_COPY,
+    EADFPHASE_COMPARE,
+    EADFPHASE_NUMPHASES
+};
+typedef enum EADFPhase EADFPhase;
+
+const char *EADFPHASE_NAMES[] = {
+    "header", "planning", "copy", "compare"
+};
+
+typedef struct {
+    unsigned long bytesRead;
+    unsigned long bytesWritten;
+    unsigned long reads;
+    unsigned long writes;
+    unsigned long seeks;
+    double phaseTime[EADFPHASE_NUMPHASES];
+} EADFStats;
+
+EADFStats eadf_stats;
+
+/*
+** CRC-32 checksums of an extended ADF file written by eadfMergeFiles()
+** or eadfSplitFile(), covering the whole file and each track's data.
+** Like the track table of a header, the per-track arrays are taken
+** from the arena by eadfChecksumsAlloc(), and the structure must be
+** zeroed before first use.
+*/
+typedef struct {
+    unsigned long fileCrc;
+    unsigned long fileSize;
+    unsigned long numTracks;
+    unsigned long maxTracks;
+    EADFUInt32 *trackCrc;
+    EADFUInt32 *trackSizeBytes;
+} EADFChecksums;
+
+/*
+** A backend through which extended ADF data is read and written at
+** given offsets: an open file, or a buffer in memory. read() and
+** write() return the number of bytes transferred, setting eadf_errno
+** if that is fewer than asked for, and size() returns -1 on failure.
+**
+** A file backend remembers the position of its file so that it only
+** seeks when an offset does not follow on from the last transfer. A
+** memory backend reads the first "length" bytes of "data" and may
+** write up to "capacity" bytes; if it was given no buffer it
+** allocates one, which grows as needed and is freed by eadfIOFree().
+*/
+typedef struct EADFIO {
+    size_t (*read)(struct EADFIO *, unsigned long, void *, size_t);
+    size_t (*write)(struct EADFIO *, unsigned long, const void *, size_t);
+    long (*size)(struct EADFIO *);
+    FILE *f;
+    long position;
+    unsigned char *data;
+    unsigned long length;
+    unsigned long capacity;
+    int owned;
+} EADFIO;
+
+#ifdef HAVE_PTHREAD
+/*
+** A run of tracks to be copied by eadfCopyRuns(), which are stored one
+** after another at "offset" of the file "srcFd" and go to "destOffset"
+** of the destination.
+*/
+typedef struct {
+    int srcFd;
+    unsigned long offset;
+    unsigned long destOffset;
+    unsigned long numBytes;
+} EADFCopyRun;
+
+/*
+** A thread of eadfCopyRuns(), which copies every EADF_COPYTHREADS'th
+** run starting with run "first". It keeps its own counts of the I/O
+** it performs and the error which stopped it, if any.
+*/
+typedef struct {
+    const EADFCopyRun *runs;
+    unsigned long numRuns;
+    unsigned long first;
+    int destFd;
+    unsigned long bytesRead;
+    unsigned long bytesWritten;
+    unsigned long reads;
+    unsigned long writes;
+    enum EADFError error;
+} EADFCopyThread;
+#endif
+
+/*
+** A cache of decoded tracks, which may be shared by the views of
+** several images. Each slot holds one track of one view, or none if
+** its owner is NULL; a mask of the sectors which decoded is kept with
+** it. When the cache is full the least recently used track is dropped.
+*/
+#define EADF_CACHETRACKS 32
+
+typedef struct {
+    const void *owner;
+    unsigned long track;
+    unsigned long found;
+    unsigned long lastUsed;
+    unsigned char *data;
+} EADFTrackCacheSlot;
+
+typedef struct {
+    unsigned long numSlots;
+    unsigned long clock;
+    unsigned long hits;
+    unsigned long misses;
+    EADFTrackCacheSlot *slots;
+} EADFTrackCache;
+
+/*
+** A view of an extended ADF file as a standard ADF image, read one
+** block at a time through a track cache by eadfViewReadBlock().
+*/
+typedef struct {
+    EADFHeader *h;
+    FILE *f;
+    const char *name;
+    EADFTrackCache *cache;
+    unsigned char *buffer;
+} EADFView;
+
+/*
+** What a track appears to hold, from worst to best: nothing (no data,
+** or the same byte repeated), an unformatted area read as noise, a
+** formatted RAW track none of whose sectors decode, or data (a DOS
+** track, or a RAW track with AmigaDOS sectors which decode).
+*/
+enum EADFTrackClass {
+    EADFTRACKCLASS_EMPTY,
+    EADFTRACKCLASS_NOISE,
+    EADFTRACKCLASS_FORMATTED,
+    EADFTRACKCLASS_DATA
+};
+typedef enum EADFTrackClass EADFTrackClass;
+const char *EADFTRACKCLASS_NAMES[] = {
+    "empty", "noise", "formatted", "data"
+};
+#define EADFTRACKCLASS_NUMCLASSES 4
+
+/*
+** The layout of a track found by eadfScanLayouts(). Only the first
+** EADF_MAXSYNCS sync word positions of a RAW track are kept, and DOS
+** tracks have just a class.
+*/
+typedef struct {
+    EADFTrackClass trackClass;
+    unsigned long numSyncs;
+    unsigned long syncPos[EADF_MAXSYNCS];
+    unsigned long numSectors;
+    unsigned long maxGap;
+} EADFTrackLayout;
+
+#define CRC_INIT 0xffffffffUL
+
+unsigned long crcUpdate(unsigned long, const unsigned char *, size_t);
+unsigned long crcFinal(unsigned long);
+
+double statsClock(void);
+void statsAddTime(EADFPhase, double);
+size_t eadfRead(void *, size_t, size_t, FILE *);
+size_t eadfWrite(const void *, size_t, size_t, FILE *);
+int eadfSeek(FILE *, long, int);
+size_t eadfIOFileRead(EADFIO *, unsigned long, void *, size_t);
+size_t eadfIOFileWrite(EADFIO *, unsigned long, const void *, size_t);
+long eadfIOFileSize(EADFIO *);
+size_t eadfIOMemoryRead(EADFIO *, unsigned long, void *, size_t);
+size_t eadfIOMemoryWrite(EADFIO *, unsigned long, const void *, size_t);
+long eadfIOMemorySize(EADFIO *);
+void eadfIOInitFile(EADFIO *, FILE *);
+void eadfIOInitMemory(EADFIO *, unsigned char *, unsigned long,
+    unsigned long);
+void eadfIOFree(EADFIO *);
+
+void *eadfArenaAlloc(size_t);
+void eadfArenaFree(void);
+EADFStatus eadfHeaderAlloc(EADFHeader *, unsigned long);
+EADFStatus eadfChecksumsAlloc(EADFChecksums *, unsigned long);
+EADFStatus eadfHeaderCopy(EADFHeader *, const EADFHeader *);
 EADFStatus eadfHeaderInitWithFile(EADFHeader *, FILE *);
+EADFStatus eadfHeaderInitWithIO(EADFHeader *, EADFIO *, unsigned long);
+EADFStatus eadfHeaderReadRecords(EADFHeader *, EADFIO *, unsigned long);
 void eadfPrintErrorWithContext(const char *context);
-EADFStatus eadfMergeFiles(EADFHeader *, FILE *, const char *,
-    EADFHeader *, FILE *, const char *, FILE *,
-    const EADFTrackSource *);
-EADFStatus eadfSplitFile(EADFHeader *, FILE *, const char *, FILE *,
-    const EADFTrackSource *);
+long eadfTrackSourceIndex(unsigned long, EADFHeader **,
+    const EADFTrackSource *, unsigned long);
+EADFStatus eadfCopyTracks(EADFHeader *, EADFIO *, EADFIO *, unsigned long,
+    unsigned long, unsigned long, unsigned char *, unsigned long,
+    EADFChecksums *, unsigned long *);
+EADFStatus eadfAssembleFiles(unsigned long, EADFHeader **, EADFIO **,
+    EADFIO *, unsigned long, const EADFTrackSource *, EADFChecksums *);
+#ifdef HAVE_PTHREAD
+void *eadfCopyRunsThread(void *);
+EADFStatus eadfCopyRuns(const EADFCopyRun *, unsigned long, EADFIO *);
+#endif
+EADFStatus eadfMergeFiles(EADFHeader *, EADFIO *, EADFHeader *, EADFIO *,
+    EADFIO *, const EADFTrackSource *, EADFChecksums *);
+EADFStatus eadfSplitFiles(EADFHeader *, EADFIO *, unsigned long, EADFIO **,
+    EADFTrackSource **, EADFChecksums **);
+EADFStatus eadfSplitFile(EADFHeader *, EADFIO *, EADFIO *,
+    const EADFTrackSource *, EADFChecksums *);
+EADFStatus eadfReadTrack(EADFHeader *, FILE *, const char *, unsigned long,
+    unsigned char *);
+unsigned long eadfHeaderCrc(const EADFHeader *);
+unsigned long eadfMaxTrackSize(const EADFHeader *);
+unsigned long eadfExpectedSize(const EADFHeader *);
+EADFStatus eadfDiffFiles(EADFHeader *, FILE *, const char *,
+    EADFHeader *, FILE *, const char *, FILE *);
+EADFStatus eadfPatchFile(EADFHeader *, FILE *, const char *, FILE *, FILE *,
+    EADFChecksums *);
+unsigned long hashMix(unsigned long);
+EADFStatus eadfMinHashRawTracks(EADFHeader *, FILE *, const char *,
+    unsigned long *);
+unsigned long minHashSimilarity(const unsigned long *, const unsigned long *);
+unsigned long eadfTrackBits(const EADFHeader *, unsigned long);
+long bitstreamFindSync(const unsigned char *, unsigned long, unsigned long,
+    unsigned long);
+void bitstreamRotate(const unsigned char *, unsigned long, unsigned long,
+    unsigned char *);
+unsigned long majorityWord(const unsigned long *, unsigned long,
+    unsigned long *);
+EADFStatus eadfConsensusFiles(unsigned long, EADFHeader *, FILE **, char **,
+    FILE *, unsigned long *);
+unsigned long bitstreamLong(const unsigned char *, unsigned long,
+    unsigned long);
+unsigned long bitstreamRevolution(const unsigned char *, unsigned long,
+    unsigned long);
+unsigned long bitstreamTrackStart(const unsigned char *, unsigned long);
+EADFStatus eadfCanonicalizeFile(EADFHeader *, FILE *, const char *,
+    EADFHeader *, FILE *);
+unsigned long mfmDecodeSectors(const unsigned char *, unsigned long,
+    unsigned long, unsigned char *);
+EADFStatus eadfDecodeTrack(EADFHeader *, FILE *, const char *, unsigned long,
+    unsigned char *, unsigned char *, unsigned long *);
+EADFStatus eadfSectorMergeTrack(unsigned long, EADFHeader *, FILE **,
+    char **, unsigned long, unsigned char *, unsigned char *,
+    unsigned char *, EADFHeader *, unsigned long *);
+EADFStatus eadfSectorMergeFiles(unsigned long, EADFHeader *, FILE **,
+    char **, FILE *, unsigned long *);
+EADFStatus eadfTrackSignature(EADFHeader *, FILE *, const char *,
+    unsigned long, unsigned char *, unsigned char *, unsigned long *,
+    unsigned long *);
+void syncByteTable(unsigned long, unsigned char *);
+unsigned long bitstreamFindSyncs(const unsigned char *, unsigned long,
+    unsigned long, const unsigned char *, unsigned long *, unsigned long,
+    unsigned long *);
+EADFTrackClass eadfClassifyTrack(const unsigned char *, unsigned long,
+    EADFTrackType, unsigned long, unsigned long);
+EADFStatus eadfScanLayouts(EADFHeader *, FILE *, const char *,
+    EADFTrackLayout *);
+long eadfFileSize(FILE *);
+EADFStatus eadfBundleReadEntry(FILE *, unsigned long, EADFBundleEntry *);
+EADFStatus eadfBundleReadHeader(FILE *, unsigned long *);
+EADFStatus eadfBundleFind(FILE *, const char *, EADFBundleEntry *);
+EADFStatus eadfBundleCheckImage(FILE *, const EADFBundleEntry *);
+EADFStatus eadfBundleWriteIndex(FILE *, unsigned long, EADFBundleEntry *);
+EADFStatus eadfBundleWriteImage(FILE *, FILE *, const EADFBundleEntry *);
+EADFStatus eadfWriteAdf(EADFHeader *, FILE *, const char *, FILE *,
+    unsigned long *);
+EADFStatus eadfTrackCacheInit(EADFTrackCache *, unsigned long);
+void eadfTrackCacheFree(EADFTrackCache *);
+EADFStatus eadfViewInit(EADFView *, EADFHeader *, FILE *, const char *,
+    EADFTrackCache *);
+void eadfViewFree(EADFView *);
+EADFStatus eadfViewReadBlock(EADFView *, unsigned long, unsigned char *);
+void mfmEncodeLong(unsigned long, unsigned char *, unsigned int *);
+unsigned long mfmEncodeOddEven(const unsigned long *, unsigned long,
+    unsigned char *, unsigned int *);
+void mfmEncodeTrack(const unsigned char *, unsigned long, unsigned char *);
+EADFStatus eadfFromAdf(FILE *, unsigned long, FILE *, EADFTrackType);
+EADFStatus eadfReadBitstream(EADFHeader *, FILE *, const char *,
+    unsigned long, unsigned char *, unsigned char *, unsigned long *);
+EADFStatus eadfWriteHfe(EADFHeader *, FILE *, const char *, EADFIO *);
+unsigned long scpFluxFromBitstream(const unsigned char *, unsigned long,
+    unsigned char *);
+EADFStatus eadfWriteScp(EADFHeader *, FILE *, const char *, EADFIO *);
 
 /*
 ** Commands
 */
 #define COMMAND_BUFSIZE 1024
+#define COMMAND_MAXWORDS 64
+#define COMMAND_MAXIMAGES 64
+#define COMMAND_BLOOMHASHES 3
 
 enum Command {
+    COMMAND_ASSEMBLE,
+    COMMAND_BATCH,
+    COMMAND_BUNDLE,
+    COMMAND_CANONICALIZE,
+    COMMAND_CATALOG,
+    COMMAND_CHECK,
     COMMAND_COMPARE,
+    COMMAND_CONSENSUS,
+    COMMAND_DIFF,
     COMMAND_DOSMERGE,
+    COMMAND_EXTRACT,
+    COMMAND_FROMADF,
     COMMAND_HELP,
+    COMMAND_IDENTIFY,
+    COMMAND_INDEX,
     COMMAND_INFO,
     COMMAND_MERGE,
+    COMMAND_PATCH,
+    COMMAND_PIPELINE,
     COMMAND_REPLACE,
+    COMMAND_SECTORMERGE,
+    COMMAND_SIMILAR,
     COMMAND_SPLIT,
+    COMMAND_TOADF,
+    COMMAND_TOHFE,
+    COMMAND_TOSCP,
     COMMAND_UNKNOWN
 };
 typedef enum Command Command;
 
 const char *COMMAND_NAMES[] = {
+    "assemble",
+    "batch",
+    "bundle",
+    "canonicalize",
+    "catalog",
+    "check",
     "compare",
+    "consensus",
+    "diff",
     "dosmerge",
+    "extract",
+    "fromadf",
     "help",
+    "identify",
+    "index",
     "info",
     "merge",
+    "patch",
+    "pipeline",
     "replace",
+    "sectormerge",
+    "similar",
     "split",
+    "toadf",
+    "tohfe",
+    "toscp",
     "unknown"
 };
 
-#define COMMAND_NUMALIASES 12
+#define COMMAND_NUMALIASES 39
 const char *COMMAND_ALIASES[] = {
+    "assemble", "asm",
+    "batch",
+    "bundle",
+    "canonicalize", "canon",
+    "catalog", "ls",
+    "check",
     "compare", "cmp",
+    "consensus", "vote",
+    "diff",
     "dosmerge", "dos",
+    "extract",
+    "fromadf",
     "help", "?", "h",
+    "identify", "id",
+    "index",
     "info",
     "merge",
+    "patch",
+    "pipeline", "pipe",
     "replace", "rpl",
-    "split"
+    "sectormerge", "sec",
+    "similar", "sim",
+    "split",
+    "toadf",
+    "tohfe",
+    "toscp"
 };
 
 const Command COMMAND_ALIASMAP[] = {
+    COMMAND_ASSEMBLE, COMMAND_ASSEMBLE,
+    COMMAND_BATCH,
+    COMMAND_BUNDLE,
+    COMMAND_CANONICALIZE, COMMAND_CANONICALIZE,
+    COMMAND_CATALOG, COMMAND_CATALOG,
+    COMMAND_CHECK,
     COMMAND_COMPARE, COMMAND_COMPARE,
+    COMMAND_CONSENSUS, COMMAND_CONSENSUS,
+    COMMAND_DIFF,
     COMMAND_DOSMERGE, COMMAND_DOSMERGE,
+    COMMAND_EXTRACT,
+    COMMAND_FROMADF,
     COMMAND_HELP, COMMAND_HELP, COMMAND_HELP,
+    COMMAND_IDENTIFY, COMMAND_IDENTIFY,
+    COMMAND_INDEX,
     COMMAND_INFO,
     COMMAND_MERGE,
+    COMMAND_PATCH,
+    COMMAND_PIPELINE, COMMAND_PIPELINE,
     COMMAND_REPLACE, COMMAND_REPLACE,
-    COMMAND_SPLIT
+    COMMAND_SECTORMERGE, COMMAND_SECTORMERGE,
+    COMMAND_SIMILAR, COMMAND_SIMILAR,
+    COMMAND_SPLIT,
+    COMMAND_TOADF,
+    COMMAND_TOHFE,
+    COMMAND_TOSCP
 };
 
 const char *COMMAND_BASICHELP =
@@ -194,7 +875,77 @@ const char *COMMAND_BASICHELP =
     "conditions. See the GNU General Public License for more details.\n\n"
     "Available commands:";
 
+const char *COMMAND_OPTIONSHELP =
+    "Options (given before the command):\n"
+    "   --manifest  Write CRC-32 checksums of the whole DESTINATION and\n"
+    "               of each of its tracks to DESTINATION.crc\n"
+    "   --stats[=json]\n"
+    "               Print the amount of I/O performed and the time spent\n"
+    "               in each phase of the command to stderr";
+
 const char *COMMAND_HELPTEXT[] = {
+    /* COMMAND_ASSEMBLE */
+    "assemble (asm): Build an Extended ADF image from several others.\n"
+    "usage: assemble RECIPE DESTINATION\n\n"
+    "Write DESTINATION with tracks taken from the source images named\n"
+    "in the RECIPE file ('-' for standard input). Each line of the\n"
+    "RECIPE lists one or more TRACKSPECs followed by a source, and\n"
+    "text after a '#' is ignored. For example:\n\n"
+    "0-79 side1.adf\n"
+    "80-159 side2.adf\n"
+    "40 41 fixed.adf\n\n"
+    "Later lines override earlier ones, and tracks which are not\n"
+    "listed are left empty. Each source is read once in track order.\n",
+
+    /* COMMAND_BATCH */
+    "batch: Run many commands, resuming where an earlier run stopped.\n"
+    "usage: batch JOBFILE [JOURNAL]\n\n"
+    "Run the commands in JOBFILE, one per line as they would follow\n"
+    "'rawadf', in a single process. A failed command does not stop\n"
+    "the others. Each command which succeeds is recorded in JOURNAL\n"
+    "(JOBFILE.journal by default) and is skipped when the batch is\n"
+    "run again, unless its line has been changed, so an interrupted\n"
+    "batch or one with failures can simply be repeated.\n",
+
+    /* COMMAND_BUNDLE */
+    "bundle: Pack several Extended ADF images into one file.\n"
+    "usage: bundle BUNDLE [FILENAME...]\n\n"
+    "Write BUNDLE holding each FILENAME ('-' to read the names from\n"
+    "standard input, one per line) under its name without any\n"
+    "directory. With no FILENAMEs, list the images in BUNDLE.\n\n"
+    "Any command can read an image in a bundle given as BUNDLE#NAME,\n"
+    "which is found through the bundle's sorted index and checked\n"
+    "against the CRC of its header kept there.\n",
+
+    /* COMMAND_CANONICALIZE */
+    "canonicalize (canon): Put the RAW tracks of an image in a standard\n"
+    "form.\n"
+    "usage: canonicalize SOURCE DESTINATION\n\n"
+    "Copy SOURCE to DESTINATION with each RAW track rotated to start\n"
+    "at the first sector after the track gap (the longest distance\n"
+    "between sync words). A track read over more than one revolution\n"
+    "is first trimmed to one, found where the bits after its first\n"
+    "sync word repeat. Reads of the same disk then give identical\n"
+    "tracks, which compare, diff and similar can match byte for byte.\n",
+
+    /* COMMAND_CATALOG */
+    "catalog (ls): List the files on AmigaDOS disk images.\n"
+    "usage: catalog FILENAME...\n\n"
+    "Walk the OFS or FFS filesystem of each FILENAME and print the\n"
+    "size, CRC-32 and path of every file, one per line as\n"
+    "FILENAME:PATH, with directories shown as '-'. Only the tracks\n"
+    "holding the filesystem's blocks are decoded, and a file with bad\n"
+    "or missing blocks is shown with 'bad' for its CRC-32.\n",
+
+    /* COMMAND_CHECK */
+    "check: Look for damage in Extended ADF images.\n"
+    "usage: check FILENAME...\n\n"
+    "Check that each FILENAME is as long as its header says, with no\n"
+    "trailing data, that every DOS track holds 5632 bytes and that no\n"
+    "track has more bits than fit in its bytes. Only the header of\n"
+    "each file is read, so a whole archive can be screened quickly\n"
+    "for truncated or damaged images. Each problem found is listed.\n",
+
     /* COMMAND_COMPARE */
     "compare (cmp): Compare two Extended ADF images.\n"
     "usage: compare SOURCE1 SOURCE2\n\n"
@@ -203,6 +954,26 @@ const char *COMMAND_HELPTEXT[] = {
     "Two tracks are considered different if they have different\n"
     "types, different sizes (in either bytes or bits) or the data\n"
     "contained within the track is different.\n",
+
+    /* COMMAND_CONSENSUS */
+    "consensus (vote): Combine several reads of the same disk.\n"
+    "usage: consensus DESTINATION SOURCE1 SOURCE2...\n\n"
+    "Write DESTINATION with each track built from the corresponding\n"
+    "tracks of the SOURCE files. A DOS track is copied from the first\n"
+    "SOURCE which has one. Otherwise the RAW tracks are lined up at\n"
+    "their first sync word and each bit is set to the value most of\n"
+    "them have, a tie going to the earliest SOURCE.\n\n"
+    "The percentage of bits on which all RAW tracks agree is shown\n"
+    "for each track as its confidence.\n",
+
+    /* COMMAND_DIFF */
+    "diff: Write the differences between two Extended ADF images.\n"
+    "usage: diff SOURCE TARGET DELTA\n\n"
+    "Write a DELTA file which the patch command can use to turn\n"
+    "SOURCE into TARGET. Tracks which are unchanged in TARGET are\n"
+    "stored by reference, tracks with a few changed bytes are\n"
+    "stored as the changed bytes only and other tracks are stored\n"
+    "in full.\n",
     
     /* COMMAND_DOSMERGE */
     "dosmerge (dos): Merge two Extended ADF images, preferring DOS tracks.\n"
@@ -215,48 +986,168 @@ const char *COMMAND_HELPTEXT[] = {
     "tracks in SOURCE1 and SOURCE2. Non-DOS tracks from SOURCE2 will\n"
     "be used where there are more tracks in SOURCE2 than SOURCE1.\n",
 
+    /* COMMAND_EXTRACT */
+    "extract: Write tracks of an Extended ADF image to separate files.\n"
+    "usage: extract SOURCE PREFIX TRACKSPEC...\n"
+    "       extract -c SOURCE DESTINATION TRACKSPEC...\n\n"
+    "Write the data of each specified track of SOURCE, as it is\n"
+    "stored, to a file named PREFIX.NNN where NNN is the track\n"
+    "number. With -c, write the tracks one after another to\n"
+    "DESTINATION instead, listing the offset of each in\n"
+    "DESTINATION.lst. TRACKSPECs are as for split.\n",
+
+    /* COMMAND_FROMADF */
+    "fromadf: Convert a standard ADF image to an Extended ADF image.\n"
+    "usage: fromadf SOURCE DESTINATION [TYPE]\n\n"
+    "Write the tracks of the standard ADF image SOURCE to DESTINATION\n"
+    "as tracks of the given TYPE, which may be DOS (the default) or\n"
+    "RAW. DOS tracks hold the sector data as it is. RAW tracks hold\n"
+    "the MFM encoded AmigaDOS track, with sector headers, checksums\n"
+    "and gaps, as it would be written to a disk.\n",
+
     /* COMMAND_HELP */
     "help (?, h): Describe the usage of this program or its commands.\n"
     "usage: help [SUBCOMMAND...]\n",
 
+    /* COMMAND_IDENTIFY */
+    "identify (id): Label the known tracks of Extended ADF images.\n"
+    "usage: identify DATABASE FILENAME...\n"
+    "       identify -s FILENAME...\n\n"
+    "Look up the signature of each track of FILENAME in DATABASE, a\n"
+    "text file with lines of the form 'CRC SIZE LABEL', and print its\n"
+    "label. The signature covers the decoded sectors of a track if\n"
+    "they all decode, and otherwise its bitstream from the first sync\n"
+    "word. With -s, print the signature of each track in the form\n"
+    "used by DATABASE instead.\n",
+
+    /* COMMAND_INDEX */
+    "index: Write a sync index for each of the specified files.\n"
+    "usage: index FILENAME...\n\n"
+    "Scan each RAW track of FILENAME for sync words at any bit\n"
+    "alignment and write their positions, the number of AmigaDOS\n"
+    "sectors which decode and the longest gap between sync words\n"
+    "to FILENAME.idx. The info command uses the index instead of\n"
+    "scanning the file again, until FILENAME's size or header\n"
+    "changes, and writes one itself when it has to scan. Images in\n"
+    "bundles are not indexed.\n",
+
     /* COMMAND_INFO */
     "info: Print the Extended ADF headers of the specified files.\n"
     "usage: info FILENAME...\n\n"
     "The track type, track size in bytes, track size in bits and the\n"
-    "offset of the track data within the Extended ADF file are shown.\n",
+    "offset of the track data within the Extended ADF file are shown.\n"
+    "Each track's class (see merge) is shown, and RAW tracks also\n"
+    "show the number of sync words, the number of AmigaDOS sectors\n"
+    "which decode, the longest gap in bits between sync words and\n"
+    "whether the track is unusually long.\n",
 
     /* COMMAND_MERGE */
     "merge: Merge two Extended ADF images.\n"
     "usage: merge SOURCE1 SOURCE2 DESTINATION\n\n"
-    "Copy SOURCE1 to DESTINATION replacing empty tracks from\n"
-    "SOURCE1 with the corresponding track from SOURCE2. Where a\n"
-    "track is not empty in both SOURCE1 and SOURCE2, the data\n"
-    "from SOURCE1 is used.\n\n"
-    "The resulting image will have the larger of the number of\n"
-    "tracks in SOURCE1 and the number in SOURCE2.\n",
+    "Copy SOURCE1 to DESTINATION, taking a track from SOURCE2 instead\n"
+    "where it is in a better class. From worst to best the classes\n"
+    "(shown by info) are empty, noise, formatted (sync words but no\n"
+    "sectors which decode) and data. DESTINATION has as many tracks\n"
+    "as the larger source.\n\n"
+    "To classify them, the RAW tracks of both sources are read and\n"
+    "decoded before copying, unless they have an up to date index\n"
+    "(see index).\n",
+
+    /* COMMAND_PATCH */
+    "patch: Apply a delta to an Extended ADF image.\n"
+    "usage: patch SOURCE DELTA DESTINATION\n\n"
+    "Write DESTINATION by applying a DELTA created by the diff\n"
+    "command to SOURCE. SOURCE must be the image the delta was\n"
+    "made from; the checksum of every track written is verified.\n",
+
+    /* COMMAND_PIPELINE */
+    "pipeline (pipe): Run several commands without temporary files.\n"
+    "usage: pipeline SCRIPT\n\n"
+    "Run the merge, dosmerge, replace and split commands given one\n"
+    "per line in the SCRIPT file ('-' for standard input). Images\n"
+    "used by a later line are kept in memory, not written. E.g.:\n\n"
+    "dosmerge a.adf b.adf ab.adf\n"
+    "replace ab.adf c.adf abc.adf 40-45\n"
+    "split abc.adf lo.adf=side1 hi.adf=side2\n\n"
+    "writes only lo.adf and hi.adf, copying each of their tracks\n"
+    "straight from a.adf, b.adf or c.adf.\n",
 
     /* COMMAND_REPLACE */
     "replace (rpl): Replace tracks in an Extended ADF image.\n"
     "usage: replace SOURCE1 SOURCE2 DESTINATION TRACKSPEC...\n\n"
     "Copy SOURCE1 to DESTINATION replacing the specified tracks\n"
     "from SOURCE1 with those from SOURCE2.\n\n"
-    "A TRACKSPEC may specify a single track (e.g. \"35\") or a range\n"
-    "of tracks (e.g. \"35-45\"). For example:\n\n"
+    "A TRACKSPEC may specify a single track (e.g. \"35\"), a range\n"
+    "of tracks (e.g. \"35-45\") or a preset as for split. For\n"
+    "example:\n\n"
     "rawadf replace src1.adf src2.adf dest.adf 15 57-59 77\n\n"
     "will copy src1.adf to dest.adf replacing tracks 15, 57, 58, 59\n"
     "and 77 with those from src2.adf.\n",
 
+    /* COMMAND_SECTORMERGE */
+    "sectormerge (sec): Rebuild DOS tracks from several reads of a disk.\n"
+    "usage: sectormerge DESTINATION SOURCE1 SOURCE2...\n\n"
+    "Decode the AmigaDOS sectors of each track of the SOURCE files and\n"
+    "take every sector from the first SOURCE in which it decodes with\n"
+    "good checksums. Tracks whose sectors are all recovered are written\n"
+    "to DESTINATION as DOS tracks. Otherwise the track with the most\n"
+    "good sectors is copied as it is.\n\n"
+    "The number of good sectors in each track written and any which\n"
+    "are missing from it are shown.\n",
+
+    /* COMMAND_SIMILAR */
+    "similar (sim): Group Extended ADF images with similar RAW tracks.\n"
+    "usage: similar FILENAME...\n\n"
+    "Print groups of the specified files ('-' to read the names from\n"
+    "standard input, one per line) whose RAW tracks were likely read\n"
+    "from the same disk or copies of it, with their estimated\n"
+    "similarity to the first file of the group. Reads which differ\n"
+    "in timing or where each track starts are still matched.\n\n"
+    "Each file is read once, so large collections can be grouped\n"
+    "quickly. Files without RAW tracks are ignored.\n",
+
     /* COMMAND_SPLIT */
     "split: Split an Extended ADF image.\n"
-    "usage: split SOURCE DESTINATION TRACKSPEC...\n\n"
-    "Copy SOURCE to DESTINATION including only the specifed tracks.\n"
-    "The resulting image will have empty (zero length) tracks for\n"
-    "all tracks other than the specified tracks.\n\n"
-    "A TRACKSPEC may specify a single track (e.g. \"74\") or a range\n"
-    "of tracks (e.g. \"74-84\"). For example:\n\n"
-    "rawadf split src1.adf dest.adf 12 21 38-47\n\n"
-    "will create dest.adf containing tracks 12, 21 and 38-47 from\n"
-    "src1.adf.\n"
+    "usage: split SOURCE DESTINATION TRACKSPEC...\n"
+    "       split SOURCE DESTINATION=TRACKSPEC[,TRACKSPEC...]...\n\n"
+    "Copy the given tracks of SOURCE (\"-\" for standard input) to\n"
+    "each DESTINATION; all other tracks are left empty. SOURCE is\n"
+    "read once, however many destinations are given.\n\n"
+    "A TRACKSPEC may be a track (\"74\"), a range (\"74-84\"),\n"
+    "a cylinder or cylinder range (\"c37\", \"c37-42\") or a side\n"
+    "(\"side1\", \"side2\"). For example:\n\n"
+    "rawadf split src.adf lo.adf=side1 hi.adf=side2,c0\n",
+
+    /* COMMAND_TOADF */
+    "toadf: Convert an Extended ADF image to a standard ADF image.\n"
+    "usage: toadf SOURCE DESTINATION\n\n"
+    "Write the 160 tracks of SOURCE to DESTINATION as a standard\n"
+    "901120 byte ADF image. DOS tracks are copied as they are and the\n"
+    "AmigaDOS sectors of RAW tracks are decoded.\n\n"
+    "Each sector which is missing or could not be decoded is listed\n"
+    "and written as zeros, and the command then fails.\n",
+
+    /* COMMAND_TOHFE */
+    "tohfe: Convert an Extended ADF image to an HFE image.\n"
+    "usage: tohfe SOURCE DESTINATION\n\n"
+    "Write SOURCE to DESTINATION as an HFE image for HxC and Gotek\n"
+    "floppy emulators. DOS tracks are MFM encoded as AmigaDOS writes\n"
+    "them. RAW tracks are copied, cut to one revolution if they were\n"
+    "read over more. Empty tracks are left unformatted, and a track\n"
+    "of over 32767 bytes is an error.\n\n"
+    "Only one cylinder is held in memory at a time. To convert many\n"
+    "images, run tohfe from a batch file.\n",
+
+    /* COMMAND_TOSCP */
+    "toscp: Convert an Extended ADF image to an SCP flux image.\n"
+    "usage: toscp SOURCE DESTINATION\n\n"
+    "Write one revolution of each track of SOURCE to DESTINATION as\n"
+    "an SCP flux image, for writing back to disk with flux hardware.\n"
+    "DOS tracks are MFM encoded as AmigaDOS writes them. Bit cells\n"
+    "last 2us, or less on tracks a little too long for a revolution;\n"
+    "longer RAW tracks are cut. Empty tracks are left out.\n\n"
+    "Only one track is held in memory at a time. To convert many\n"
+    "images, run toscp from a batch file.\n"
 };
 
 enum CommandStatus {
@@ -277,6 +1168,22 @@ enum CommandError {
     COMMANDERROR_READERROR,
     COMMANDERROR_SEEKERROR,
     COMMANDERROR_EOFERROR,
+    COMMANDERROR_MANIFESTERROR,
+    COMMANDERROR_DIFFERROR,
+    COMMANDERROR_PATCHERROR,
+    COMMANDERROR_BADSECTORS,
+    COMMANDERROR_INVALIDTRACKTYPE,
+    COMMANDERROR_INVALIDRECIPE,
+    COMMANDERROR_INVALIDPIPELINE,
+    COMMANDERROR_INDEXERROR,
+    COMMANDERROR_BUNDLEERROR,
+    COMMANDERROR_INVALIDSIGNATURES,
+    COMMANDERROR_INVALIDBATCH,
+    COMMANDERROR_JOURNALERROR,
+    COMMANDERROR_JOBSFAILED,
+    COMMANDERROR_EXTRACTERROR,
+    COMMANDERROR_CHECKFAILED,
+    COMMANDERROR_EXPORTERROR,
     COMMANDERROR_INTERNALERROR
 };
 
@@ -316,6 +1223,54 @@ const char *COMMANDERROR_MESSAGES[] = {
     /* COMMANDERROR_EOFERROR */
     "Premature end-of-file",
 
+    /* COMMANDERROR_MANIFESTERROR */
+    "Error writing manifest",
+
+    /* COMMANDERROR_DIFFERROR */
+    "Error while writing delta",
+
+    /* COMMANDERROR_PATCHERROR */
+    "Error while applying delta",
+
+    /* COMMANDERROR_BADSECTORS */
+    "Bad or missing sectors",
+
+    /* COMMANDERROR_INVALIDTRACKTYPE */
+    "Invalid track type (should be DOS or RAW)",
+
+    /* COMMANDERROR_INVALIDRECIPE */
+    "Invalid recipe",
+
+    /* COMMANDERROR_INVALIDPIPELINE */
+    "Invalid pipeline",
+
+    /* COMMANDERROR_INDEXERROR */
+    "Error writing sync index",
+
+    /* COMMANDERROR_BUNDLEERROR */
+    "Error writing bundle",
+
+    /* COMMANDERROR_INVALIDSIGNATURES */
+    "Invalid signature database",
+
+    /* COMMANDERROR_INVALIDBATCH */
+    "Invalid batch",
+
+    /* COMMANDERROR_JOURNALERROR */
+    "Error writing journal",
+
+    /* COMMANDERROR_JOBSFAILED */
+    "Some jobs failed",
+
+    /* COMMANDERROR_EXTRACTERROR */
+    "Error while extracting tracks",
+
+    /* COMMANDERROR_CHECKFAILED */
+    "Problems found",
+
+    /* COMMANDERROR_EXPORTERROR */
+    "Error while converting image",
+
     /* COMMANDERROR_INTERNALERROR */
     "Internal error"
 };
@@ -328,13 +1283,58 @@ const char *COMMANDERROR_MESSAGES[] = {
 typedef CommandStatus (*CommandTrackSourceCallback)(EADFTrackSource *,
     EADFHeader *, EADFHeader *, void *);
 
+/*
+** A list of TRACKSPECs, argv[start] to argv[argc - 1], kept as they
+** were given until the number of tracks they apply to is known.
+*/
+typedef struct {
+    int argc;
+    char **argv;
+    int start;
+} CommandTrackSpecs;
+
+/*
+** Function pointer to write an extended ADF file to a backend in
+** another format.
+*/
+typedef EADFStatus (*CommandExportFunction)(EADFHeader *, FILE *,
+    const char *, EADFIO *);
+
 Command commandFromString(const char *);
 const char *commandNameFromCommand(Command);
 void commandPrintErrorWithContext(const char *);
+CommandStatus dispatchCommand(Command, int, char **);
 CommandStatus mergeFiles(const char *, const char *, const char *,
     CommandTrackSourceCallback, void *);
-CommandStatus splitFile(const char *, const char *,
-    CommandTrackSourceCallback, void *);
+CommandStatus splitFiles(const char *, unsigned long, char **,
+    const CommandTrackSpecs *);
+CommandStatus writeManifest(const char *, const EADFChecksums *);
+FILE *openImage(const char *);
+int isBundledImage(const char *);
+EADFStatus readImageIO(const char *, EADFIO *, FILE **);
+void closeImageIO(EADFIO *, FILE *);
+int splitLine(char *, char **, int);
+CommandStatus parseTrackSpecs(int, char **, int, EADFTrackSource *,
+    unsigned long, EADFTrackSource);
+CommandStatus parseSplitDestination(char *, CommandTrackSpecs *);
+CommandStatus loadLayouts(EADFHeader *, FILE *, const char *,
+    EADFTrackLayout *, int);
+CommandStatus loadClasses(const char *, EADFTrackClass **);
+CommandStatus replaceTrackSourceCallback(EADFTrackSource *, EADFHeader *,
+    EADFHeader *, void *);
+
+/* Set by the --manifest option */
+int option_manifest = 0;
+
+/* Set by the --stats option */
+enum StatsFormat {
+    STATSFORMAT_NONE,
+    STATSFORMAT_TEXT,
+    STATSFORMAT_JSON
+};
+enum StatsFormat option_stats = STATSFORMAT_NONE;
+
+void printStats(enum StatsFormat, double);
 
 
 void usage()
@@ -380,430 +1380,6830 @@ void bigEndianBytesFromLong(unsigned char buf[4], const long l)
 }
 
 /*
-** Initialise an EADFHeader with the contents of a file.
-**
-** Returns EADFSTATUS_SUCCESS on success. Otherwise EADFSTATUS_FAILURE
-** is returned and eadf_errno is set.
-*/ 
-EADFStatus eadfHeaderInitWithFile(EADFHeader *h, FILE *f)
+** Convert a long to a four-byte char array in little-endian format.
+*/
+void littleEndianBytesFromLong(unsigned char buf[4], const long l)
 {
-    unsigned char buffer[EADF_MAXTRACKS * EADF_BYTESPERRECORD];
-    size_t numRead, fileOffset;
-    unsigned long i;
-
-    fileOffset = 0;
-
-    numRead = fread(h->magic, 1, EADF_MAGICLEN, f);
-    if (numRead < EADF_MAGICLEN) {
-        eadf_errno = EADFERROR_UNKNOWNERROR;
-        if (feof(f)) {
-            eadf_errno = EADFERROR_EOFERROR;
-        } else if (ferror(f)) {
-            eadf_errno = EADFERROR_READERROR;
-        }
-        return EADFSTATUS_FAILURE;
-    }
-
-    h->magic[EADF_MAGICLEN] = '\0';
-    if (strcmp(h->magic, EADF_MAGIC)) {
-        eadf_errno = EADFERROR_WRONGMAGIC;
-        return EADFSTATUS_FAILURE;
-    }
-    fileOffset += numRead;
+    buf[0] = l & 0xff;
+    buf[1] = (l >> 8) & 0xff;
+    buf[2] = (l >> 16) & 0xff;
+    buf[3] = (l >> 24) & 0xff;
+}
 
-    numRead = fread(buffer, 1, 4, f);
-    if (numRead != 4) {
-        eadf_errno = EADFERROR_UNKNOWNERROR;
-        if (feof(f)) {
-            eadf_errno = EADFERROR_EOFERROR;
-        } else if (ferror(f)) {
-            eadf_errno = EADFERROR_READERROR;
+/*
+** Update a running CRC-32 (the polynomial used by zip and PNG) with
+** "len" bytes from "buf". Start with CRC_INIT and pass the result
+** through crcFinal() once all data has been processed.
+*/
+unsigned long crcUpdate(unsigned long crc, const unsigned char *buf,
+    size_t len)
+{
+    static unsigned long table[256];
+    static int tableInitialised = 0;
+    size_t i;
+
+    if (!tableInitialised) {
+        unsigned long n, c;
+        int k;
+
+        for (n = 0; n < 256; n++) {
+            c = n;
+            for (k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xedb88320UL ^ (c >> 1) : c >> 1;
+            }
+            table[n] = c;
         }
-        return EADFSTATUS_FAILURE;
-    }
-    fileOffset += numRead;
-
-    h->numTracks = longFromBigEndianBytes(buffer);
-    if (h->numTracks > EADF_MAXTRACKS) {
-        eadf_errno = EADFERROR_INVALIDNUMTRACKS;
-        return EADFSTATUS_FAILURE;
+        tableInitialised = 1;
     }
 
-    numRead = fread(buffer, 1, h->numTracks * EADF_BYTESPERRECORD, f);
-    if (numRead != h->numTracks * EADF_BYTESPERRECORD) {
-        eadf_errno = EADFERROR_UNKNOWNERROR;
-        if (feof(f)) {
-            eadf_errno = EADFERROR_EOFERROR;
-        } else if (ferror(f)) {
-            eadf_errno = EADFERROR_READERROR;
-        }
-        return EADFSTATUS_FAILURE;
+    for (i = 0; i < len; i++) {
+        crc = table[(crc ^ buf[i]) & 0xff] ^ ((crc >> 8) & 0xffffffUL);
     }
-    fileOffset += numRead;
-
-    for (i = 0; i < h->numTracks; i++) {
-        int bufOffset = i * EADF_BYTESPERRECORD;
 
-        h->trackType[i] = longFromBigEndianBytes(&buffer[bufOffset]);
-        if (h->trackType[i] != EADFTRACKTYPE_DOS
-            && h->trackType[i] != EADFTRACKTYPE_RAW)
-        {
-            eadf_errno = EADFERROR_INVALIDTRACKTYPE;
-            return EADFSTATUS_FAILURE;
-        }
+    return crc;
+}
 
-        h->trackSizeBytes[i] = longFromBigEndianBytes(&buffer[bufOffset + 4]);
-        h->trackSizeBits[i] = longFromBigEndianBytes(&buffer[bufOffset + 8]);
-        h->trackOffset[i] = fileOffset;
+unsigned long crcFinal(unsigned long crc)
+{
+    return (crc ^ 0xffffffffUL) & 0xffffffffUL;
+}
 
-        fileOffset += h->trackSizeBytes[i];
-    }
+/*
+** Scramble the bits of a 32-bit value (the MurmurHash3 finaliser).
+*/
+unsigned long hashMix(unsigned long h)
+{
+    h &= 0xffffffffUL;
+    h ^= h >> 16;
+    h = (h * 0x85ebca6bUL) & 0xffffffffUL;
+    h ^= h >> 13;
+    h = (h * 0xc2b2ae35UL) & 0xffffffffUL;
+    h ^= h >> 16;
+
+    return h;
+}
 
-    return EADFSTATUS_SUCCESS;
+/*
+** Return a time in seconds, for measuring how long things take.
+*/
+double statsClock(void)
+{
+#ifdef HAVE_GETTIMEOFDAY
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
 }
 
 /*
-** Print an EADF error message, based on the eadf_errno global, to stderr.
-**
-** If "context" is not NULL and does not begin with '\0' the
-** error message is prefixed with the contents of "context"
-** followed by a ':' and a space.
+** Add the time since "start" (a value from statsClock()) to a phase.
 */
-void eadfPrintErrorWithContext(const char *context)
+void statsAddTime(EADFPhase phase, double start)
 {
-    if (context != NULL && *context != '\0') {
-        fprintf(stderr, "%s: ", context);
-    }
-    fprintf(stderr, "%s\n", EADFERROR_MESSAGES[eadf_errno]);
+    eadf_stats.phaseTime[phase] += statsClock() - start;
 }
 
 /*
-** Merge two extended ADF files into one.
+** Wrappers around fread(), fwrite() and fseek() which keep count of
+** the I/O performed in eadf_stats.
 */
-EADFStatus eadfMergeFiles(EADFHeader *h1, FILE *f1, const char *n1,
-    EADFHeader *h2, FILE *f2, const char *n2, FILE *dest,
-    const EADFTrackSource trackSources[])
+size_t eadfRead(void *ptr, size_t size, size_t nmemb, FILE *f)
 {
-    unsigned char buffer[EADF_BUFSIZE], *upto;
-    unsigned long numTracks, bufLength;
-    unsigned long track;
+    size_t numRead = fread(ptr, size, nmemb, f);
 
-    strncpy((char *)buffer, EADF_MAGIC, EADF_MAGICLEN);
+    eadf_stats.reads++;
+    eadf_stats.bytesRead += numRead * size;
+    return numRead;
+}
 
-    numTracks = (h1->numTracks > h2->numTracks) ? h1->numTracks:h2->numTracks;
-    bigEndianBytesFromLong(buffer + EADF_MAGICLEN, numTracks);
+size_t eadfWrite(const void *ptr, size_t size, size_t nmemb, FILE *f)
+{
+    size_t numWritten = fwrite(ptr, size, nmemb, f);
 
-    upto = buffer + EADF_MAGICLEN + 4;
-    for (track = 0; track < numTracks; track++) {
-        if (trackSources[track] == EADFTRACKSOURCE_SOURCE1
-            && track < h1->numTracks)
-        {
-            bigEndianBytesFromLong(upto, h1->trackType[track]);
-            bigEndianBytesFromLong(upto + 4, h1->trackSizeBytes[track]);
-            bigEndianBytesFromLong(upto + 8, h1->trackSizeBits[track]);
-        } else if (trackSources[track] == EADFTRACKSOURCE_SOURCE2
-                   && track < h2->numTracks)
-        {
-            bigEndianBytesFromLong(upto, h2->trackType[track]);
-            bigEndianBytesFromLong(upto + 4, h2->trackSizeBytes[track]);
-            bigEndianBytesFromLong(upto + 8, h2->trackSizeBits[track]);
-        } else {
-            bigEndianBytesFromLong(upto, EADFTRACKTYPE_RAW);
-            bigEndianBytesFromLong(upto + 4, 0);
-            bigEndianBytesFromLong(upto + 8, 0);
-        }
-        upto += EADF_BYTESPERRECORD;
+    eadf_stats.writes++;
+    eadf_stats.bytesWritten += numWritten * size;
+    return numWritten;
+}
 
-        bufLength = upto - buffer;
-        if (bufLength > (EADF_BUFSIZE - EADF_BYTESPERRECORD)) {
-            if (fwrite(buffer, 1, bufLength, dest) < bufLength) {
-                eadf_errno = EADFERROR_WRITEERROR;
-                return EADFSTATUS_FAILURE;
-            }
-            upto = buffer;
-        }
-    }
-    
-    bufLength = upto - buffer;
-    if (fwrite(buffer, 1, bufLength, dest) < bufLength) {
+int eadfSeek(FILE *f, long offset, int whence)
+{
+    eadf_stats.seeks++;
+    return fseek(f, offset, whence);
+}
+
+size_t eadfIOFileRead(EADFIO *io, unsigned long offset, void *buf, size_t n)
+{
+    size_t numRead;
+
+    if (io->position != (long)offset
+        && eadfSeek(io->f, offset, SEEK_SET) < 0)
+    {
+        io->position = -1;
+        eadf_errno = EADFERROR_SEEKERROR;
+        return 0;
+    }
+
+    numRead = eadfRead(buf, 1, n, io->f);
+    io->position = offset + numRead;
+    if (numRead < n)
+        eadf_errno = ferror(io->f) ? EADFERROR_READERROR : EADFERROR_EOFERROR;
+    return numRead;
+}
+
+size_t eadfIOFileWrite(EADFIO *io, unsigned long offset, const void *buf,
+    size_t n)
+{
+    size_t numWritten;
+
+    if (io->position != (long)offset
+        && eadfSeek(io->f, offset, SEEK_SET) < 0)
+    {
+        io->position = -1;
+        eadf_errno = EADFERROR_SEEKERROR;
+        return 0;
+    }
+
+    numWritten = eadfWrite(buf, 1, n, io->f);
+    io->position = offset + numWritten;
+    if (numWritten < n)
+        eadf_errno = EADFERROR_WRITEERROR;
+    return numWritten;
+}
+
+long eadfIOFileSize(EADFIO *io)
+{
+    io->position = eadfFileSize(io->f);
+    if (io->position < 0)
+        eadf_errno = EADFERROR_SEEKERROR;
+    return io->position;
+}
+
+size_t eadfIOMemoryRead(EADFIO *io, unsigned long offset, void *buf,
+    size_t n)
+{
+    size_t numRead = 0;
+
+    if (offset < io->length)
+        numRead = (io->length - offset < n) ? io->length - offset : n;
+
+    if (numRead > 0)
+        memcpy(buf, io->data + offset, numRead);
+    if (numRead < n)
+        eadf_errno = EADFERROR_EOFERROR;
+    return numRead;
+}
+
+size_t eadfIOMemoryWrite(EADFIO *io, unsigned long offset, const void *buf,
+    size_t n)
+{
+    unsigned long capacity;
+    unsigned char *more;
+
+    if (n == 0)
+        return 0;
+
+    if (offset + n > io->capacity) {
+        capacity = (2 * io->capacity > offset + n) ? 2 * io->capacity
+                                                  : offset + n;
+        if (!io->owned || (more = realloc(io->data, capacity)) == NULL) {
+            eadf_errno = io->owned ? EADFERROR_NOMEMORY
+                                   : EADFERROR_WRITEERROR;
+            return 0;
+        }
+        io->data = more;
+        io->capacity = capacity;
+    }
+
+    /* Anything skipped over reads back as zeros */
+    if (offset > io->length)
+        memset(io->data + io->length, 0, offset - io->length);
+
+    memcpy(io->data + offset, buf, n);
+    if (offset + n > io->length)
+        io->length = offset + n;
+    return n;
+}
+
+long eadfIOMemorySize(EADFIO *io)
+{
+    return io->length;
+}
+
+/*
+** Set up a backend reading and writing the open file "f", whose current
+** position is taken as already known.
+*/
+void eadfIOInitFile(EADFIO *io, FILE *f)
+{
+    io->read = eadfIOFileRead;
+    io->write = eadfIOFileWrite;
+    io->size = eadfIOFileSize;
+    io->f = f;
+    io->position = ftell(f);
+    io->data = NULL;
+    io->length = 0;
+    io->capacity = 0;
+    io->owned = 0;
+}
+
+/*
+** Set up a backend on the "length" bytes at "data", with room to write
+** up to "capacity" bytes. If "data" is NULL a buffer is allocated as it
+** is written to.
+*/
+void eadfIOInitMemory(EADFIO *io, unsigned char *data, unsigned long length,
+    unsigned long capacity)
+{
+    io->read = eadfIOMemoryRead;
+    io->write = eadfIOMemoryWrite;
+    io->size = eadfIOMemorySize;
+    io->f = NULL;
+    io->position = -1;
+    io->data = data;
+    io->length = (data == NULL) ? 0 : length;
+    io->capacity = (data == NULL) ? 0 : capacity;
+    io->owned = (data == NULL);
+}
+
+/*
+** Free a buffer allocated by a memory backend.
+*/
+void eadfIOFree(EADFIO *io)
+{
+    if (io->owned)
+        free(io->data);
+    io->data = NULL;
+    io->length = 0;
+    io->capacity = 0;
+}
+
+/*
+** Return "size" bytes from the arena, or NULL if there is no memory.
+*/
+void *eadfArenaAlloc(size_t size)
+{
+    EADFArenaBlock *block;
+    size_t blockSize;
+    void *p;
+
+    size = (size + sizeof(EADFArenaAlign) - 1) / sizeof(EADFArenaAlign)
+        * sizeof(EADFArenaAlign);
+
+    if (eadf_arena == NULL || eadf_arena->size - eadf_arena->used < size) {
+        blockSize = (size > EADF_ARENABLOCKSIZE) ? size : EADF_ARENABLOCKSIZE;
+        block = malloc(offsetof(EADFArenaBlock, data) + blockSize);
+        if (block == NULL)
+            return NULL;
+
+        block->next = eadf_arena;
+        block->size = blockSize;
+        block->used = 0;
+        eadf_arena = block;
+    }
+
+    p = (char *)eadf_arena->data + eadf_arena->used;
+    eadf_arena->used += size;
+    return p;
+}
+
+/*
+** Free everything allocated from the arena.
+*/
+void eadfArenaFree(void)
+{
+    EADFArenaBlock *next;
+
+    for (; eadf_arena != NULL; eadf_arena = next) {
+        next = eadf_arena->next;
+        free(eadf_arena);
+    }
+}
+
+/*
+** Set the number of tracks of a header, first giving it a zeroed track
+** table from the arena unless the one it has is big enough.
+*/
+EADFStatus eadfHeaderAlloc(EADFHeader *h, unsigned long numTracks)
+{
+    EADFUInt32 *fields;
+
+    if (numTracks > EADF_MAXTRACKS) {
+        eadf_errno = EADFERROR_INVALIDNUMTRACKS;
+        return EADFSTATUS_FAILURE;
+    }
+
+    if (h->trackType == NULL || h->maxTracks < numTracks) {
+        fields = eadfArenaAlloc(numTracks * (3 * sizeof(EADFUInt32) + 1));
+        if (fields == NULL) {
+            eadf_errno = EADFERROR_NOMEMORY;
+            return EADFSTATUS_FAILURE;
+        }
+
+        h->trackSizeBytes = fields;
+        h->trackSizeBits = fields + numTracks;
+        h->trackOffset = fields + 2 * numTracks;
+        h->trackType = (unsigned char *)(fields + 3 * numTracks);
+        h->maxTracks = numTracks;
+    }
+
+    h->numTracks = numTracks;
+    memset(h->trackSizeBytes, 0, numTracks * sizeof(EADFUInt32));
+    memset(h->trackSizeBits, 0, numTracks * sizeof(EADFUInt32));
+    memset(h->trackOffset, 0, numTracks * sizeof(EADFUInt32));
+    memset(h->trackType, 0, numTracks);
+    return EADFSTATUS_SUCCESS;
+}
+
+/*
+** Set the number of tracks of a set of checksums, first giving it
+** zeroed per-track arrays from the arena unless it has big enough ones.
+*/
+EADFStatus eadfChecksumsAlloc(EADFChecksums *sums, unsigned long numTracks)
+{
+    EADFUInt32 *fields;
+
+    if (numTracks > EADF_MAXTRACKS) {
+        eadf_errno = EADFERROR_INVALIDNUMTRACKS;
+        return EADFSTATUS_FAILURE;
+    }
+
+    if (sums->trackCrc == NULL || sums->maxTracks < numTracks) {
+        fields = eadfArenaAlloc(numTracks * 2 * sizeof(EADFUInt32));
+        if (fields == NULL) {
+            eadf_errno = EADFERROR_NOMEMORY;
+            return EADFSTATUS_FAILURE;
+        }
+
+        sums->trackCrc = fields;
+        sums->trackSizeBytes = fields + numTracks;
+        sums->maxTracks = numTracks;
+    }
+
+    sums->numTracks = numTracks;
+    memset(sums->trackCrc, 0, numTracks * sizeof(EADFUInt32));
+    memset(sums->trackSizeBytes, 0, numTracks * sizeof(EADFUInt32));
+    return EADFSTATUS_SUCCESS;
+}
+
+/*
+** Make "dest" a copy of the header "src" with a track table of its own.
+*/
+EADFStatus eadfHeaderCopy(EADFHeader *dest, const EADFHeader *src)
+{
+    unsigned long n = src->numTracks;
+
+    if (eadfHeaderAlloc(dest, n) != EADFSTATUS_SUCCESS)
+        return EADFSTATUS_FAILURE;
+
+    strcpy(dest->magic, src->magic);
+    memcpy(dest->trackType, src->trackType, n);
+    memcpy(dest->trackSizeBytes, src->trackSizeBytes, n * sizeof(EADFUInt32));
+    memcpy(dest->trackSizeBits, src->trackSizeBits, n * sizeof(EADFUInt32));
+    memcpy(dest->trackOffset, src->trackOffset, n * sizeof(EADFUInt32));
+    return EADFSTATUS_SUCCESS;
+}
+
+/*
+** Initialise an EADFHeader with the contents of a file.
+**
+** Returns EADFSTATUS_SUCCESS on success. Otherwise EADFSTATUS_FAILURE
+** is returned and eadf_errno is set.
+*/ 
+EADFStatus eadfHeaderInitWithFile(EADFHeader *h, FILE *f)
+{
+    EADFIO io;
+    long position;
+
+    /* Track offsets are absolute, so images in bundles can be read */
+    eadfIOInitFile(&io, f);
+    position = (io.position < 0) ? 0 : io.position;
+
+    return eadfHeaderInitWithIO(h, &io, position);
+}
+
+/*
+** Initialise an EADFHeader with the image starting at "offset" of a
+** backend, as for eadfHeaderInitWithFile().
+*/
+EADFStatus eadfHeaderInitWithIO(EADFHeader *h, EADFIO *io,
+    unsigned long offset)
+{
+    double start = statsClock();
+    EADFStatus status;
+
+    status = eadfHeaderReadRecords(h, io, offset);
+    statsAddTime(EADFPHASE_HEADER, start);
+
+    return status;
+}
+
+/*
+** Read the magic, number of tracks and track records for
+** eadfHeaderInitWithIO().
+*/
+EADFStatus eadfHeaderReadRecords(EADFHeader *h, EADFIO *io,
+    unsigned long offset)
+{
+    unsigned char *buffer, count[4];
+    size_t numRead, fileOffset = offset;
+    unsigned long i, numTracks, type;
+
+    numRead = io->read(io, fileOffset, h->magic, EADF_MAGICLEN);
+    if (numRead < EADF_MAGICLEN)
+        return EADFSTATUS_FAILURE;
+
+    h->magic[EADF_MAGICLEN] = '\0';
+    if (strcmp(h->magic, EADF_MAGIC)) {
+        eadf_errno = EADFERROR_WRONGMAGIC;
+        return EADFSTATUS_FAILURE;
+    }
+    fileOffset += numRead;
+
+    numRead = io->read(io, fileOffset, count, 4);
+    if (numRead != 4)
+        return EADFSTATUS_FAILURE;
+    fileOffset += numRead;
+
+    numTracks = longFromBigEndianBytes(count);
+    if (eadfHeaderAlloc(h, numTracks) != EADFSTATUS_SUCCESS)
+        return EADFSTATUS_FAILURE;
+
+    if ((buffer = malloc(numTracks * EADF_BYTESPERRECORD + 1)) == NULL) {
+        eadf_errno = EADFERROR_NOMEMORY;
+        return EADFSTATUS_FAILURE;
+    }
+
+    numRead = io->read(io, fileOffset, buffer,
+        numTracks * EADF_BYTESPERRECORD);
+    if (numRead != numTracks * EADF_BYTESPERRECORD) {
+        free(buffer);
+        return EADFSTATUS_FAILURE;
+    }
+    fileOffset += numRead;
+
+    for (i = 0; i < numTracks; i++) {
+        unsigned char *rec = buffer + i * EADF_BYTESPERRECORD;
+
+        type = longFromBigEndianBytes(rec);
+        if (type != EADFTRACKTYPE_DOS && type != EADFTRACKTYPE_RAW) {
+            free(buffer);
+            eadf_errno = EADFERROR_INVALIDTRACKTYPE;
+            return EADFSTATUS_FAILURE;
+        }
+
+        h->trackType[i] = type;
+        h->trackSizeBytes[i] = longFromBigEndianBytes(rec + 4);
+        h->trackSizeBits[i] = longFromBigEndianBytes(rec + 8);
+        h->trackOffset[i] = fileOffset;
+
+        fileOffset += h->trackSizeBytes[i];
+    }
+
+    free(buffer);
+    return EADFSTATUS_SUCCESS;
+}
+
+/*
+** Print an EADF error message, based on the eadf_errno global, to stderr.
+**
+** If "context" is not NULL and does not begin with '\0' the
+** error message is prefixed with the contents of "context"
+** followed by a ':' and a space.
+*/
+void eadfPrintErrorWithContext(const char *context)
+{
+    if (context != NULL && *context != '\0') {
+        fprintf(stderr, "%s: ", context);
+    }
+    fprintf(stderr, "%s\n", EADFERROR_MESSAGES[eadf_errno]);
+}
+
+/*
+** Return the index of the source file a track of an assembled file is
+** taken from, or -1 if the track is empty.
+*/
+long eadfTrackSourceIndex(unsigned long numSources, EADFHeader **hs,
+    const EADFTrackSource *trackSources, unsigned long track)
+{
+    long source;
+
+    if (trackSources[track] == EADFTRACKSOURCE_NONE)
+        return -1;
+
+    source = trackSources[track] - EADFTRACKSOURCE_SOURCE1;
+    if (source < 0 || (unsigned long)source >= numSources
+        || track >= hs[source]->numTracks)
+    {
+        return -1;
+    }
+
+    return source;
+}
+
+/*
+** Copy tracks "first" to "last" of "h", which are stored one after
+** another in "src", to "destOffset" of "dest" through the "bufSize"
+** byte "buffer". If "sums" is not NULL the checksum of each track is
+** set and *fileCrc is updated with the data copied.
+*/
+EADFStatus eadfCopyTracks(EADFHeader *h, EADFIO *src, EADFIO *dest,
+    unsigned long destOffset, unsigned long first, unsigned long last,
+    unsigned char *buffer, unsigned long bufSize, EADFChecksums *sums,
+    unsigned long *fileCrc)
+{
+    unsigned long numBytes = 0, track, left, count, done, part;
+    unsigned long trackCrc = CRC_INIT, offset = h->trackOffset[first];
+
+    for (track = first; track <= last; track++) {
+        numBytes += h->trackSizeBytes[track];
+    }
+
+    track = first;
+    left = h->trackSizeBytes[first];
+    for (; numBytes > 0; numBytes -= count) {
+        count = (numBytes > bufSize) ? bufSize : numBytes;
+
+        if (src->read(src, offset, buffer, count) < count
+            || dest->write(dest, destOffset, buffer, count) < count)
+        {
+            return EADFSTATUS_FAILURE;
+        }
+        offset += count;
+        destOffset += count;
+
+        if (sums == NULL)
+            continue;
+
+        /* A piece of the run may hold the end of one track and the start
+           of the next */
+        *fileCrc = crcUpdate(*fileCrc, buffer, count);
+        for (done = 0; done < count; done += part) {
+            while (left == 0) {
+                sums->trackCrc[track++] = crcFinal(trackCrc);
+                trackCrc = CRC_INIT;
+                left = h->trackSizeBytes[track];
+            }
+
+            part = (count - done < left) ? count - done : left;
+            trackCrc = crcUpdate(trackCrc, buffer + done, part);
+            left -= part;
+        }
+    }
+
+    for (; sums != NULL && track <= last; track++) {
+        sums->trackCrc[track] = crcFinal(trackCrc);
+        trackCrc = CRC_INIT;
+    }
+
+    return EADFSTATUS_SUCCESS;
+}
+
+#ifdef HAVE_PTHREAD
+/*
+** Copy the runs of an EADFCopyThread with pread() and pwrite(), which
+** leave the positions of the files alone and so need no locking.
+*/
+void *eadfCopyRunsThread(void *arg)
+{
+    EADFCopyThread *t = (EADFCopyThread *)arg;
+    const EADFCopyRun *run;
+    unsigned char *buffer;
+    unsigned long i, done, count;
+    ssize_t n;
+
+    if ((buffer = malloc(EADF_COPYBUFSIZE)) == NULL) {
+        t->error = EADFERROR_NOMEMORY;
+        return NULL;
+    }
+
+    for (i = t->first; i < t->numRuns; i += EADF_COPYTHREADS) {
+        run = &t->runs[i];
+        for (done = 0; done < run->numBytes; done += count) {
+            count = run->numBytes - done;
+            if (count > EADF_COPYBUFSIZE)
+                count = EADF_COPYBUFSIZE;
+
+            n = pread(run->srcFd, buffer, count, run->offset + done);
+            t->reads++;
+            if (n <= 0) {
+                t->error = (n < 0) ? EADFERROR_READERROR
+                                   : EADFERROR_EOFERROR;
+                free(buffer);
+                return NULL;
+            }
+            count = n;
+            t->bytesRead += count;
+
+            n = pwrite(t->destFd, buffer, count,
+                run->destOffset + done);
+            t->writes++;
+            if (n < 0 || (unsigned long)n < count) {
+                t->error = EADFERROR_WRITEERROR;
+                free(buffer);
+                return NULL;
+            }
+            t->bytesWritten += count;
+        }
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+/*
+** Copy "numRuns" runs of tracks to the file backend "dest" with up to
+** EADF_COPYTHREADS threads at once. Every offset is already known, so
+** the runs may be written in any order.
+*/
+EADFStatus eadfCopyRuns(const EADFCopyRun *runs, unsigned long numRuns,
+    EADFIO *dest)
+{
+    EADFCopyThread threads[EADF_COPYTHREADS];
+    pthread_t ids[EADF_COPYTHREADS];
+    EADFStatus status = EADFSTATUS_SUCCESS;
+    unsigned long i, numThreads, numStarted;
+
+    /* The header is still in the buffer of the destination's stream */
+    if (fflush(dest->f) != 0) {
         eadf_errno = EADFERROR_WRITEERROR;
         return EADFSTATUS_FAILURE;
     }
+    dest->position = -1;
+
+    numThreads = (numRuns < EADF_COPYTHREADS) ? numRuns : EADF_COPYTHREADS;
+    for (i = 0; i < numThreads; i++) {
+        threads[i].runs = runs;
+        threads[i].numRuns = numRuns;
+        threads[i].first = i;
+        threads[i].destFd = fileno(dest->f);
+        threads[i].bytesRead = 0;
+        threads[i].bytesWritten = 0;
+        threads[i].reads = 0;
+        threads[i].writes = 0;
+        threads[i].error = EADFERROR_NOERROR;
+    }
+
+    for (numStarted = 0; numStarted < numThreads; numStarted++) {
+        if (pthread_create(&ids[numStarted], NULL, eadfCopyRunsThread,
+                &threads[numStarted]) != 0)
+        {
+            break;
+        }
+    }
+
+    /* If fewer threads could be started, this one copies the rest */
+    for (i = numStarted; i < numThreads; i++) {
+        eadfCopyRunsThread(&threads[i]);
+    }
+
+    for (i = 0; i < numThreads; i++) {
+        if (i < numStarted)
+            pthread_join(ids[i], NULL);
+
+        eadf_stats.bytesRead += threads[i].bytesRead;
+        eadf_stats.bytesWritten += threads[i].bytesWritten;
+        eadf_stats.reads += threads[i].reads;
+        eadf_stats.writes += threads[i].writes;
+        if (threads[i].error != EADFERROR_NOERROR) {
+            eadf_errno = threads[i].error;
+            status = EADFSTATUS_FAILURE;
+        }
+    }
+
+    return status;
+}
+#endif
+
+/*
+** Write an extended ADF file to "dest" whose tracks are taken from any
+** number of sources. trackSources[track] is EADFTRACKSOURCE_NONE
+** for an empty track or EADFTRACKSOURCE_SOURCE1 + n to take the track
+** from source n; tracks past the end of their source are also empty.
+** The result has "numTracks" tracks, or if that is zero as many tracks
+** as the largest source.
+**
+** The destination is written in one sequential pass, and as tracks are
+** stored in order each source is read in order of offset. A file
+** source is only seeked when the next track wanted from it is not
+** adjacent to the last one read, and consecutive tracks which are
+** adjacent in their source are copied as a single run through a large
+** buffer. When built with HAVE_PTHREAD and every backend is a file,
+** the runs are instead copied by eadfCopyRuns() with several threads,
+** unless checksums are wanted, as those are computed in file order.
+**
+** If "sums" is not NULL it is filled in with the CRC-32 checksums of
+** the data written to "dest", computed as it is copied.
+*/
+EADFStatus eadfAssembleFiles(unsigned long numSources, EADFHeader **hs,
+    EADFIO **ios, EADFIO *dest, unsigned long numTracks,
+    const EADFTrackSource *trackSources, EADFChecksums *sums)
+{
+    unsigned char buffer[EADF_BUFSIZE], *upto, *copyBuffer;
+    unsigned long bufLength, i, written = 0;
+    unsigned long track, last, fileCrc = CRC_INIT;
+#ifdef HAVE_PTHREAD
+    EADFCopyRun *runs = NULL;
+    unsigned long numRuns = 0;
+#endif
+
+    if ((copyBuffer = malloc(EADF_COPYBUFSIZE)) == NULL) {
+        eadf_errno = EADFERROR_NOMEMORY;
+        return EADFSTATUS_FAILURE;
+    }
+
+    if (numTracks == 0) {
+        for (i = 0; i < numSources; i++) {
+            if (hs[i]->numTracks > numTracks)
+                numTracks = hs[i]->numTracks;
+        }
+    }
+
+    if (sums != NULL) {
+        if (eadfChecksumsAlloc(sums, numTracks) != EADFSTATUS_SUCCESS) {
+            free(copyBuffer);
+            return EADFSTATUS_FAILURE;
+        }
+        sums->fileSize = 0;
+    }
+
+    strncpy((char *)buffer, EADF_MAGIC, EADF_MAGICLEN);
+    bigEndianBytesFromLong(buffer + EADF_MAGICLEN, numTracks);
+
+    upto = buffer + EADF_MAGICLEN + 4;
+    for (track = 0; track < numTracks; track++) {
+        long source = eadfTrackSourceIndex(numSources, hs, trackSources,
+            track);
+
+        if (source >= 0) {
+            bigEndianBytesFromLong(upto, hs[source]->trackType[track]);
+            bigEndianBytesFromLong(upto + 4,
+                hs[source]->trackSizeBytes[track]);
+            bigEndianBytesFromLong(upto + 8, hs[source]->trackSizeBits[track]);
+        } else {
+            bigEndianBytesFromLong(upto, EADFTRACKTYPE_RAW);
+            bigEndianBytesFromLong(upto + 4, 0);
+            bigEndianBytesFromLong(upto + 8, 0);
+        }
+        upto += EADF_BYTESPERRECORD;
+
+        bufLength = upto - buffer;
+        if (bufLength > (EADF_BUFSIZE - EADF_BYTESPERRECORD)) {
+            if (dest->write(dest, written, buffer, bufLength) < bufLength) {
+                free(copyBuffer);
+                return EADFSTATUS_FAILURE;
+            }
+            written += bufLength;
+            if (sums != NULL) {
+                fileCrc = crcUpdate(fileCrc, buffer, bufLength);
+                sums->fileSize += bufLength;
+            }
+            upto = buffer;
+        }
+    }
+    
+    bufLength = upto - buffer;
+    if (dest->write(dest, written, buffer, bufLength) < bufLength) {
+        free(copyBuffer);
+        return EADFSTATUS_FAILURE;
+    }
+    written += bufLength;
+    if (sums != NULL) {
+        fileCrc = crcUpdate(fileCrc, buffer, bufLength);
+        sums->fileSize += bufLength;
+    }
+
+#ifdef HAVE_PTHREAD
+    /* If there is no memory for the runs, they are copied here instead */
+    if (sums == NULL && numTracks > 0 && dest->f != NULL) {
+        int files = 1;
+
+        for (i = 0; i < numSources; i++) {
+            if (ios[i]->f == NULL)
+                files = 0;
+        }
+
+        if (files)
+            runs = eadfArenaAlloc(numTracks * sizeof(EADFCopyRun));
+    }
+#endif
+
+    for (track = 0; track < numTracks; track = last + 1) {
+        unsigned long offset, numBytes;
+        long source;
+
+        last = track;
+        source = eadfTrackSourceIndex(numSources, hs, trackSources, track);
+        if (source < 0)
+            continue;
+
+        /* Tracks stored one after another in a source are copied as one */
+        offset = hs[source]->trackOffset[track];
+        numBytes = hs[source]->trackSizeBytes[track];
+        while (last + 1 < numTracks
+               && eadfTrackSourceIndex(numSources, hs, trackSources, last + 1)
+                  == source
+               && hs[source]->trackOffset[last + 1] == offset + numBytes)
+        {
+            last++;
+            numBytes += hs[source]->trackSizeBytes[last];
+        }
+
+        if (sums != NULL) {
+            for (i = track; i <= last; i++) {
+                sums->trackSizeBytes[i] = hs[source]->trackSizeBytes[i];
+            }
+            sums->fileSize += numBytes;
+        }
+
+#ifdef HAVE_PTHREAD
+        if (runs != NULL) {
+            runs[numRuns].srcFd = fileno(ios[source]->f);
+            runs[numRuns].offset = offset;
+            runs[numRuns].destOffset = written;
+            runs[numRuns].numBytes = numBytes;
+            numRuns++;
+            written += numBytes;
+            continue;
+        }
+#endif
+
+        if (eadfCopyTracks(hs[source], ios[source], dest, written, track,
+                last, copyBuffer, EADF_COPYBUFSIZE, sums, &fileCrc)
+            != EADFSTATUS_SUCCESS)
+        {
+            free(copyBuffer);
+            return EADFSTATUS_FAILURE;
+        }
+        written += numBytes;
+    }
+
+#ifdef HAVE_PTHREAD
+    if (runs != NULL && eadfCopyRuns(runs, numRuns, dest)
+        != EADFSTATUS_SUCCESS)
+    {
+        free(copyBuffer);
+        return EADFSTATUS_FAILURE;
+    }
+#endif
+
+    if (sums != NULL) {
+        sums->fileCrc = crcFinal(fileCrc);
+    }
+
+    free(copyBuffer);
+    return EADFSTATUS_SUCCESS;
+}
+
+/*
+** Merge two extended ADF files into one, taking each track from the
+** source given by "trackSources" as described for eadfAssembleFiles().
+**
+** If "sums" is not NULL it is filled in with the CRC-32 checksums of
+** the data written to "dest", computed as it is copied.
+*/
+EADFStatus eadfMergeFiles(EADFHeader *h1, EADFIO *io1, EADFHeader *h2,
+    EADFIO *io2, EADFIO *dest, const EADFTrackSource trackSources[],
+    EADFChecksums *sums)
+{
+    EADFHeader *hs[2];
+    EADFIO *ios[2];
+
+    hs[0] = h1;
+    hs[1] = h2;
+    ios[0] = io1;
+    ios[1] = io2;
+
+    return eadfAssembleFiles(2, hs, ios, dest, 0, trackSources, sums);
+}
+
+/*
+** Copy tracks of an extended ADF file to several destinations at once.
+** A track is copied to dests[i] if trackSources[i][track] is
+** EADFTRACKSOURCE_SOURCE1; all other tracks of that destination are
+** left empty.
+**
+** Each wanted track is read from the source once, in offset order, and
+** each piece read is written to every destination which wants it.
+**
+** If "sums" is not NULL, each of its entries which is not NULL is
+** filled in with the CRC-32 checksums of the data written to the
+** corresponding destination.
+*/
+EADFStatus eadfSplitFiles(EADFHeader *h, EADFIO *io, unsigned long numDests,
+    EADFIO **dests, EADFTrackSource **trackSources, EADFChecksums **sums)
+{
+    unsigned char buffer[EADF_BUFSIZE], *header;
+    unsigned long track, headerLength, i, *written;
+
+    headerLength = EADF_MAGICLEN + 4 + h->numTracks * EADF_BYTESPERRECORD;
+    header = malloc(headerLength);
+    written = malloc(numDests * sizeof(unsigned long));
+    if (header == NULL || written == NULL) {
+        free(header);
+        free(written);
+        eadf_errno = EADFERROR_NOMEMORY;
+        return EADFSTATUS_FAILURE;
+    }
+
+    for (i = 0; i < numDests; i++) {
+        EADFChecksums *s = (sums != NULL) ? sums[i] : NULL;
+
+        if (s != NULL
+            && eadfChecksumsAlloc(s, h->numTracks) != EADFSTATUS_SUCCESS)
+        {
+            free(header);
+            free(written);
+            return EADFSTATUS_FAILURE;
+        }
+
+        memcpy(header, EADF_MAGIC, EADF_MAGICLEN);
+        bigEndianBytesFromLong(header + EADF_MAGICLEN, h->numTracks);
+        for (track = 0; track < h->numTracks; track++) {
+            unsigned char *rec = header + EADF_MAGICLEN + 4
+                + track * EADF_BYTESPERRECORD;
+
+            if (trackSources[i][track] == EADFTRACKSOURCE_SOURCE1) {
+                bigEndianBytesFromLong(rec, h->trackType[track]);
+                bigEndianBytesFromLong(rec + 4, h->trackSizeBytes[track]);
+                bigEndianBytesFromLong(rec + 8, h->trackSizeBits[track]);
+            } else {
+                bigEndianBytesFromLong(rec, EADFTRACKTYPE_RAW);
+                bigEndianBytesFromLong(rec + 4, 0);
+                bigEndianBytesFromLong(rec + 8, 0);
+            }
+        }
+
+        if (dests[i]->write(dests[i], 0, header, headerLength)
+            < headerLength)
+        {
+            free(header);
+            free(written);
+            return EADFSTATUS_FAILURE;
+        }
+        written[i] = headerLength;
+
+        /* The checksums are kept unfinished until everything is copied */
+        if (s != NULL) {
+            s->fileSize = headerLength;
+            s->fileCrc = crcUpdate(CRC_INIT, header, headerLength);
+        }
+    }
+    free(header);
+
+    for (track = 0; track < h->numTracks; track++) {
+        unsigned long offset;
+        long numBytes;
+        int wanted = 0;
+
+        for (i = 0; i < numDests; i++) {
+            if (trackSources[i][track] != EADFTRACKSOURCE_SOURCE1)
+                continue;
+
+            wanted = 1;
+            if (sums != NULL && sums[i] != NULL) {
+                sums[i]->trackCrc[track] = CRC_INIT;
+                sums[i]->trackSizeBytes[track] = h->trackSizeBytes[track];
+                sums[i]->fileSize += h->trackSizeBytes[track];
+            }
+        }
+
+        if (!wanted)
+            continue;
+
+        offset = h->trackOffset[track];
+        numBytes = h->trackSizeBytes[track];
+        for (; numBytes > 0; numBytes -= EADF_BUFSIZE) {
+            unsigned int count;
+            count = (numBytes > EADF_BUFSIZE) ? EADF_BUFSIZE : numBytes;
+
+            if (io->read(io, offset, buffer, count) < count) {
+                free(written);
+                return EADFSTATUS_FAILURE;
+            }
+            offset += count;
+
+            for (i = 0; i < numDests; i++) {
+                if (trackSources[i][track] != EADFTRACKSOURCE_SOURCE1)
+                    continue;
+
+                if (dests[i]->write(dests[i], written[i], buffer, count)
+                    < count)
+                {
+                    free(written);
+                    return EADFSTATUS_FAILURE;
+                }
+                written[i] += count;
+
+                if (sums != NULL && sums[i] != NULL) {
+                    sums[i]->trackCrc[track] = crcUpdate(
+                        sums[i]->trackCrc[track], buffer, count);
+                    sums[i]->fileCrc = crcUpdate(sums[i]->fileCrc, buffer,
+                        count);
+                }
+            }
+        }
+
+        for (i = 0; i < numDests; i++) {
+            if (sums != NULL && sums[i] != NULL
+                && trackSources[i][track] == EADFTRACKSOURCE_SOURCE1)
+            {
+                sums[i]->trackCrc[track] = crcFinal(sums[i]->trackCrc[track]);
+            }
+        }
+    }
+
+    for (i = 0; i < numDests; i++) {
+        if (sums != NULL && sums[i] != NULL)
+            sums[i]->fileCrc = crcFinal(sums[i]->fileCrc);
+    }
+
+    free(written);
+    return EADFSTATUS_SUCCESS;
+}
+
+/*
+** Copy the tracks of an extended ADF file marked EADFTRACKSOURCE_SOURCE1
+** in "trackSources" to "dest", leaving all other tracks empty.
+**
+** If "sums" is not NULL it is filled in with the CRC-32 checksums of
+** the data written to "dest", computed as it is copied.
+*/
+EADFStatus eadfSplitFile(EADFHeader *h, EADFIO *io, EADFIO *dest,
+    const EADFTrackSource *trackSources, EADFChecksums *sums)
+{
+    EADFTrackSource *sources = (EADFTrackSource *)trackSources;
+
+    return eadfSplitFiles(h, io, 1, &dest, &sources, &sums);
+}
+
+/*
+** Read the data of the specified track into "buffer", which must be
+** large enough to hold h->trackSizeBytes[track] bytes.
+*/
+EADFStatus eadfReadTrack(EADFHeader *h, FILE *f, const char *n,
+    unsigned long track, unsigned char *buffer)
+{
+    size_t numBytes = h->trackSizeBytes[track];
+
+    if (eadfSeek(f, h->trackOffset[track], SEEK_SET) < 0) {
+        perror(n);
+        eadf_errno = EADFERROR_SEEKERROR;
+        return EADFSTATUS_FAILURE;
+    }
+
+    if (eadfRead(buffer, 1, numBytes, f) < numBytes) {
+        eadf_errno = EADFERROR_UNKNOWNERROR;
+        if (feof(f)) {
+            eadf_errno = EADFERROR_EOFERROR;
+        } else if (ferror(f)) {
+            eadf_errno = EADFERROR_READERROR;
+        }
+        return EADFSTATUS_FAILURE;
+    }
+
+    return EADFSTATUS_SUCCESS;
+}
+
+/*
+** Return the CRC-32 of the header of an extended ADF file as it
+** would be stored on disk.
+*/
+unsigned long eadfHeaderCrc(const EADFHeader *h)
+{
+    unsigned char buf[EADF_BYTESPERRECORD];
+    unsigned long crc, track;
+
+    crc = crcUpdate(CRC_INIT, (const unsigned char *)EADF_MAGIC,
+        EADF_MAGICLEN);
+    bigEndianBytesFromLong(buf, h->numTracks);
+    crc = crcUpdate(crc, buf, 4);
+
+    for (track = 0; track < h->numTracks; track++) {
+        bigEndianBytesFromLong(buf, h->trackType[track]);
+        bigEndianBytesFromLong(buf + 4, h->trackSizeBytes[track]);
+        bigEndianBytesFromLong(buf + 8, h->trackSizeBits[track]);
+        crc = crcUpdate(crc, buf, EADF_BYTESPERRECORD);
+    }
+
+    return crcFinal(crc);
+}
+
+/*
+** Return the largest track size in bytes of an extended ADF file.
+*/
+unsigned long eadfMaxTrackSize(const EADFHeader *h)
+{
+    unsigned long track, max = 0;
+
+    for (track = 0; track < h->numTracks; track++) {
+        if (h->trackSizeBytes[track] > max)
+            max = h->trackSizeBytes[track];
+    }
+
+    return max;
+}
+
+/*
+** Return the size in bytes an extended ADF file should have: that of
+** its header followed by the data of every track.
+*/
+unsigned long eadfExpectedSize(const EADFHeader *h)
+{
+    unsigned long track, size;
+
+    size = EADF_MAGICLEN + 4 + h->numTracks * EADF_BYTESPERRECORD;
+    for (track = 0; track < h->numTracks; track++) {
+        size += h->trackSizeBytes[track];
+    }
+
+    return size;
+}
+
+/*
+** Work out the runs of bytes in "target" which differ from "base",
+** both "n" bytes long, and write them to "dest" as a sequence of
+** big-endian offset and length pairs each followed by the new bytes.
+** Runs separated by fewer than EADFDELTA_MINGAP equal bytes are
+** joined together as that is cheaper than starting a new run.
+**
+** If "dest" is NULL nothing is written. In either case the number of
+** bytes the runs take up is stored in *length.
+*/
+EADFStatus eadfWriteDeltaRuns(const unsigned char *base,
+    const unsigned char *target, unsigned long n, FILE *dest,
+    unsigned long *length)
+{
+    unsigned char buf[8];
+    unsigned long start, end, i;
+
+    *length = 0;
+    for (i = 0; i < n; ) {
+        if (base[i] == target[i]) {
+            i++;
+            continue;
+        }
+
+        start = i;
+        end = i + 1;
+        for (i = end; i < n && i < end + EADFDELTA_MINGAP; i++) {
+            if (base[i] != target[i])
+                end = i + 1;
+        }
+        i = end;
+
+        *length += 8 + (end - start);
+        if (dest == NULL)
+            continue;
+
+        bigEndianBytesFromLong(buf, start);
+        bigEndianBytesFromLong(buf + 4, end - start);
+        if (eadfWrite(buf, 1, 8, dest) < 8
+            || eadfWrite(target + start, 1, end - start, dest) < end - start)
+        {
+            eadf_errno = EADFERROR_WRITEERROR;
+            return EADFSTATUS_FAILURE;
+        }
+    }
+
+    return EADFSTATUS_SUCCESS;
+}
+
+/*
+** Write the delta records and data of eadfDiffFiles() using the
+** supplied buffers.
+*/
+EADFStatus eadfWriteDelta(EADFHeader *h1, FILE *f1, const char *n1,
+    EADFHeader *h2, FILE *f2, const char *n2, FILE *dest,
+    unsigned char *records, unsigned char *buf1, unsigned char *buf2)
+{
+    unsigned char header[EADFDELTA_HEADERSIZE], *rec;
+    unsigned long track, recordsLength;
+
+    memcpy(header, EADFDELTA_MAGIC, EADF_MAGICLEN);
+    bigEndianBytesFromLong(header + EADF_MAGICLEN, h1->numTracks);
+    bigEndianBytesFromLong(header + EADF_MAGICLEN + 4, eadfHeaderCrc(h1));
+    bigEndianBytesFromLong(header + EADF_MAGICLEN + 8, h2->numTracks);
+
+    /* The records are filled in once the data has been written */
+    recordsLength = h2->numTracks * EADFDELTA_BYTESPERRECORD;
+    memset(records, 0, recordsLength);
+    if (eadfWrite(header, 1, EADFDELTA_HEADERSIZE, dest) < EADFDELTA_HEADERSIZE
+        || eadfWrite(records, 1, recordsLength, dest) < recordsLength)
+    {
+        eadf_errno = EADFERROR_WRITEERROR;
+        return EADFSTATUS_FAILURE;
+    }
+
+    for (track = 0; track < h2->numTracks; track++) {
+        unsigned long numBytes = h2->trackSizeBytes[track];
+        unsigned long op = EADFDELTAOP_FULL, ref = 0, length = numBytes;
+
+        if (eadfReadTrack(h2, f2, n2, track, buf2) != EADFSTATUS_SUCCESS)
+            return EADFSTATUS_FAILURE;
+
+        if (track < h1->numTracks && h1->trackSizeBytes[track] == numBytes) {
+            if (eadfReadTrack(h1, f1, n1, track, buf1) != EADFSTATUS_SUCCESS)
+                return EADFSTATUS_FAILURE;
+
+            ref = track;
+            if (memcmp(buf1, buf2, numBytes) == 0) {
+                op = EADFDELTAOP_COPY;
+                length = 0;
+            } else {
+                eadfWriteDeltaRuns(buf1, buf2, numBytes, NULL, &length);
+                if (length < numBytes) {
+                    op = EADFDELTAOP_RUNS;
+                } else {
+                    length = numBytes;
+                }
+            }
+        }
+
+        if (op == EADFDELTAOP_RUNS) {
+            if (eadfWriteDeltaRuns(buf1, buf2, numBytes, dest, &length)
+                != EADFSTATUS_SUCCESS)
+            {
+                return EADFSTATUS_FAILURE;
+            }
+        } else if (op == EADFDELTAOP_FULL) {
+            if (eadfWrite(buf2, 1, numBytes, dest) < numBytes) {
+                eadf_errno = EADFERROR_WRITEERROR;
+                return EADFSTATUS_FAILURE;
+            }
+        }
+
+        rec = records + track * EADFDELTA_BYTESPERRECORD;
+        bigEndianBytesFromLong(rec, h2->trackType[track]);
+        bigEndianBytesFromLong(rec + 4, numBytes);
+        bigEndianBytesFromLong(rec + 8, h2->trackSizeBits[track]);
+        bigEndianBytesFromLong(rec + 12, op);
+        bigEndianBytesFromLong(rec + 16, ref);
+        bigEndianBytesFromLong(rec + 20, length);
+        bigEndianBytesFromLong(rec + 24,
+            crcFinal(crcUpdate(CRC_INIT, buf2, numBytes)));
+    }
+
+    if (eadfSeek(dest, EADFDELTA_HEADERSIZE, SEEK_SET) < 0) {
+        eadf_errno = EADFERROR_SEEKERROR;
+        return EADFSTATUS_FAILURE;
+    }
+
+    if (eadfWrite(records, 1, recordsLength, dest) < recordsLength) {
+        eadf_errno = EADFERROR_WRITEERROR;
+        return EADFSTATUS_FAILURE;
+    }
+
+    return EADFSTATUS_SUCCESS;
+}
+
+/*
+** Write a delta to "dest" which turns the extended ADF file "f1" (the
+** base) into "f2" (the target).
+**
+** The delta consists of a header holding the number of tracks and
+** header CRC-32 of the base and the number of tracks of the target,
+** followed by a record for each target track and then the data for
+** those records in track order. Each record holds the track's type,
+** size in bytes and bits, how its data is stored, the base track it
+** refers to, the length of its data in the delta and the CRC-32 of
+** the resulting track data.
+**
+** A track which is unchanged from the base is stored by reference,
+** one of the same size with only a few bytes changed is stored as
+** runs of changed bytes and anything else is stored in full.
+*/
+EADFStatus eadfDiffFiles(EADFHeader *h1, FILE *f1, const char *n1,
+    EADFHeader *h2, FILE *f2, const char *n2, FILE *dest)
+{
+    unsigned char *records, *buf1, *buf2;
+    unsigned long maxBytes;
+    EADFStatus status;
+
+    maxBytes = eadfMaxTrackSize(h1);
+    if (eadfMaxTrackSize(h2) > maxBytes)
+        maxBytes = eadfMaxTrackSize(h2);
+
+    records = malloc(h2->numTracks * EADFDELTA_BYTESPERRECORD + 1);
+    buf1 = malloc(maxBytes + 1);
+    buf2 = malloc(maxBytes + 1);
+    if (records == NULL || buf1 == NULL || buf2 == NULL) {
+        free(records);
+        free(buf1);
+        free(buf2);
+        eadf_errno = EADFERROR_NOMEMORY;
+        return EADFSTATUS_FAILURE;
+    }
+
+    status = eadfWriteDelta(h1, f1, n1, h2, f2, n2, dest,
+        records, buf1, buf2);
+
+    free(records);
+    free(buf1);
+    free(buf2);
+    return status;
+}
+
+/*
+** Rebuild the target of a delta from its records using the supplied
+** buffer, which must be large enough to hold the largest target track.
+*/
+EADFStatus eadfApplyDelta(EADFHeader *h, FILE *f, const char *n,
+    FILE *delta, FILE *dest, EADFChecksums *sums,
+    unsigned long numTracks, const unsigned char *records,
+    unsigned char *buffer)
+{
+    unsigned char header[EADF_MAGICLEN + 4];
+    const unsigned char *rec;
+    unsigned long track, fileCrc = CRC_INIT;
+
+    memcpy(header, EADF_MAGIC, EADF_MAGICLEN);
+    bigEndianBytesFromLong(header + EADF_MAGICLEN, numTracks);
+    if (eadfWrite(header, 1, EADF_MAGICLEN + 4, dest) < EADF_MAGICLEN + 4) {
+        eadf_errno = EADFERROR_WRITEERROR;
+        return EADFSTATUS_FAILURE;
+    }
+
+    if (sums != NULL) {
+        if (eadfChecksumsAlloc(sums, numTracks) != EADFSTATUS_SUCCESS)
+            return EADFSTATUS_FAILURE;
+        fileCrc = crcUpdate(fileCrc, header, EADF_MAGICLEN + 4);
+        sums->fileSize = EADF_MAGICLEN + 4;
+    }
+
+    /* The target's header records are the start of the delta records */
+    for (track = 0; track < numTracks; track++) {
+        rec = records + track * EADFDELTA_BYTESPERRECORD;
+        if (eadfWrite(rec, 1, EADF_BYTESPERRECORD, dest) < EADF_BYTESPERRECORD) {
+            eadf_errno = EADFERROR_WRITEERROR;
+            return EADFSTATUS_FAILURE;
+        }
+
+        if (sums != NULL) {
+            fileCrc = crcUpdate(fileCrc, rec, EADF_BYTESPERRECORD);
+            sums->fileSize += EADF_BYTESPERRECORD;
+        }
+    }
+
+    for (track = 0; track < numTracks; track++) {
+        unsigned long numBytes, op, ref, length, crc;
+
+        rec = records + track * EADFDELTA_BYTESPERRECORD;
+        numBytes = longFromBigEndianBytes(rec + 4);
+        op = longFromBigEndianBytes(rec + 12);
+        ref = longFromBigEndianBytes(rec + 16);
+        length = longFromBigEndianBytes(rec + 20);
+
+        if (op == EADFDELTAOP_COPY || op == EADFDELTAOP_RUNS) {
+            if (ref >= h->numTracks || h->trackSizeBytes[ref] != numBytes) {
+                eadf_errno = EADFERROR_DELTAMISMATCH;
+                return EADFSTATUS_FAILURE;
+            }
+            if (eadfReadTrack(h, f, n, ref, buffer) != EADFSTATUS_SUCCESS)
+                return EADFSTATUS_FAILURE;
+        }
+
+        if (op == EADFDELTAOP_RUNS) {
+            unsigned char run[8];
+            unsigned long offset, count;
+
+            while (length >= 8) {
+                if (eadfRead(run, 1, 8, delta) < 8) {
+                    eadf_errno = EADFERROR_INVALIDDELTA;
+                    return EADFSTATUS_FAILURE;
+                }
+
+                offset = longFromBigEndianBytes(run);
+                count = longFromBigEndianBytes(run + 4);
+                if (offset > numBytes || count > numBytes - offset
+                    || count > length - 8
+                    || eadfRead(buffer + offset, 1, count, delta) < count)
+                {
+                    eadf_errno = EADFERROR_INVALIDDELTA;
+                    return EADFSTATUS_FAILURE;
+                }
+                length -= 8 + count;
+            }
+
+            if (length != 0) {
+                eadf_errno = EADFERROR_INVALIDDELTA;
+                return EADFSTATUS_FAILURE;
+            }
+        } else if (op == EADFDELTAOP_FULL) {
+            if (length != numBytes
+                || eadfRead(buffer, 1, numBytes, delta) < numBytes)
+            {
+                eadf_errno = EADFERROR_INVALIDDELTA;
+                return EADFSTATUS_FAILURE;
+            }
+        } else if (op != EADFDELTAOP_COPY) {
+            eadf_errno = EADFERROR_INVALIDDELTA;
+            return EADFSTATUS_FAILURE;
+        }
+
+        crc = crcFinal(crcUpdate(CRC_INIT, buffer, numBytes));
+        if (crc != longFromBigEndianBytes(rec + 24)) {
+            eadf_errno = EADFERROR_DELTAMISMATCH;
+            return EADFSTATUS_FAILURE;
+        }
+
+        if (eadfWrite(buffer, 1, numBytes, dest) < numBytes) {
+            eadf_errno = EADFERROR_WRITEERROR;
+            return EADFSTATUS_FAILURE;
+        }
+
+        if (sums != NULL) {
+            fileCrc = crcUpdate(fileCrc, buffer, numBytes);
+            sums->trackCrc[track] = crc;
+            sums->trackSizeBytes[track] = numBytes;
+            sums->fileSize += numBytes;
+        }
+    }
+
+    if (sums != NULL) {
+        sums->fileCrc = crcFinal(fileCrc);
+    }
+
+    return EADFSTATUS_SUCCESS;
+}
+
+/*
+** Apply a delta written by eadfDiffFiles() to the extended ADF file
+** "f" (the base), writing the target to "dest". The delta is read
+** sequentially, as are the tracks of the base it refers to. The
+** CRC-32 of every rebuilt track is checked against the delta.
+**
+** If "sums" is not NULL it is filled in with the CRC-32 checksums of
+** the data written to "dest".
+*/
+EADFStatus eadfPatchFile(EADFHeader *h, FILE *f, const char *n,
+    FILE *delta, FILE *dest, EADFChecksums *sums)
+{
+    unsigned char header[EADFDELTA_HEADERSIZE], *records, *buffer;
+    unsigned long numTracks, recordsLength, maxBytes, track;
+    EADFStatus status;
+
+    if (eadfRead(header, 1, EADFDELTA_HEADERSIZE, delta) < EADFDELTA_HEADERSIZE
+        || memcmp(header, EADFDELTA_MAGIC, EADF_MAGICLEN) != 0)
+    {
+        eadf_errno = EADFERROR_INVALIDDELTA;
+        return EADFSTATUS_FAILURE;
+    }
+
+    if (longFromBigEndianBytes(header + EADF_MAGICLEN) != h->numTracks
+        || longFromBigEndianBytes(header + EADF_MAGICLEN + 4)
+           != eadfHeaderCrc(h))
+    {
+        eadf_errno = EADFERROR_DELTAMISMATCH;
+        return EADFSTATUS_FAILURE;
+    }
+
+    numTracks = longFromBigEndianBytes(header + EADF_MAGICLEN + 8);
+    if (numTracks > EADF_MAXTRACKS) {
+        eadf_errno = EADFERROR_INVALIDNUMTRACKS;
+        return EADFSTATUS_FAILURE;
+    }
+
+    recordsLength = numTracks * EADFDELTA_BYTESPERRECORD;
+    if ((records = malloc(recordsLength + 1)) == NULL) {
+        eadf_errno = EADFERROR_NOMEMORY;
+        return EADFSTATUS_FAILURE;
+    }
+
+    if (eadfRead(records, 1, recordsLength, delta) < recordsLength) {
+        free(records);
+        eadf_errno = EADFERROR_INVALIDDELTA;
+        return EADFSTATUS_FAILURE;
+    }
+
+    maxBytes = 0;
+    for (track = 0; track < numTracks; track++) {
+        unsigned long numBytes = longFromBigEndianBytes(records
+            + track * EADFDELTA_BYTESPERRECORD + 4);
+
+        if (numBytes > maxBytes)
+            maxBytes = numBytes;
+    }
+
+    if ((buffer = malloc(maxBytes + 1)) == NULL) {
+        free(records);
+        eadf_errno = EADFERROR_NOMEMORY;
+        return EADFSTATUS_FAILURE;
+    }
+
+    status = eadfApplyDelta(h, f, n, delta, dest, sums, numTracks, records,
+        buffer);
+
+    free(records);
+    free(buffer);
+    return status;
+}
+
+/*
+** Calculate a MinHash signature of the RAW tracks of an extended ADF
+** file, storing EADF_MINHASHES values in "sig".
+**
+** Every 64-bit window of each track's bitstream, at every bit offset,
+** is hashed. The top EADF_MINHASHBITS of the hash choose a slot of the
+** signature and the slot keeps the smallest remaining bits seen. The
+** windows do not depend on where a track starts or how it is aligned,
+** so two reads of the same disk give similar signatures even when
+** their timing or index position differs. Slots which see no windows
+** are set to EADF_MINHASHEMPTY.
+*/
+EADFStatus eadfMinHashRawTracks(EADFHeader *h, FILE *f, const char *n,
+    unsigned long *sig)
+{
+    unsigned char *buffer;
+    unsigned long track, i;
+
+    for (i = 0; i < EADF_MINHASHES; i++) {
+        sig[i] = EADF_MINHASHEMPTY;
+    }
+
+    if ((buffer = malloc(eadfMaxTrackSize(h) + 1)) == NULL) {
+        eadf_errno = EADFERROR_NOMEMORY;
+        return EADFSTATUS_FAILURE;
+    }
+
+    for (track = 0; track < h->numTracks; track++) {
+        unsigned long hi = 0, lo = 0, numBits, bit;
+
+        if (h->trackType[track] != EADFTRACKTYPE_RAW
+            || h->trackSizeBytes[track] < 8)
+        {
+            continue;
+        }
+
+        if (eadfReadTrack(h, f, n, track, buffer) != EADFSTATUS_SUCCESS) {
+            free(buffer);
+            return EADFSTATUS_FAILURE;
+        }
+
+        numBits = eadfTrackBits(h, track);
+        for (bit = 0; bit < numBits; bit++) {
+            unsigned long value, slot;
+
+            hi = ((hi << 1) | (lo >> 31)) & 0xffffffffUL;
+            lo = ((lo << 1) | ((buffer[bit >> 3] >> (7 - (bit & 7))) & 1))
+                 & 0xffffffffUL;
+            if (bit < 63)
+                continue;
+
+            value = hashMix(hi ^ hashMix(lo ^ 0x9e3779b9UL));
+            slot = value >> (32 - EADF_MINHASHBITS);
+            value &= 0xffffffffUL >> EADF_MINHASHBITS;
+            if (value < sig[slot])
+                sig[slot] = value;
+        }
+    }
+
+    free(buffer);
+    return EADFSTATUS_SUCCESS;
+}
+
+/*
+** Estimate the similarity of the RAW tracks of two images, as a
+** percentage, from their MinHash signatures.
+*/
+unsigned long minHashSimilarity(const unsigned long *sig1,
+    const unsigned long *sig2)
+{
+    unsigned long i, same = 0, used = 0;
+
+    for (i = 0; i < EADF_MINHASHES; i++) {
+        if (sig1[i] == EADF_MINHASHEMPTY && sig2[i] == EADF_MINHASHEMPTY)
+            continue;
+
+        used++;
+        if (sig1[i] == sig2[i])
+            same++;
+    }
+
+    return (used == 0) ? 0 : (same * 100) / used;
+}
+
+/*
+** Return the number of valid bits in a track's data. Some files leave
+** the bit count at zero, in which case every byte is assumed used.
+*/
+unsigned long eadfTrackBits(const EADFHeader *h, unsigned long track)
+{
+    unsigned long numBits = h->trackSizeBits[track];
+
+    if (numBits == 0 || numBits > h->trackSizeBytes[track] * 8)
+        numBits = h->trackSizeBytes[track] * 8;
+
+    return numBits;
+}
+
+/*
+** Search a bitstream of "numBits" bits for the 16-bit "sync" word at
+** any bit alignment, starting at bit "from". Returns the bit offset
+** of the first bit of the sync word, or -1 if it was not found.
+*/
+long bitstreamFindSync(const unsigned char *buf, unsigned long numBits,
+    unsigned long from, unsigned long sync)
+{
+    unsigned long window = 0, bit;
+
+    for (bit = from; bit < numBits; bit++) {
+        window = ((window << 1) | ((buf[bit >> 3] >> (7 - (bit & 7))) & 1))
+                 & 0xffff;
+        if (bit >= from + 15 && window == sync)
+            return (long)(bit - 15);
+    }
+
+    return -1;
+}
+
+/*
+** Copy "numBits" bits of a bitstream to "dest" starting at bit "start"
+** and wrapping round to the beginning at the end of the stream. Any
+** bits left over in the last byte of "dest" are cleared.
+*/
+void bitstreamRotate(const unsigned char *src, unsigned long numBits,
+    unsigned long start, unsigned char *dest)
+{
+    unsigned long i, bit = start;
+
+    memset(dest, 0, (numBits + 7) / 8);
+    for (i = 0; i < numBits; i++, bit++) {
+        if (bit == numBits)
+            bit = 0;
+        if (src[bit >> 3] & (0x80 >> (bit & 7)))
+            dest[i >> 3] |= 0x80 >> (i & 7);
+    }
+}
+
+/*
+** Bitwise majority vote of "numInputs" 32-bit words. Each bit of the
+** result is set if more than half of the inputs have it set, with a
+** tie going to the first input. *agree is set to the bits on which all
+** of the inputs agree.
+**
+** The votes for all 32 bits are counted at once by holding the counts
+** as bit planes and adding each input to them with a ripple carry.
+*/
+unsigned long majorityWord(const unsigned long *in, unsigned long numInputs,
+    unsigned long *agree)
+{
+    unsigned long planes[EADF_CONSENSUSPLANES];
+    unsigned long all = 0xffffffffUL, any = 0, half = numInputs / 2;
+    unsigned long gt = 0, eq = 0xffffffffUL, i;
+    int k;
+
+    for (k = 0; k < EADF_CONSENSUSPLANES; k++) {
+        planes[k] = 0;
+    }
+
+    for (i = 0; i < numInputs; i++) {
+        unsigned long carry = in[i];
+
+        all &= carry;
+        any |= carry;
+        for (k = 0; k < EADF_CONSENSUSPLANES && carry != 0; k++) {
+            unsigned long t = planes[k] & carry;
+            planes[k] ^= carry;
+            carry = t;
+        }
+    }
+
+    /* Compare the counts with half the number of inputs */
+    for (k = EADF_CONSENSUSPLANES - 1; k >= 0; k--) {
+        if ((half >> k) & 1) {
+            eq &= planes[k];
+        } else {
+            gt |= eq & planes[k];
+            eq &= ~planes[k];
+        }
+    }
+
+    *agree = (all | ~any) & 0xffffffffUL;
+    if (numInputs % 2 == 0)
+        gt |= eq & in[0];
+
+    return gt & 0xffffffffUL;
+}
+
+/*
+** Build the consensus of one track from several extended ADF files.
+**
+** A DOS track in any source is used as it is, as its sectors have
+** already been checked. Otherwise each RAW track is rotated to start
+** at its first AmigaDOS sync word and a bitwise majority vote is taken
+** over the shortest of their lengths. Tracks without a sync word only
+** take part if none of the tracks have one.
+**
+** "bufs" must have room for one track from each source plus one. The
+** result is left in bufs[numSources] and its size is stored in the
+** header "out". *confidence is set to the percentage of bits on which
+** all of the voting tracks agree.
+*/
+EADFStatus eadfConsensusTrack(unsigned long numSources, EADFHeader *hs,
+    FILE **fs, char **names, unsigned long track, unsigned char **bufs,
+    EADFHeader *out, unsigned long *confidence)
+{
+    unsigned long i, numBits = 0, numVoters = 0, numSynced = 0, word;
+    unsigned long numWords, agreed = 0;
+    unsigned long votes[EADF_MAXCONSENSUS];
+    long syncs[EADF_MAXCONSENSUS];
+    unsigned char *result = bufs[numSources];
+
+    out->trackType[track] = EADFTRACKTYPE_RAW;
+    out->trackSizeBytes[track] = 0;
+    out->trackSizeBits[track] = 0;
+    *confidence = 0;
+
+    for (i = 0; i < numSources; i++) {
+        if (track >= hs[i].numTracks || hs[i].trackSizeBytes[track] == 0)
+            continue;
+
+        if (hs[i].trackType[track] == EADFTRACKTYPE_DOS) {
+            if (eadfReadTrack(&hs[i], fs[i], names[i], track, result)
+                != EADFSTATUS_SUCCESS)
+            {
+                return EADFSTATUS_FAILURE;
+            }
+            out->trackType[track] = EADFTRACKTYPE_DOS;
+            out->trackSizeBytes[track] = hs[i].trackSizeBytes[track];
+            out->trackSizeBits[track] = hs[i].trackSizeBits[track];
+            *confidence = 100;
+            return EADFSTATUS_SUCCESS;
+        }
+    }
+
+    for (i = 0; i < numSources; i++) {
+        syncs[i] = -1;
+        if (track >= hs[i].numTracks || hs[i].trackSizeBytes[track] == 0)
+            continue;
+
+        if (eadfReadTrack(&hs[i], fs[i], names[i], track, bufs[i])
+            != EADFSTATUS_SUCCESS)
+        {
+            return EADFSTATUS_FAILURE;
+        }
+
+        syncs[i] = bitstreamFindSync(bufs[i], eadfTrackBits(&hs[i], track),
+            0, EADF_SYNCWORD);
+        if (syncs[i] >= 0)
+            numSynced++;
+    }
+
+    for (i = 0; i < numSources; i++) {
+        unsigned long bits;
+
+        if (track >= hs[i].numTracks || hs[i].trackSizeBytes[track] == 0
+            || (numSynced > 0 && syncs[i] < 0))
+        {
+            continue;
+        }
+
+        bits = eadfTrackBits(&hs[i], track);
+        if (numVoters == 0 || bits < numBits)
+            numBits = bits;
+
+        /* Move the voting tracks to the front of the buffers */
+        bitstreamRotate(bufs[i], bits, (syncs[i] < 0) ? 0 : syncs[i],
+            result);
+        memcpy(bufs[numVoters], result, (bits + 7) / 8);
+        numVoters++;
+    }
+
+    if (numVoters == 0)
+        return EADFSTATUS_SUCCESS;
+
+    numWords = (numBits + 31) / 32;
+    for (word = 0; word < numWords; word++) {
+        unsigned long agree, value, valid = 0xffffffffUL;
+
+        for (i = 0; i < numVoters; i++) {
+            votes[i] = longFromBigEndianBytes(bufs[i] + word * 4);
+        }
+
+        value = majorityWord(votes, numVoters, &agree);
+        bigEndianBytesFromLong(result + word * 4, value);
+
+        if (word == numWords - 1 && numBits % 32 != 0)
+            valid = (0xffffffffUL << (32 - numBits % 32)) & 0xffffffffUL;
+
+        for (agree &= valid; agree != 0; agree &= agree - 1) {
+            agreed++;
+        }
+    }
+
+    /* Clear the bits past the end of the track */
+    if (numBits % 8 != 0)
+        result[numBits / 8] &= 0xff << (8 - numBits % 8);
+
+    out->trackSizeBytes[track] = (numBits + 7) / 8;
+    out->trackSizeBits[track] = numBits;
+    *confidence = (agreed * 100) / numBits;
+
+    return EADFSTATUS_SUCCESS;
+}
+
+/*
+** Write an extended ADF file to "dest" whose tracks are the consensus
+** of the corresponding tracks of several others, as described for
+** eadfConsensusTrack(). The confidence of each track is stored in the
+** "confidence" array, which must have an entry for each track of the
+** source with the most tracks.
+*/
+EADFStatus eadfConsensusFiles(unsigned long numSources, EADFHeader *hs,
+    FILE **fs, char **names, FILE *dest, unsigned long *confidence)
+{
+    EADFHeader *out;
+    unsigned char **bufs, *header;
+    unsigned long i, track, maxBytes = 0, headerLength;
+    EADFStatus status = EADFSTATUS_SUCCESS;
+
+    if (numSources > EADF_MAXCONSENSUS) {
+        eadf_errno = EADFERROR_TOOMANYSOURCES;
+        return EADFSTATUS_FAILURE;
+    }
+
+    out = calloc(1, sizeof(EADFHeader));
+    bufs = malloc((numSources + 1) * sizeof(unsigned char *));
+    if (out == NULL || bufs == NULL) {
+        free(out);
+        free(bufs);
+        eadf_errno = EADFERROR_NOMEMORY;
+        return EADFSTATUS_FAILURE;
+    }
+
+    out->numTracks = 0;
+    for (i = 0; i < numSources; i++) {
+        if (eadfMaxTrackSize(&hs[i]) > maxBytes)
+            maxBytes = eadfMaxTrackSize(&hs[i]);
+        if (hs[i].numTracks > out->numTracks)
+            out->numTracks = hs[i].numTracks;
+    }
+
+    if (eadfHeaderAlloc(out, out->numTracks) != EADFSTATUS_SUCCESS) {
+        free(out);
+        free(bufs);
+        return EADFSTATUS_FAILURE;
+    }
+
+    for (i = 0; i <= numSources; i++) {
+        /* Room to read whole 32-bit words past the end of a track */
+        if ((bufs[i] = malloc(maxBytes + 4)) == NULL) {
+            status = EADFSTATUS_FAILURE;
+        } else {
+            memset(bufs[i], 0, maxBytes + 4);
+        }
+    }
+
+    headerLength = EADF_MAGICLEN + 4 + out->numTracks * EADF_BYTESPERRECORD;
+    if (status != EADFSTATUS_SUCCESS || (header = malloc(headerLength)) == NULL)
+    {
+        for (i = 0; i <= numSources; i++) {
+            free(bufs[i]);
+        }
+        free(bufs);
+        free(out);
+        eadf_errno = EADFERROR_NOMEMORY;
+        return EADFSTATUS_FAILURE;
+    }
+
+    /* Space for the header, which is written once the sizes are known */
+    memset(header, 0, headerLength);
+    if (eadfWrite(header, 1, headerLength, dest) < headerLength) {
+        eadf_errno = EADFERROR_WRITEERROR;
+        status = EADFSTATUS_FAILURE;
+    }
+
+    for (track = 0; track < out->numTracks && status == EADFSTATUS_SUCCESS;
+         track++)
+    {
+        unsigned long numBytes;
+
+        status = eadfConsensusTrack(numSources, hs, fs, names, track, bufs,
+            out, &confidence[track]);
+        if (status != EADFSTATUS_SUCCESS)
+            break;
+
+        numBytes = out->trackSizeBytes[track];
+        if (eadfWrite(bufs[numSources], 1, numBytes, dest) < numBytes) {
+            eadf_errno = EADFERROR_WRITEERROR;
+            status = EADFSTATUS_FAILURE;
+        }
+    }
+
+    if (status == EADFSTATUS_SUCCESS) {
+        memcpy(header, EADF_MAGIC, EADF_MAGICLEN);
+        bigEndianBytesFromLong(header + EADF_MAGICLEN, out->numTracks);
+        for (track = 0; track < out->numTracks; track++) {
+            unsigned char *rec = header + EADF_MAGICLEN + 4
+                + track * EADF_BYTESPERRECORD;
+
+            bigEndianBytesFromLong(rec, out->trackType[track]);
+            bigEndianBytesFromLong(rec + 4, out->trackSizeBytes[track]);
+            bigEndianBytesFromLong(rec + 8, out->trackSizeBits[track]);
+        }
+
+        if (eadfSeek(dest, 0, SEEK_SET) < 0) {
+            eadf_errno = EADFERROR_SEEKERROR;
+            status = EADFSTATUS_FAILURE;
+        } else if (eadfWrite(header, 1, headerLength, dest) < headerLength) {
+            eadf_errno = EADFERROR_WRITEERROR;
+            status = EADFSTATUS_FAILURE;
+        }
+    }
+
+    for (i = 0; i <= numSources; i++) {
+        free(bufs[i]);
+    }
+    free(bufs);
+    free(header);
+    free(out);
+    return status;
+}
+
+/*
+** Return the 32 bits of a bitstream of "numBits" bits starting at bit
+** "pos", wrapping round to the start of the stream at the end as a
+** track on a disk does.
+*/
+unsigned long bitstreamLong(const unsigned char *buf, unsigned long numBits,
+    unsigned long pos)
+{
+    unsigned long value = 0;
+    int i;
+
+    pos %= numBits;
+    if (pos + 40 <= numBits) {
+        unsigned int shift = pos & 7;
+        const unsigned char *p = buf + (pos >> 3);
+
+        value = longFromBigEndianBytes(p);
+        if (shift != 0)
+            value = ((value << shift) | (p[4] >> (8 - shift))) & 0xffffffffUL;
+        return value;
+    }
+
+    for (i = 0; i < 32; i++, pos++) {
+        if (pos == numBits)
+            pos = 0;
+        value = (value << 1) | ((buf[pos >> 3] >> (7 - (pos & 7))) & 1);
+    }
+
+    return value & 0xffffffffUL;
+}
+
+/*
+** Find the revolution period of a RAW track read over more than one
+** revolution, as the distance from the sync word at bit "first" to the
+** next sync word at least EADF_MINREVOLUTIONBITS later which is
+** followed by the same EADF_REVOLUTIONCHECK bits. Returns 0 if the
+** track does not repeat.
+*/
+unsigned long bitstreamRevolution(const unsigned char *buf,
+    unsigned long numBits, unsigned long first)
+{
+    unsigned long i;
+    long sync;
+
+    sync = bitstreamFindSync(buf, numBits, first + EADF_MINREVOLUTIONBITS,
+        EADF_SYNCWORD);
+    while (sync >= 0
+           && (unsigned long)sync + EADF_REVOLUTIONCHECK <= numBits)
+    {
+        for (i = 0; i < EADF_REVOLUTIONCHECK; i += 32) {
+            if (bitstreamLong(buf, numBits, first + i)
+                != bitstreamLong(buf, numBits, sync + i))
+            {
+                break;
+            }
+        }
+        if (i == EADF_REVOLUTIONCHECK)
+            return sync - first;
+
+        sync = bitstreamFindSync(buf, numBits, sync + 1, EADF_SYNCWORD);
+    }
+
+    return 0;
+}
+
+/*
+** Return the bit offset of the sync word which starts the first sector
+** after the track gap in a bitstream of one revolution: the one after
+** the longest distance between sync words, counting the distance round
+** the end of the track. A sync word just before it is included, as
+** sectors normally start with two. Returns 0 if there is no sync word.
+*/
+unsigned long bitstreamTrackStart(const unsigned char *buf,
+    unsigned long numBits)
+{
+    unsigned long first, last, maxGap = 0, start = 0;
+    long sync;
+
+    if ((sync = bitstreamFindSync(buf, numBits, 0, EADF_SYNCWORD)) < 0)
+        return 0;
+
+    first = last = sync;
+    while ((sync = bitstreamFindSync(buf, numBits, last + 1, EADF_SYNCWORD))
+           >= 0)
+    {
+        if (sync - last > maxGap) {
+            maxGap = sync - last;
+            start = sync;
+        }
+        last = sync;
+    }
+
+    if (numBits - last + first > maxGap)
+        start = first;
+
+    if (bitstreamLong(buf, numBits, start + numBits - 16) >> 16
+        == EADF_SYNCWORD)
+    {
+        start = (start + numBits - 16) % numBits;
+    }
+
+    return start;
+}
+
+/*
+** Write a copy of an extended ADF file to "dest" with each RAW track
+** trimmed to a single revolution if it was read over more than one,
+** and rotated to start at the first sector after the track gap as
+** found by bitstreamTrackStart(). Reads of the same disk then give
+** identical tracks. DOS tracks and RAW tracks without a sync word are
+** copied as they are. The header of the copy is left in "out".
+*/
+EADFStatus eadfCanonicalizeFile(EADFHeader *h, FILE *f, const char *n,
+    EADFHeader *out, FILE *dest)
+{
+    unsigned char *buffer, *result, *header;
+    unsigned long track, numBits, period, headerLength;
+    EADFStatus status = EADFSTATUS_SUCCESS;
+    long sync;
+
+    if (eadfHeaderCopy(out, h) != EADFSTATUS_SUCCESS)
+        return EADFSTATUS_FAILURE;
+
+    headerLength = EADF_MAGICLEN + 4 + h->numTracks * EADF_BYTESPERRECORD;
+    buffer = malloc(eadfMaxTrackSize(h) + 1);
+    result = malloc(eadfMaxTrackSize(h) + 1);
+    header = malloc(headerLength);
+    if (buffer == NULL || result == NULL || header == NULL) {
+        free(buffer);
+        free(result);
+        free(header);
+        eadf_errno = EADFERROR_NOMEMORY;
+        return EADFSTATUS_FAILURE;
+    }
+
+    /* Space for the header, which is written once the sizes are known */
+    memset(header, 0, headerLength);
+    if (eadfWrite(header, 1, headerLength, dest) < headerLength) {
+        eadf_errno = EADFERROR_WRITEERROR;
+        status = EADFSTATUS_FAILURE;
+    }
+
+    for (track = 0; track < h->numTracks && status == EADFSTATUS_SUCCESS;
+         track++)
+    {
+        unsigned long numBytes = h->trackSizeBytes[track];
+
+        if (eadfReadTrack(h, f, n, track, buffer) != EADFSTATUS_SUCCESS) {
+            status = EADFSTATUS_FAILURE;
+            break;
+        }
+
+        numBits = eadfTrackBits(h, track);
+        if (h->trackType[track] == EADFTRACKTYPE_RAW && numBits > 0
+            && (sync = bitstreamFindSync(buffer, numBits, 0,
+                    EADF_SYNCWORD)) >= 0)
+        {
+            period = bitstreamRevolution(buffer, numBits, sync);
+            bitstreamRotate(buffer, numBits, sync, result);
+            if (period > 0)
+                numBits = period;
+            bitstreamRotate(result, numBits,
+                bitstreamTrackStart(result, numBits), buffer);
+
+            numBytes = (numBits + 7) / 8;
+            out->trackSizeBytes[track] = numBytes;
+            out->trackSizeBits[track] = numBits;
+        }
+
+        if (eadfWrite(buffer, 1, numBytes, dest) < numBytes) {
+            eadf_errno = EADFERROR_WRITEERROR;
+            status = EADFSTATUS_FAILURE;
+        }
+    }
+
+    if (status == EADFSTATUS_SUCCESS) {
+        memcpy(header, EADF_MAGIC, EADF_MAGICLEN);
+        bigEndianBytesFromLong(header + EADF_MAGICLEN, out->numTracks);
+        for (track = 0; track < out->numTracks; track++) {
+            unsigned char *rec = header + EADF_MAGICLEN + 4
+                + track * EADF_BYTESPERRECORD;
+
+            out->trackOffset[track] = (track == 0) ? headerLength
+                : out->trackOffset[track - 1]
+                  + out->trackSizeBytes[track - 1];
+            bigEndianBytesFromLong(rec, out->trackType[track]);
+            bigEndianBytesFromLong(rec + 4, out->trackSizeBytes[track]);
+            bigEndianBytesFromLong(rec + 8, out->trackSizeBits[track]);
+        }
+
+        if (eadfSeek(dest, 0, SEEK_SET) < 0) {
+            eadf_errno = EADFERROR_SEEKERROR;
+            status = EADFSTATUS_FAILURE;
+        } else if (eadfWrite(header, 1, headerLength, dest) < headerLength) {
+            eadf_errno = EADFERROR_WRITEERROR;
+            status = EADFSTATUS_FAILURE;
+        }
+    }
+
+    free(buffer);
+    free(result);
+    free(header);
+    return status;
+}
+
+/*
+** Decode the AmigaDOS sectors of a RAW track bitstream into "out",
+** which must have room for ADF_TRACKSIZE bytes. Sectors are found by
+** their sync words at any bit alignment, and each one is stored only
+** if its header belongs to "track" and both of its checksums are
+** correct.
+**
+** The odd and even bits of each long are split into separate blocks
+** on the disk, so they are put back together 32 bits at a time with
+** masks rather than bit by bit.
+**
+** Returns a mask with bit n set for each sector n which was decoded.
+*/
+unsigned long mfmDecodeSectors(const unsigned char *buf,
+    unsigned long numBits, unsigned long track, unsigned char *out)
+{
+    unsigned long found = 0, pos = 0, i;
+    long sync;
+
+    if (numBits < ADF_MFMSECTORBITS)
+        return 0;
+
+    while ((sync = bitstreamFindSync(buf, numBits, pos, EADF_SYNCWORD)) >= 0) {
+        unsigned long q = sync + 16, info, sector, check, odd, even;
+
+        /* Sectors normally start with two sync words */
+        if (bitstreamLong(buf, numBits, q) >> 16 == EADF_SYNCWORD)
+            q += 16;
+        pos = q;
+
+        odd = bitstreamLong(buf, numBits, q);
+        even = bitstreamLong(buf, numBits, q + 32);
+        info = ((odd & MFM_DATAMASK) << 1) | (even & MFM_DATAMASK);
+        sector = (info >> 8) & 0xff;
+        if ((info >> 24) != 0xff || ((info >> 16) & 0xff) != track
+            || sector >= ADF_SECTORSPERTRACK || (found & (1UL << sector)))
+        {
+            continue;
+        }
+
+        /* Header checksum covers the info and label longs */
+        check = 0;
+        for (i = 0; i < 10; i++) {
+            check ^= bitstreamLong(buf, numBits, q + i * 32);
+        }
+        odd = bitstreamLong(buf, numBits, q + 320);
+        even = bitstreamLong(buf, numBits, q + 352);
+        if ((check & MFM_DATAMASK)
+            != (((odd & MFM_DATAMASK) << 1) | (even & MFM_DATAMASK)))
+        {
+            continue;
+        }
+
+        check = 0;
+        for (i = 0; i < ADF_SECTORSIZE / 4; i++) {
+            unsigned long value;
+
+            odd = bitstreamLong(buf, numBits, q + 448 + i * 32);
+            even = bitstreamLong(buf, numBits,
+                q + 448 + ADF_SECTORSIZE * 8 + i * 32);
+            check ^= odd ^ even;
+
+            value = ((odd & MFM_DATAMASK) << 1) | (even & MFM_DATAMASK);
+            bigEndianBytesFromLong(out + sector * ADF_SECTORSIZE + i * 4,
+                value);
+        }
+
+        odd = bitstreamLong(buf, numBits, q + 384);
+        even = bitstreamLong(buf, numBits, q + 416);
+        if ((check & MFM_DATAMASK)
+            != (((odd & MFM_DATAMASK) << 1) | (even & MFM_DATAMASK)))
+        {
+            continue;
+        }
+
+        found |= 1UL << sector;
+        pos = q + ADF_MFMSECTORBITS - 64;
+    }
+
+    return found;
+}
+
+/*
+** Decode a track of an extended ADF file into the ADF_TRACKSIZE bytes
+** at "out". DOS tracks are copied as they are and RAW tracks are
+** decoded by mfmDecodeSectors(); "buffer" must be large enough to hold
+** the track's data.
+**
+** *found is set to a mask with bit n set for each sector n which was
+** decoded successfully. Other sectors of "out" are left unchanged.
+*/
+EADFStatus eadfDecodeTrack(EADFHeader *h, FILE *f, const char *n,
+    unsigned long track, unsigned char *buffer, unsigned char *out,
+    unsigned long *found)
+{
+    *found = 0;
+    if (track >= h->numTracks || h->trackSizeBytes[track] == 0)
+        return EADFSTATUS_SUCCESS;
+
+    if (h->trackType[track] == EADFTRACKTYPE_DOS) {
+        if (h->trackSizeBytes[track] != ADF_TRACKSIZE)
+            return EADFSTATUS_SUCCESS;
+
+        if (eadfReadTrack(h, f, n, track, out) != EADFSTATUS_SUCCESS)
+            return EADFSTATUS_FAILURE;
+
+        *found = ADF_ALLSECTORS;
+        return EADFSTATUS_SUCCESS;
+    }
+
+    if (eadfReadTrack(h, f, n, track, buffer) != EADFSTATUS_SUCCESS)
+        return EADFSTATUS_FAILURE;
+
+    *found = mfmDecodeSectors(buffer, eadfTrackBits(h, track), track, out);
+    return EADFSTATUS_SUCCESS;
+}
+
+/*
+** Rebuild a track of eadfSectorMergeFiles() from the AmigaDOS sectors
+** of the corresponding tracks of the sources, taking each sector from
+** the first source in which it decodes. Later sources are only decoded
+** while sectors are still missing.
+**
+** If every sector is recovered the result is a DOS track; otherwise
+** the track of the source with the most good sectors is kept as it is,
+** so that it can be worked on further. "buffer" must hold the largest
+** track of any source, "work" ADF_TRACKSIZE bytes and "result" both.
+** The track is left in "result" and its size is stored in the header
+** "out". *found is set to a mask of the sectors which decode in the
+** track written, so a kept track reports only its own good sectors.
+*/
+EADFStatus eadfSectorMergeTrack(unsigned long numSources, EADFHeader *hs,
+    FILE **fs, char **names, unsigned long track, unsigned char *buffer,
+    unsigned char *work, unsigned char *result, EADFHeader *out,
+    unsigned long *found)
+{
+    unsigned long i, sector, got, count, bestCount = 0, bestGot = 0;
+    long best = -1;
+
+    out->trackType[track] = EADFTRACKTYPE_RAW;
+    out->trackSizeBytes[track] = 0;
+    out->trackSizeBits[track] = 0;
+    *found = 0;
+
+    for (i = 0; i < numSources && *found != ADF_ALLSECTORS; i++) {
+        if (eadfDecodeTrack(&hs[i], fs[i], names[i], track, buffer, work,
+                &got) != EADFSTATUS_SUCCESS)
+        {
+            return EADFSTATUS_FAILURE;
+        }
+
+        count = 0;
+        for (sector = 0; sector < ADF_SECTORSPERTRACK; sector++) {
+            if (!(got & (1UL << sector)))
+                continue;
+
+            count++;
+            if (!(*found & (1UL << sector))) {
+                memcpy(result + sector * ADF_SECTORSIZE,
+                    work + sector * ADF_SECTORSIZE, ADF_SECTORSIZE);
+                *found |= 1UL << sector;
+            }
+        }
+
+        if (track < hs[i].numTracks && hs[i].trackSizeBytes[track] > 0
+            && (best < 0 || count > bestCount))
+        {
+            best = i;
+            bestCount = count;
+            bestGot = got;
+        }
+    }
+
+    if (*found == ADF_ALLSECTORS) {
+        out->trackType[track] = EADFTRACKTYPE_DOS;
+        out->trackSizeBytes[track] = ADF_TRACKSIZE;
+        out->trackSizeBits[track] = ADF_TRACKSIZE * 8;
+        return EADFSTATUS_SUCCESS;
+    }
+
+    if (best >= 0) {
+        if (eadfReadTrack(&hs[best], fs[best], names[best], track, result)
+            != EADFSTATUS_SUCCESS)
+        {
+            return EADFSTATUS_FAILURE;
+        }
+        out->trackType[track] = hs[best].trackType[track];
+        out->trackSizeBytes[track] = hs[best].trackSizeBytes[track];
+        out->trackSizeBits[track] = hs[best].trackSizeBits[track];
+    }
+
+    *found = bestGot;
+    return EADFSTATUS_SUCCESS;
+}
+
+/*
+** Write an extended ADF file to "dest" whose tracks are rebuilt from
+** the sectors of the corresponding tracks of several others, as
+** described for eadfSectorMergeTrack(). The mask of sectors recovered
+** for each track is stored in the "found" array, which must have an
+** entry for each track of the source with the most tracks.
+*/
+EADFStatus eadfSectorMergeFiles(unsigned long numSources, EADFHeader *hs,
+    FILE **fs, char **names, FILE *dest, unsigned long *found)
+{
+    EADFHeader *out;
+    unsigned char *buffer, *work, *result, *header;
+    unsigned long i, track, maxBytes = ADF_TRACKSIZE, headerLength;
+    EADFStatus status = EADFSTATUS_SUCCESS;
+
+    out = calloc(1, sizeof(EADFHeader));
+    if (out == NULL) {
+        eadf_errno = EADFERROR_NOMEMORY;
+        return EADFSTATUS_FAILURE;
+    }
+
+    out->numTracks = 0;
+    for (i = 0; i < numSources; i++) {
+        if (eadfMaxTrackSize(&hs[i]) > maxBytes)
+            maxBytes = eadfMaxTrackSize(&hs[i]);
+        if (hs[i].numTracks > out->numTracks)
+            out->numTracks = hs[i].numTracks;
+    }
+
+    if (eadfHeaderAlloc(out, out->numTracks) != EADFSTATUS_SUCCESS) {
+        free(out);
+        return EADFSTATUS_FAILURE;
+    }
+
+    headerLength = EADF_MAGICLEN + 4 + out->numTracks * EADF_BYTESPERRECORD;
+    buffer = malloc(maxBytes);
+    work = malloc(ADF_TRACKSIZE);
+    result = malloc(maxBytes);
+    header = malloc(headerLength);
+    if (buffer == NULL || work == NULL || result == NULL || header == NULL) {
+        free(buffer);
+        free(work);
+        free(result);
+        free(header);
+        free(out);
+        eadf_errno = EADFERROR_NOMEMORY;
+        return EADFSTATUS_FAILURE;
+    }
+
+    /* Space for the header, which is written once the sizes are known */
+    memset(header, 0, headerLength);
+    if (eadfWrite(header, 1, headerLength, dest) < headerLength) {
+        eadf_errno = EADFERROR_WRITEERROR;
+        status = EADFSTATUS_FAILURE;
+    }
+
+    for (track = 0; track < out->numTracks && status == EADFSTATUS_SUCCESS;
+         track++)
+    {
+        unsigned long numBytes;
+
+        status = eadfSectorMergeTrack(numSources, hs, fs, names, track,
+            buffer, work, result, out, &found[track]);
+        if (status != EADFSTATUS_SUCCESS)
+            break;
+
+        numBytes = out->trackSizeBytes[track];
+        if (eadfWrite(result, 1, numBytes, dest) < numBytes) {
+            eadf_errno = EADFERROR_WRITEERROR;
+            status = EADFSTATUS_FAILURE;
+        }
+    }
+
+    if (status == EADFSTATUS_SUCCESS) {
+        memcpy(header, EADF_MAGIC, EADF_MAGICLEN);
+        bigEndianBytesFromLong(header + EADF_MAGICLEN, out->numTracks);
+        for (track = 0; track < out->numTracks; track++) {
+            unsigned char *rec = header + EADF_MAGICLEN + 4
+                + track * EADF_BYTESPERRECORD;
+
+            bigEndianBytesFromLong(rec, out->trackType[track]);
+            bigEndianBytesFromLong(rec + 4, out->trackSizeBytes[track]);
+            bigEndianBytesFromLong(rec + 8, out->trackSizeBits[track]);
+        }
+
+        if (eadfSeek(dest, 0, SEEK_SET) < 0) {
+            eadf_errno = EADFERROR_SEEKERROR;
+            status = EADFSTATUS_FAILURE;
+        } else if (eadfWrite(header, 1, headerLength, dest) < headerLength) {
+            eadf_errno = EADFERROR_WRITEERROR;
+            status = EADFSTATUS_FAILURE;
+        }
+    }
+
+    free(buffer);
+    free(work);
+    free(result);
+    free(header);
+    free(out);
+    return status;
+}
+
+/*
+** Compute the signature of a track by which the identify command
+** recognises known tracks: the CRC-32 of its sectors if they all
+** decode, so that a DOS track and a RAW read of the same data match,
+** or else the CRC-32 of its bitstream rotated to start at its first
+** sync word. *size is set to the number of bytes covered by the CRC,
+** which is 0 for an empty track. "buffer" and "work" must each hold
+** eadfMaxTrackSize() bytes, and at least ADF_TRACKSIZE.
+*/
+EADFStatus eadfTrackSignature(EADFHeader *h, FILE *f, const char *n,
+    unsigned long track, unsigned char *buffer, unsigned char *work,
+    unsigned long *crc, unsigned long *size)
+{
+    unsigned long found, numBits;
+    long sync;
+
+    *crc = 0;
+    *size = 0;
+    if (track >= h->numTracks || h->trackSizeBytes[track] == 0)
+        return EADFSTATUS_SUCCESS;
+
+    if (eadfDecodeTrack(h, f, n, track, buffer, work, &found)
+        != EADFSTATUS_SUCCESS)
+    {
+        return EADFSTATUS_FAILURE;
+    }
+
+    if (found == ADF_ALLSECTORS) {
+        *size = ADF_TRACKSIZE;
+        *crc = crcFinal(crcUpdate(CRC_INIT, work, ADF_TRACKSIZE));
+        return EADFSTATUS_SUCCESS;
+    }
+
+    /* A DOS track of the wrong size is not decoded, so read it here */
+    if (h->trackType[track] == EADFTRACKTYPE_DOS) {
+        if (eadfReadTrack(h, f, n, track, buffer) != EADFSTATUS_SUCCESS)
+            return EADFSTATUS_FAILURE;
+
+        *size = h->trackSizeBytes[track];
+        *crc = crcFinal(crcUpdate(CRC_INIT, buffer, *size));
+        return EADFSTATUS_SUCCESS;
+    }
+
+    numBits = eadfTrackBits(h, track);
+    sync = bitstreamFindSync(buffer, numBits, 0, EADF_SYNCWORD);
+    bitstreamRotate(buffer, numBits, (sync < 0) ? 0 : sync, work);
+    *size = (numBits + 7) / 8;
+    *crc = crcFinal(crcUpdate(CRC_INIT, work, *size));
+    return EADFSTATUS_SUCCESS;
+}
+
+/*
+** Set bit r of table[v] for each byte value v which the 16-bit "sync"
+** word covers completely when it starts r bits into a byte, for use
+** by bitstreamFindSyncs().
+*/
+void syncByteTable(unsigned long sync, unsigned char *table)
+{
+    int r;
+
+    memset(table, 0, 256);
+    for (r = 0; r < 8; r++) {
+        table[(sync >> r) & 0xff] |= 1 << r;
+    }
+}
+
+/*
+** Find every occurrence of the 16-bit "sync" word in a bitstream of
+** "numBits" bits at any bit alignment, storing the bit offsets of the
+** first "max" of them in "positions". *maxGap is set to the longest
+** distance in bits from one sync word to the next, counting the gap
+** round the end of the track. Returns the number of sync words found.
+**
+** Whatever its alignment a sync word covers one whole byte, so "table"
+** (made by syncByteTable()) rules out most of the stream a byte at a
+** time and gives the only alignments which need to be checked.
+*/
+unsigned long bitstreamFindSyncs(const unsigned char *buf,
+    unsigned long numBits, unsigned long sync, const unsigned char *table,
+    unsigned long *positions, unsigned long max, unsigned long *maxGap)
+{
+    unsigned long numBytes = (numBits + 7) / 8, numFound = 0;
+    unsigned long first = 0, last = 0, m, window, start;
+    int r;
+
+    *maxGap = numBits;
+    for (m = 1; m < numBytes; m++) {
+        if (table[buf[m]] == 0)
+            continue;
+
+        window = ((unsigned long)buf[m - 1] << 16) | (buf[m] << 8);
+        if (m + 1 < numBytes)
+            window |= buf[m + 1];
+
+        for (r = 0; r < 8; r++) {
+            start = (m - 1) * 8 + r;
+            if (!(table[buf[m]] & (1 << r)) || start + 16 > numBits
+                || ((window >> (8 - r)) & 0xffff) != sync)
+            {
+                continue;
+            }
+
+            if (numFound < max)
+                positions[numFound] = start;
+            if (numFound == 0) {
+                first = start;
+                *maxGap = 0;
+            } else if (start - last > *maxGap) {
+                *maxGap = start - last;
+            }
+            last = start;
+            numFound++;
+        }
+    }
+
+    if (numFound > 0 && numBits - last + first > *maxGap)
+        *maxGap = numBits - last + first;
+
+    return numFound;
+}
+
+/*
+** Classify a track of "numBytes" bytes of data at "buf", given the
+** number of sync words and decoded sectors found in it if it is a RAW
+** track.
+**
+** The length of the longest run of one byte value and the number of
+** bytes which break the MFM coding rules are found in a single pass.
+*/
+EADFTrackClass eadfClassifyTrack(const unsigned char *buf,
+    unsigned long numBytes, EADFTrackType type, unsigned long numSyncs,
+    unsigned long numSectors)
+{
+    unsigned long i, run = 0, longest = 0, numBad = 0;
+
+    if (numBytes == 0)
+        return EADFTRACKCLASS_EMPTY;
+
+    /* A DOS track's sectors have already been checked by rawread */
+    if (type == EADFTRACKTYPE_DOS)
+        return EADFTRACKCLASS_DATA;
+
+    for (i = 0; i < numBytes; i++) {
+        run = (i > 0 && buf[i] == buf[i - 1]) ? run + 1 : 1;
+        if (run > longest)
+            longest = run;
+        if (buf[i] & (buf[i] >> 1))
+            numBad++;
+    }
+
+    if (longest * 100 >= numBytes * EADF_EMPTYRUN)
+        return EADFTRACKCLASS_EMPTY;
+    if (numSectors > 0)
+        return EADFTRACKCLASS_DATA;
+    if (numSyncs == 0 || numBad * 100 > numBytes * EADF_NOISEBYTES)
+        return EADFTRACKCLASS_NOISE;
+    return EADFTRACKCLASS_FORMATTED;
+}
+
+/*
+** Work out the layout of each track of an extended ADF file: its class
+** and, for a RAW track, where its sync words are, how many AmigaDOS
+** sectors decode correctly and the longest stretch without a sync
+** word. Empty tracks are left as zeros. Only RAW tracks are read, as
+** the class of a DOS track does not depend on its data.
+*/
+EADFStatus eadfScanLayouts(EADFHeader *h, FILE *f, const char *n,
+    EADFTrackLayout *layouts)
+{
+    unsigned char syncTable[256], *buffer, *out;
+    unsigned long track, numBits, found;
+    EADFTrackLayout *l;
+
+    buffer = malloc(eadfMaxTrackSize(h) + 1);
+    out = malloc(ADF_TRACKSIZE);
+    if (buffer == NULL || out == NULL) {
+        free(buffer);
+        free(out);
+        eadf_errno = EADFERROR_NOMEMORY;
+        return EADFSTATUS_FAILURE;
+    }
+
+    syncByteTable(EADF_SYNCWORD, syncTable);
+
+    for (track = 0; track < h->numTracks; track++) {
+        l = &layouts[track];
+        memset(l, 0, sizeof(EADFTrackLayout));
+        if (h->trackSizeBytes[track] == 0)
+            continue;
+
+        if (h->trackType[track] == EADFTRACKTYPE_DOS) {
+            l->trackClass = eadfClassifyTrack(NULL, h->trackSizeBytes[track],
+                EADFTRACKTYPE_DOS, 0, 0);
+            continue;
+        }
+
+        if (eadfReadTrack(h, f, n, track, buffer) != EADFSTATUS_SUCCESS) {
+            free(buffer);
+            free(out);
+            return EADFSTATUS_FAILURE;
+        }
+
+        numBits = eadfTrackBits(h, track);
+        l->numSyncs = bitstreamFindSyncs(buffer, numBits, EADF_SYNCWORD,
+            syncTable, l->syncPos, EADF_MAXSYNCS, &l->maxGap);
+
+        found = mfmDecodeSectors(buffer, numBits, track, out);
+        for (; found != 0; found &= found - 1) {
+            l->numSectors++;
+        }
+
+        l->trackClass = eadfClassifyTrack(buffer, h->trackSizeBytes[track],
+            h->trackType[track], l->numSyncs, l->numSectors);
+    }
+
+    free(buffer);
+    free(out);
+    return EADFSTATUS_SUCCESS;
+}
+
+/*
+** Return the size in bytes of an open file, or -1 on failure.
+*/
+long eadfFileSize(FILE *f)
+{
+    if (eadfSeek(f, 0, SEEK_END) < 0)
+        return -1;
+
+    return ftell(f);
+}
+
+/*
+** Read entry "index" of the index of a bundle.
+*/
+EADFStatus eadfBundleReadEntry(FILE *f, unsigned long index,
+    EADFBundleEntry *entry)
+{
+    unsigned char buf[EADFBUNDLE_ENTRYSIZE];
+
+    if (eadfSeek(f, EADFBUNDLE_HEADERSIZE + index * EADFBUNDLE_ENTRYSIZE,
+            SEEK_SET) < 0)
+    {
+        eadf_errno = EADFERROR_SEEKERROR;
+        return EADFSTATUS_FAILURE;
+    }
+
+    if (eadfRead(buf, 1, EADFBUNDLE_ENTRYSIZE, f) < EADFBUNDLE_ENTRYSIZE) {
+        eadf_errno = ferror(f) ? EADFERROR_READERROR : EADFERROR_EOFERROR;
+        return EADFSTATUS_FAILURE;
+    }
+
+    memcpy(entry->name, buf, EADFBUNDLE_NAMELEN);
+    entry->name[EADFBUNDLE_NAMELEN] = '\0';
+    entry->offset = longFromBigEndianBytes(buf + EADFBUNDLE_NAMELEN);
+    entry->size = longFromBigEndianBytes(buf + EADFBUNDLE_NAMELEN + 4);
+    entry->numTracks = longFromBigEndianBytes(buf + EADFBUNDLE_NAMELEN + 8);
+    entry->headerCrc = longFromBigEndianBytes(buf + EADFBUNDLE_NAMELEN + 12);
+
+    return EADFSTATUS_SUCCESS;
+}
+
+/*
+** Check that "f" is a bundle and set *numImages to the number of images
+** it holds.
+*/
+EADFStatus eadfBundleReadHeader(FILE *f, unsigned long *numImages)
+{
+    unsigned char buf[EADFBUNDLE_HEADERSIZE];
+
+    if (eadfRead(buf, 1, EADFBUNDLE_HEADERSIZE, f) < EADFBUNDLE_HEADERSIZE
+        || memcmp(buf, EADFBUNDLE_MAGIC, EADF_MAGICLEN))
+    {
+        eadf_errno = ferror(f) ? EADFERROR_READERROR : EADFERROR_NOTABUNDLE;
+        return EADFSTATUS_FAILURE;
+    }
+
+    *numImages = longFromBigEndianBytes(buf + EADF_MAGICLEN);
+    return EADFSTATUS_SUCCESS;
+}
+
+/*
+** Find the image called "name" in a bundle. The index is sorted by
+** name, so this reads only a few of its entries however many images
+** the bundle holds.
+*/
+EADFStatus eadfBundleFind(FILE *f, const char *name, EADFBundleEntry *entry)
+{
+    unsigned long numImages, low = 0, high, mid;
+    int cmp;
+
+    if (eadfBundleReadHeader(f, &numImages) != EADFSTATUS_SUCCESS)
+        return EADFSTATUS_FAILURE;
+
+    high = numImages;
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (eadfBundleReadEntry(f, mid, entry) != EADFSTATUS_SUCCESS)
+            return EADFSTATUS_FAILURE;
+
+        cmp = strcmp(name, entry->name);
+        if (cmp == 0)
+            return EADFSTATUS_SUCCESS;
+
+        if (cmp < 0) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+
+    eadf_errno = EADFERROR_NOSUCHIMAGE;
+    return EADFSTATUS_FAILURE;
+}
+
+/*
+** Check that the header of the image of a bundle given by "entry" is
+** the one recorded in the index, and leave "f" at the start of the
+** image. The header is CRCed as it is stored, which gives what
+** eadfHeaderCrc() gave when the bundle was written without parsing it.
+*/
+EADFStatus eadfBundleCheckImage(FILE *f, const EADFBundleEntry *entry)
+{
+    unsigned char buf[32 * EADF_BYTESPERRECORD];
+    unsigned long crc, left, n;
+
+    if (entry->size < EADF_MAGICLEN + 4 || entry->numTracks
+        > (entry->size - EADF_MAGICLEN - 4) / EADF_BYTESPERRECORD)
+    {
+        eadf_errno = EADFERROR_BUNDLEMISMATCH;
+        return EADFSTATUS_FAILURE;
+    }
+
+    if (eadfSeek(f, entry->offset, SEEK_SET) < 0) {
+        eadf_errno = EADFERROR_SEEKERROR;
+        return EADFSTATUS_FAILURE;
+    }
+
+    crc = CRC_INIT;
+    left = EADF_MAGICLEN + 4 + entry->numTracks * EADF_BYTESPERRECORD;
+    while (left > 0) {
+        n = (left < sizeof(buf)) ? left : sizeof(buf);
+        if (eadfRead(buf, 1, n, f) < n) {
+            eadf_errno = ferror(f) ? EADFERROR_READERROR
+                                   : EADFERROR_EOFERROR;
+            return EADFSTATUS_FAILURE;
+        }
+        crc = crcUpdate(crc, buf, n);
+        left -= n;
+    }
+
+    if (crcFinal(crc) != entry->headerCrc) {
+        eadf_errno = EADFERROR_BUNDLEMISMATCH;
+        return EADFSTATUS_FAILURE;
+    }
+
+    if (eadfSeek(f, entry->offset, SEEK_SET) < 0) {
+        eadf_errno = EADFERROR_SEEKERROR;
+        return EADFSTATUS_FAILURE;
+    }
+
+    return EADFSTATUS_SUCCESS;
+}
+
+/*
+** Write the header and index of a bundle of "numImages" images to
+** "dest". The entries must be sorted by name and have their sizes
+** filled in; their offsets are set here, each image starting on an
+** EADFBUNDLE_ALIGN byte boundary.
+*/
+EADFStatus eadfBundleWriteIndex(FILE *dest, unsigned long numImages,
+    EADFBundleEntry *entries)
+{
+    unsigned char buf[EADFBUNDLE_ENTRYSIZE];
+    unsigned long offset, i;
+
+    offset = EADFBUNDLE_HEADERSIZE + numImages * EADFBUNDLE_ENTRYSIZE;
+    for (i = 0; i < numImages; i++) {
+        offset = (offset + EADFBUNDLE_ALIGN - 1) / EADFBUNDLE_ALIGN
+            * EADFBUNDLE_ALIGN;
+        if (entries[i].size > 0xffffffffUL - offset) {
+            eadf_errno = EADFERROR_BUNDLETOOLARGE;
+            return EADFSTATUS_FAILURE;
+        }
+        entries[i].offset = offset;
+        offset += entries[i].size;
+    }
+
+    memset(buf, 0, EADFBUNDLE_HEADERSIZE);
+    memcpy(buf, EADFBUNDLE_MAGIC, EADF_MAGICLEN);
+    bigEndianBytesFromLong(buf + EADF_MAGICLEN, numImages);
+    if (eadfWrite(buf, 1, EADFBUNDLE_HEADERSIZE, dest)
+        < EADFBUNDLE_HEADERSIZE)
+    {
+        eadf_errno = EADFERROR_WRITEERROR;
+        return EADFSTATUS_FAILURE;
+    }
+
+    for (i = 0; i < numImages; i++) {
+        memset(buf, 0, EADFBUNDLE_NAMELEN);
+        strncpy((char *)buf, entries[i].name, EADFBUNDLE_NAMELEN);
+        bigEndianBytesFromLong(buf + EADFBUNDLE_NAMELEN, entries[i].offset);
+        bigEndianBytesFromLong(buf + EADFBUNDLE_NAMELEN + 4,
+            entries[i].size);
+        bigEndianBytesFromLong(buf + EADFBUNDLE_NAMELEN + 8,
+            entries[i].numTracks);
+        bigEndianBytesFromLong(buf + EADFBUNDLE_NAMELEN + 12,
+            entries[i].headerCrc);
+
+        if (eadfWrite(buf, 1, EADFBUNDLE_ENTRYSIZE, dest)
+            < EADFBUNDLE_ENTRYSIZE)
+        {
+            eadf_errno = EADFERROR_WRITEERROR;
+            return EADFSTATUS_FAILURE;
+        }
+    }
+
+    return EADFSTATUS_SUCCESS;
+}
+
+/*
+** Copy an image into a bundle at the offset given by its entry, from
+** the start of "src". The gap before it is filled with zeros.
+*/
+EADFStatus eadfBundleWriteImage(FILE *dest, FILE *src,
+    const EADFBundleEntry *entry)
+{
+    unsigned char buffer[EADF_BUFSIZE];
+    unsigned long numBytes, count;
+    long position;
+
+    if ((position = ftell(dest)) < 0) {
+        eadf_errno = EADFERROR_SEEKERROR;
+        return EADFSTATUS_FAILURE;
+    }
+
+    memset(buffer, 0, EADFBUNDLE_ALIGN);
+    if (eadfWrite(buffer, 1, entry->offset - position, dest)
+        < entry->offset - position)
+    {
+        eadf_errno = EADFERROR_WRITEERROR;
+        return EADFSTATUS_FAILURE;
+    }
+
+    for (numBytes = entry->size; numBytes > 0; numBytes -= count) {
+        count = (numBytes > EADF_BUFSIZE) ? EADF_BUFSIZE : numBytes;
+
+        if (eadfRead(buffer, 1, count, src) < count) {
+            eadf_errno = ferror(src) ? EADFERROR_READERROR
+                : EADFERROR_EOFERROR;
+            return EADFSTATUS_FAILURE;
+        }
+
+        if (eadfWrite(buffer, 1, count, dest) < count) {
+            eadf_errno = EADFERROR_WRITEERROR;
+            return EADFSTATUS_FAILURE;
+        }
+    }
+
+    return EADFSTATUS_SUCCESS;
+}
+
+/*
+** Write a standard ADF image of ADF_NUMTRACKS tracks to "dest" from an
+** extended ADF file. Sectors which could not be decoded are written as
+** zeros and reported to stderr, and *numBad is set to their number.
+*/
+EADFStatus eadfWriteAdf(EADFHeader *h, FILE *f, const char *n, FILE *dest,
+    unsigned long *numBad)
+{
+    unsigned char *buffer, *out;
+    unsigned long track, sector, found;
+
+    *numBad = 0;
+    buffer = malloc(eadfMaxTrackSize(h) + 1);
+    out = malloc(ADF_TRACKSIZE);
+    if (buffer == NULL || out == NULL) {
+        free(buffer);
+        free(out);
+        eadf_errno = EADFERROR_NOMEMORY;
+        return EADFSTATUS_FAILURE;
+    }
+
+    for (track = 0; track < ADF_NUMTRACKS; track++) {
+        memset(out, 0, ADF_TRACKSIZE);
+        if (eadfDecodeTrack(h, f, n, track, buffer, out, &found)
+            != EADFSTATUS_SUCCESS)
+        {
+            free(buffer);
+            free(out);
+            return EADFSTATUS_FAILURE;
+        }
+
+        for (sector = 0; sector < ADF_SECTORSPERTRACK; sector++) {
+            if (found & (1UL << sector))
+                continue;
+
+            fprintf(stderr, "%s: track %lu sector %lu (block %lu) %s\n", n,
+                track, sector, track * ADF_SECTORSPERTRACK + sector,
+                (track < h->numTracks && h->trackSizeBytes[track] > 0)
+                    ? "is bad" : "is missing");
+            (*numBad)++;
+        }
+
+        if (eadfWrite(out, 1, ADF_TRACKSIZE, dest) < ADF_TRACKSIZE) {
+            free(buffer);
+            free(out);
+            eadf_errno = EADFERROR_WRITEERROR;
+            return EADFSTATUS_FAILURE;
+        }
+    }
+
+    free(buffer);
+    free(out);
+    return EADFSTATUS_SUCCESS;
+}
+
+/*
+** Set up a cache of "numSlots" decoded tracks.
+*/
+EADFStatus eadfTrackCacheInit(EADFTrackCache *c, unsigned long numSlots)
+{
+    unsigned char *data;
+    unsigned long i;
+
+    c->slots = malloc(numSlots * sizeof(EADFTrackCacheSlot));
+    data = malloc(numSlots * ADF_TRACKSIZE);
+    if (c->slots == NULL || data == NULL) {
+        free(c->slots);
+        free(data);
+        c->slots = NULL;
+        eadf_errno = EADFERROR_NOMEMORY;
+        return EADFSTATUS_FAILURE;
+    }
+
+    c->numSlots = numSlots;
+    c->clock = 0;
+    c->hits = 0;
+    c->misses = 0;
+    for (i = 0; i < numSlots; i++) {
+        c->slots[i].owner = NULL;
+        c->slots[i].lastUsed = 0;
+        c->slots[i].data = data + i * ADF_TRACKSIZE;
+    }
+
+    return EADFSTATUS_SUCCESS;
+}
+
+/*
+** Free the memory of a track cache set up by eadfTrackCacheInit().
+*/
+void eadfTrackCacheFree(EADFTrackCache *c)
+{
+    if (c->slots != NULL)
+        free(c->slots[0].data);
+    free(c->slots);
+    c->slots = NULL;
+}
+
+/*
+** Set up a view of the extended ADF file "f" as a standard ADF image
+** whose tracks are decoded as their blocks are read, and kept in the
+** cache "c", which may be shared with other views.
+*/
+EADFStatus eadfViewInit(EADFView *v, EADFHeader *h, FILE *f, const char *n,
+    EADFTrackCache *c)
+{
+    /* Room to read whole 32-bit words past the end of a track */
+    if ((v->buffer = malloc(eadfMaxTrackSize(h) + 4)) == NULL) {
+        eadf_errno = EADFERROR_NOMEMORY;
+        return EADFSTATUS_FAILURE;
+    }
+
+    v->h = h;
+    v->f = f;
+    v->name = n;
+    v->cache = c;
+    return EADFSTATUS_SUCCESS;
+}
+
+/*
+** Free a view, dropping its tracks from the cache.
+*/
+void eadfViewFree(EADFView *v)
+{
+    unsigned long i;
+
+    for (i = 0; i < v->cache->numSlots; i++) {
+        if (v->cache->slots[i].owner == v)
+            v->cache->slots[i].owner = NULL;
+    }
+
+    free(v->buffer);
+    v->buffer = NULL;
+}
+
+/*
+** Read block "block" of a view into the ADF_SECTORSIZE bytes at "out".
+** Only the track holding the block is decoded, unless it is already in
+** the cache; otherwise it replaces the least recently used track there.
+**
+** Returns EADFSTATUS_FAILURE with eadf_errno set to EADFERROR_BADSECTOR
+** if the block is missing or could not be decoded.
+*/
+EADFStatus eadfViewReadBlock(EADFView *v, unsigned long block,
+    unsigned char *out)
+{
+    EADFTrackCache *c = v->cache;
+    EADFTrackCacheSlot *slot = NULL;
+    unsigned long track = block / ADF_SECTORSPERTRACK, i;
+    unsigned long sector = block % ADF_SECTORSPERTRACK;
+
+    for (i = 0; i < c->numSlots; i++) {
+        if (c->slots[i].owner == v && c->slots[i].track == track) {
+            slot = &c->slots[i];
+            break;
+        }
+    }
+
+    if (slot != NULL) {
+        c->hits++;
+    } else {
+        c->misses++;
+        slot = &c->slots[0];
+        for (i = 1; i < c->numSlots && slot->owner != NULL; i++) {
+            if (c->slots[i].owner == NULL
+                || c->slots[i].lastUsed < slot->lastUsed)
+            {
+                slot = &c->slots[i];
+            }
+        }
+
+        slot->owner = NULL;
+        memset(slot->data, 0, ADF_TRACKSIZE);
+        if (eadfDecodeTrack(v->h, v->f, v->name, track, v->buffer,
+                slot->data, &slot->found) != EADFSTATUS_SUCCESS)
+        {
+            return EADFSTATUS_FAILURE;
+        }
+        slot->owner = v;
+        slot->track = track;
+    }
+    slot->lastUsed = ++c->clock;
+
+    if (!(slot->found & (1UL << sector))) {
+        eadf_errno = EADFERROR_BADSECTOR;
+        return EADFSTATUS_FAILURE;
+    }
+
+    memcpy(out, slot->data + sector * ADF_SECTORSIZE, ADF_SECTORSIZE);
+    return EADFSTATUS_SUCCESS;
+}
+
+/*
+** MFM encode the data bits of a 32-bit long, which must only use the
+** bits in MFM_DATAMASK, into four bytes at "out". A clock bit is set
+** between two zero data bits; *prev holds the last data bit written
+** and is updated.
+**
+** The clock bits of each byte depend only on its data bits and the
+** data bit before it, so they come from a table built on first use.
+*/
+void mfmEncodeLong(unsigned long value, unsigned char *out, unsigned int *prev)
+{
+    static unsigned char table[2][256];
+    static int tableInitialised = 0;
+    int i;
+
+    if (!tableInitialised) {
+        unsigned int p, b;
+        int bit;
+
+        for (p = 0; p < 2; p++) {
+            for (b = 0; b < 256; b++) {
+                unsigned int left = p, result = b & 0x55;
+
+                for (bit = 7; bit > 0; bit -= 2) {
+                    unsigned int right = (b >> (bit - 1)) & 1;
+
+                    if (!left && !right)
+                        result |= 1 << bit;
+                    left = right;
+                }
+                table[p][b] = result;
+            }
+        }
+        tableInitialised = 1;
+    }
+
+    for (i = 3; i >= 0; i--) {
+        unsigned int b = (value >> (i * 8)) & 0x55;
+
+        *out++ = table[*prev][b];
+        *prev = b & 1;
+    }
+}
+
+/*
+** MFM encode "numLongs" longs as their odd bits followed by their even
+** bits, as AmigaDOS stores each part of a sector. Returns the XOR of
+** the encoded data bits, from which sector checksums are made.
+*/
+unsigned long mfmEncodeOddEven(const unsigned long *values,
+    unsigned long numLongs, unsigned char *out, unsigned int *prev)
+{
+    unsigned long i, check = 0;
+
+    for (i = 0; i < numLongs; i++, out += 4) {
+        check ^= (values[i] >> 1) & MFM_DATAMASK;
+        mfmEncodeLong((values[i] >> 1) & MFM_DATAMASK, out, prev);
+    }
+
+    for (i = 0; i < numLongs; i++, out += 4) {
+        check ^= values[i] & MFM_DATAMASK;
+        mfmEncodeLong(values[i] & MFM_DATAMASK, out, prev);
+    }
+
+    return check;
+}
+
+/*
+** Encode the ADF_TRACKSIZE bytes at "data" as an AmigaDOS RAW track of
+** EADF_RAWTRACKSIZE bytes at "out": eleven sectors, each preceded by
+** its gap words and two sync words, followed by gap words to the end
+** of the track.
+*/
+void mfmEncodeTrack(const unsigned char *data, unsigned long track,
+    unsigned char *out)
+{
+    unsigned long longs[ADF_SECTORSIZE / 4], check, sector, i;
+    unsigned char *upto = out;
+    unsigned int prev = 0;
+
+    for (sector = 0; sector < ADF_SECTORSPERTRACK; sector++) {
+        mfmEncodeLong(0, upto, &prev);
+        upto += 4;
+        bigEndianBytesFromLong(upto, (EADF_SYNCWORD << 16) | EADF_SYNCWORD);
+        upto += 4;
+        prev = 1;
+
+        /* Info long and an empty label, then the header checksum */
+        longs[0] = (0xffUL << 24) | (track << 16) | (sector << 8)
+            | (ADF_SECTORSPERTRACK - sector);
+        check = mfmEncodeOddEven(longs, 1, upto, &prev);
+        upto += 8;
+        for (i = 0; i < 4; i++) {
+            longs[i] = 0;
+        }
+        check ^= mfmEncodeOddEven(longs, 4, upto, &prev);
+        upto += 32;
+        mfmEncodeOddEven(&check, 1, upto, &prev);
+        upto += 8;
+
+        /* The data checksum comes before the data it covers */
+        check = 0;
+        for (i = 0; i < ADF_SECTORSIZE / 4; i++) {
+            longs[i] = longFromBigEndianBytes(data
+                + sector * ADF_SECTORSIZE + i * 4);
+            check ^= (longs[i] ^ (longs[i] >> 1)) & MFM_DATAMASK;
+        }
+        mfmEncodeOddEven(&check, 1, upto, &prev);
+        upto += 8;
+        mfmEncodeOddEven(longs, ADF_SECTORSIZE / 4, upto, &prev);
+        upto += ADF_SECTORSIZE * 2;
+    }
+
+    while (upto < out + EADF_RAWTRACKSIZE) {
+        mfmEncodeLong(0, upto, &prev);
+        upto += 4;
+    }
+}
+
+/*
+** Write an extended ADF file to "dest" from the standard ADF image "f",
+** whose size in bytes is "size". Each track is stored either as a DOS
+** track, which is the sector data as it is, or as a RAW track encoded
+** by mfmEncodeTrack(). The file is written in a single pass.
+*/
+EADFStatus eadfFromAdf(FILE *f, unsigned long size, FILE *dest,
+    EADFTrackType type)
+{
+    unsigned char record[EADF_BYTESPERRECORD], *data, *raw;
+    unsigned long numTracks, track, trackBytes;
+
+    if (size == 0 || size % ADF_TRACKSIZE != 0
+        || size / ADF_TRACKSIZE > EADF_MAXTRACKS)
+    {
+        eadf_errno = EADFERROR_INVALIDADF;
+        return EADFSTATUS_FAILURE;
+    }
+    numTracks = size / ADF_TRACKSIZE;
+    trackBytes = (type == EADFTRACKTYPE_DOS) ? ADF_TRACKSIZE
+                                             : EADF_RAWTRACKSIZE;
+
+    memcpy(record, EADF_MAGIC, EADF_MAGICLEN);
+    bigEndianBytesFromLong(record + EADF_MAGICLEN, numTracks);
+    if (eadfWrite(record, 1, EADF_MAGICLEN + 4, dest) < EADF_MAGICLEN + 4) {
+        eadf_errno = EADFERROR_WRITEERROR;
+        return EADFSTATUS_FAILURE;
+    }
+
+    bigEndianBytesFromLong(record, type);
+    bigEndianBytesFromLong(record + 4, trackBytes);
+    bigEndianBytesFromLong(record + 8, trackBytes * 8);
+    for (track = 0; track < numTracks; track++) {
+        if (eadfWrite(record, 1, EADF_BYTESPERRECORD, dest)
+            < EADF_BYTESPERRECORD)
+        {
+            eadf_errno = EADFERROR_WRITEERROR;
+            return EADFSTATUS_FAILURE;
+        }
+    }
+
+    data = malloc(ADF_TRACKSIZE);
+    raw = malloc(EADF_RAWTRACKSIZE);
+    if (data == NULL || raw == NULL) {
+        free(data);
+        free(raw);
+        eadf_errno = EADFERROR_NOMEMORY;
+        return EADFSTATUS_FAILURE;
+    }
+
+    for (track = 0; track < numTracks; track++) {
+        if (eadfRead(data, 1, ADF_TRACKSIZE, f) < ADF_TRACKSIZE) {
+            free(data);
+            free(raw);
+            eadf_errno = feof(f) ? EADFERROR_EOFERROR : EADFERROR_READERROR;
+            return EADFSTATUS_FAILURE;
+        }
+
+        if (type == EADFTRACKTYPE_RAW)
+            mfmEncodeTrack(data, track, raw);
+
+        if (eadfWrite((type == EADFTRACKTYPE_RAW) ? raw : data, 1,
+                trackBytes, dest) < trackBytes)
+        {
+            free(data);
+            free(raw);
+            eadf_errno = EADFERROR_WRITEERROR;
+            return EADFSTATUS_FAILURE;
+        }
+    }
+
+    free(data);
+    free(raw);
+    return EADFSTATUS_SUCCESS;
+}
+
+/*
+** Read a track of an extended ADF file into "out" as the MFM bitstream
+** a drive would see: RAW tracks as they are and DOS tracks encoded by
+** mfmEncodeTrack(). A RAW track read over more than one revolution is
+** cut to one, starting at its first sync word, as canonicalize does.
+** *numBits is set to its length, which is zero for an empty track or a
+** DOS track of the wrong size. "buffer" must hold ADF_TRACKSIZE bytes,
+** and "out" the track's data and at least EADF_RAWTRACKSIZE bytes.
+*/
+EADFStatus eadfReadBitstream(EADFHeader *h, FILE *f, const char *n,
+    unsigned long track, unsigned char *buffer, unsigned char *out,
+    unsigned long *numBits)
+{
+    unsigned long period, bit, i;
+    long sync;
+
+    *numBits = 0;
+    if (track >= h->numTracks || h->trackSizeBytes[track] == 0)
+        return EADFSTATUS_SUCCESS;
+
+    if (h->trackType[track] == EADFTRACKTYPE_DOS) {
+        if (h->trackSizeBytes[track] != ADF_TRACKSIZE)
+            return EADFSTATUS_SUCCESS;
+
+        if (eadfReadTrack(h, f, n, track, buffer) != EADFSTATUS_SUCCESS)
+            return EADFSTATUS_FAILURE;
+
+        mfmEncodeTrack(buffer, track, out);
+        *numBits = EADF_RAWTRACKSIZE * 8;
+        return EADFSTATUS_SUCCESS;
+    }
+
+    if (eadfReadTrack(h, f, n, track, out) != EADFSTATUS_SUCCESS)
+        return EADFSTATUS_FAILURE;
+
+    *numBits = eadfTrackBits(h, track);
+    if ((sync = bitstreamFindSync(out, *numBits, 0, EADF_SYNCWORD)) >= 0
+        && (period = bitstreamRevolution(out, *numBits, sync)) != 0)
+    {
+        /* Each bit is moved down before anything is written over it */
+        for (i = 0; i < period; i++) {
+            bit = sync + i;
+            if (out[bit >> 3] & (0x80 >> (bit & 7)))
+                out[i >> 3] |= 0x80 >> (i & 7);
+            else
+                out[i >> 3] &= ~(0x80 >> (i & 7));
+        }
+        *numBits = period;
+    }
+
+    /*
+    ** Fill the rest of the last byte with the cells of MFM encoded
+    ** zeros, never after a 1, so that formats written in whole bytes
+    ** do not carry what was left there.
+    */
+    for (i = *numBits; (i & 7) != 0; i++) {
+        if ((i & 1) == 0 && !(out[(i - 1) >> 3] & (0x80 >> ((i - 1) & 7))))
+            out[i >> 3] |= 0x80 >> (i & 7);
+        else
+            out[i >> 3] &= ~(0x80 >> (i & 7));
+    }
+    return EADFSTATUS_SUCCESS;
+}
+
+/*
+** Write an HFE image of an extended ADF file to "dest". Each cylinder is
+** read and written in turn, so only its two tracks are held in memory,
+** and the track list is written once the length of each is known. A
+** side shorter than the other is padded with MFM encoded zeros, as are
+** empty tracks, which are as long as one written by trackdisk.device.
+*/
+EADFStatus eadfWriteHfe(EADFHeader *h, FILE *f, const char *n, EADFIO *dest)
+{
+    unsigned char block[HFE_BLOCKSIZE], reversed[256], *buffer, *sides[2];
+    unsigned char *list, *entry;
+    unsigned long numCylinders, listBlocks, cyl, side, sideBytes, maxBytes;
+    unsigned long numBits, numBytes, offset, i, b;
+    EADFStatus status = EADFSTATUS_SUCCESS;
+
+    numCylinders = (h->numTracks + 1) / 2;
+    if (numCylinders > HFE_MAXCYLINDERS) {
+        eadf_errno = EADFERROR_TOOMANYTRACKS;
+        return EADFSTATUS_FAILURE;
+    }
+
+    for (b = 0; b < 256; b++) {
+        reversed[b] = 0;
+        for (i = 0; i < 8; i++) {
+            if (b & (1 << i))
+                reversed[b] |= 0x80 >> i;
+        }
+    }
+
+    memset(block, 0xff, HFE_BLOCKSIZE);
+    memcpy(block, HFE_MAGIC, 8);
+    block[8] = 0;
+    block[9] = numCylinders;
+    block[10] = 2;
+    block[11] = HFE_AMIGAMFM;
+    block[12] = HFE_BITRATE & 0xff;
+    block[13] = HFE_BITRATE >> 8;
+    block[14] = HFE_RPM & 0xff;
+    block[15] = HFE_RPM >> 8;
+    block[16] = HFE_AMIGADD;
+    block[17] = 0;
+    block[18] = 1;
+    block[19] = 0;
+    block[23] = HFE_AMIGAMFM;
+    block[25] = HFE_AMIGAMFM;
+    if (dest->write(dest, 0, block, HFE_BLOCKSIZE) < HFE_BLOCKSIZE)
+        return EADFSTATUS_FAILURE;
+
+    /* Each side is padded to a whole number of half blocks */
+    maxBytes = eadfMaxTrackSize(h);
+    if (maxBytes < EADF_RAWTRACKSIZE)
+        maxBytes = EADF_RAWTRACKSIZE;
+    maxBytes = (maxBytes + HFE_BLOCKSIZE / 2 - 1) / (HFE_BLOCKSIZE / 2)
+        * (HFE_BLOCKSIZE / 2);
+    listBlocks = (numCylinders * 4 + HFE_BLOCKSIZE - 1) / HFE_BLOCKSIZE;
+    list = malloc(listBlocks * HFE_BLOCKSIZE);
+    buffer = malloc(ADF_TRACKSIZE);
+    sides[0] = malloc(maxBytes);
+    sides[1] = malloc(maxBytes);
+    if (list == NULL || buffer == NULL || sides[0] == NULL
+        || sides[1] == NULL)
+    {
+        free(list);
+        free(buffer);
+        free(sides[0]);
+        free(sides[1]);
+        eadf_errno = EADFERROR_NOMEMORY;
+        return EADFSTATUS_FAILURE;
+    }
+
+    /* The track list gives each cylinder's first block and length */
+    memset(list, 0xff, listBlocks * HFE_BLOCKSIZE);
+    offset = 1 + listBlocks;
+    for (cyl = 0; cyl < numCylinders && status == EADFSTATUS_SUCCESS;
+         cyl++)
+    {
+        sideBytes = 0;
+        for (side = 0; side < 2; side++) {
+            if (eadfReadBitstream(h, f, n, cyl * 2 + side, buffer,
+                    sides[side], &numBits) != EADFSTATUS_SUCCESS)
+            {
+                status = EADFSTATUS_FAILURE;
+                break;
+            }
+
+            numBytes = (numBits + 7) / 8;
+            memset(sides[side] + numBytes, 0xaa, maxBytes - numBytes);
+            if (numBits == 0)
+                numBytes = EADF_RAWTRACKSIZE;
+            if (numBytes > sideBytes)
+                sideBytes = numBytes;
+        }
+
+        /* The track list holds the length of both sides in 16 bits */
+        if (status == EADFSTATUS_SUCCESS && sideBytes * 2 > 0xffff) {
+            eadf_errno = EADFERROR_TRACKTOOLONG;
+            status = EADFSTATUS_FAILURE;
+        }
+        if (status != EADFSTATUS_SUCCESS)
+            break;
+
+        entry = list + cyl * 4;
+        entry[0] = offset & 0xff;
+        entry[1] = (offset >> 8) & 0xff;
+        entry[2] = (sideBytes * 2) & 0xff;
+        entry[3] = ((sideBytes * 2) >> 8) & 0xff;
+
+        for (i = 0; i < sideBytes; i += HFE_BLOCKSIZE / 2) {
+            for (b = 0; b < HFE_BLOCKSIZE / 2; b++) {
+                block[b] = reversed[sides[0][i + b]];
+                block[b + HFE_BLOCKSIZE / 2] = reversed[sides[1][i + b]];
+            }
+
+            if (dest->write(dest, offset * HFE_BLOCKSIZE, block,
+                    HFE_BLOCKSIZE) < HFE_BLOCKSIZE)
+            {
+                status = EADFSTATUS_FAILURE;
+                break;
+            }
+            offset++;
+        }
+    }
+
+    if (status == EADFSTATUS_SUCCESS
+        && dest->write(dest, HFE_BLOCKSIZE, list, listBlocks * HFE_BLOCKSIZE)
+           < listBlocks * HFE_BLOCKSIZE)
+    {
+        status = EADFSTATUS_FAILURE;
+    }
+
+    free(list);
+    free(buffer);
+    free(sides[0]);
+    free(sides[1]);
+    return status;
+}
+
+/*
+** Convert a bitstream of "numBits" MFM cells into SCP flux times at
+** "out", returning their number. Cells last 2us, unless the track is
+** a little too long to fit one revolution, in which case they are
+** shortened so that it just does, as when it was written. A track of
+** more than SCP_MAXCELLS, which was not found to repeat, is cut to one
+** revolution instead. The time from the last flux transition round to
+** the first is given to the first, so the times add up to
+** SCP_REVOLUTION.
+*/
+unsigned long scpFluxFromBitstream(const unsigned char *bits,
+    unsigned long numBits, unsigned char *out)
+{
+    unsigned long numCells, bit, last = 0, count = 0;
+    double cellTicks;
+    long previous, ticks, value;
+
+    if (numBits > SCP_MAXCELLS)
+        numBits = SCP_REVOLUTIONCELLS;
+    numCells = (numBits > SCP_REVOLUTIONCELLS) ? numBits
+                                               : SCP_REVOLUTIONCELLS;
+    cellTicks = (double)SCP_REVOLUTION / numCells;
+
+    for (bit = 0; bit < numBits; bit++) {
+        if (bits[bit / 8] & (0x80 >> (bit % 8)))
+            last = bit;
+    }
+    previous = (long)(last * cellTicks) - (long)SCP_REVOLUTION;
+
+    for (bit = 0; bit < numBits; bit++) {
+        if (!(bits[bit / 8] & (0x80 >> (bit % 8))))
+            continue;
+
+        ticks = (long)(bit * cellTicks);
+        value = ticks - previous;
+        previous = ticks;
+
+        /* Times of 65536 ticks or more are preceded by overflow zeros */
+        for (; value > 0xffffL; value -= 0x10000L) {
+            out[count * 2] = 0;
+            out[count * 2 + 1] = 0;
+            count++;
+        }
+
+        /* One tick late rather than a zero, which would be an overflow */
+        if (value == 0)
+            value = 1;
+        out[count * 2] = (value >> 8) & 0xff;
+        out[count * 2 + 1] = value & 0xff;
+        count++;
+    }
+
+    return count;
+}
+
+/*
+** Write an SCP flux image of an extended ADF file to "dest", holding
+** one revolution of each track which is not empty. Tracks are read
+** and written one at a time; the track table and the checksum of the
+** header are filled in once all of them have been written.
+*/
+EADFStatus eadfWriteScp(EADFHeader *h, FILE *f, const char *n, EADFIO *dest)
+{
+    unsigned char header[SCP_HEADERSIZE], table[SCP_MAXTRACKS * 4];
+    unsigned char *buffer, *bits, *flux;
+    unsigned long track, numBits, numFlux, maxBits, offset, length, i;
+    unsigned long checksum = 0;
+
+    if (h->numTracks > SCP_MAXTRACKS) {
+        eadf_errno = EADFERROR_TOOMANYTRACKS;
+        return EADFSTATUS_FAILURE;
+    }
+
+    /* A flux time per cell at most, plus the zeros of long ones */
+    maxBits = eadfMaxTrackSize(h);
+    if (maxBits < EADF_RAWTRACKSIZE)
+        maxBits = EADF_RAWTRACKSIZE;
+    maxBits *= 8;
+    buffer = malloc(ADF_TRACKSIZE);
+    bits = malloc(maxBits / 8);
+    flux = malloc(SCP_TRACKHEADERSIZE
+        + (maxBits + SCP_REVOLUTION / 0x10000L + 1) * 2);
+    if (buffer == NULL || bits == NULL || flux == NULL) {
+        free(buffer);
+        free(bits);
+        free(flux);
+        eadf_errno = EADFERROR_NOMEMORY;
+        return EADFSTATUS_FAILURE;
+    }
+
+    memset(table, 0, sizeof(table));
+    offset = SCP_HEADERSIZE + sizeof(table);
+    for (track = 0; track < h->numTracks; track++) {
+        if (eadfReadBitstream(h, f, n, track, buffer, bits, &numBits)
+            != EADFSTATUS_SUCCESS)
+        {
+            free(buffer);
+            free(bits);
+            free(flux);
+            return EADFSTATUS_FAILURE;
+        }
+
+        if (numBits == 0)
+            continue;
+
+        numFlux = scpFluxFromBitstream(bits, numBits,
+            flux + SCP_TRACKHEADERSIZE);
+        memcpy(flux, "TRK", 3);
+        flux[3] = track;
+        littleEndianBytesFromLong(flux + 4, SCP_REVOLUTION);
+        littleEndianBytesFromLong(flux + 8, numFlux);
+        littleEndianBytesFromLong(flux + 12, SCP_TRACKHEADERSIZE);
+
+        length = SCP_TRACKHEADERSIZE + numFlux * 2;
+        if (dest->write(dest, offset, flux, length) < length) {
+            free(buffer);
+            free(bits);
+            free(flux);
+            return EADFSTATUS_FAILURE;
+        }
+
+        for (i = 0; i < length; i++) {
+            checksum += flux[i];
+        }
+        littleEndianBytesFromLong(table + track * 4, offset);
+        offset += length;
+    }
+
+    free(buffer);
+    free(bits);
+    free(flux);
+
+    for (i = 0; i < sizeof(table); i++) {
+        checksum += table[i];
+    }
+
+    memcpy(header, SCP_MAGIC, 3);
+    header[3] = SCP_VERSION;
+    header[4] = SCP_AMIGA;
+    header[5] = 1;
+    header[6] = 0;
+    header[7] = (h->numTracks > 0) ? h->numTracks - 1 : 0;
+    header[8] = SCP_FLAGS;
+    header[9] = 0;
+    header[10] = 0;
+    header[11] = 0;
+    littleEndianBytesFromLong(header + 12, checksum);
+
+    if (dest->write(dest, SCP_HEADERSIZE, table, sizeof(table))
+        < sizeof(table)
+        || dest->write(dest, 0, header, SCP_HEADERSIZE) < SCP_HEADERSIZE)
+    {
+        return EADFSTATUS_FAILURE;
+    }
+
+    return EADFSTATUS_SUCCESS;
+}
+/*
+** End of EADF stuff
+*/
+
+/*
+** Split a line into words separated by white space, storing pointers
+** to them in "words" and terminating each with '\0'. Anything from a
+** '#' to the end of the line is ignored.
+**
+** Returns the number of words, or -1 if there are more than "max".
+*/
+int splitLine(char *line, char **words, int max)
+{
+    int numWords = 0;
+
+    for (;;) {
+        while (*line == ' ' || *line == '\t' || *line == '\r'
+               || *line == '\n')
+        {
+            line++;
+        }
+
+        if (*line == '\0' || *line == '#')
+            return numWords;
+
+        if (numWords == max)
+            return -1;
+        words[numWords++] = line;
+
+        while (*line != '\0' && *line != ' ' && *line != '\t'
+               && *line != '\r' && *line != '\n' && *line != '#')
+        {
+            line++;
+        }
+
+        if (*line == '#') {
+            *line = '\0';
+            return numWords;
+        }
+
+        if (*line != '\0')
+            *line++ = '\0';
+    }
+}
+
+/*
+** A line of an assemble recipe: the index of the source it names and
+** its TRACKSPECs, kept until the sources are open and the number of
+** tracks is known.
+*/
+typedef struct RecipeLine {
+    unsigned long source;
+    CommandTrackSpecs specs;
+    struct RecipeLine *next;
+} RecipeLine;
+
+/*
+** Read an assemble recipe from "f", storing its lines, in order, in a
+** list from the arena at *lines, and the list of source names in
+** *sources. A new name is added to *sources the first time it appears;
+** no recipe needs more than EADF_MAXTRACKS, as each track has one
+** source.
+*/
+CommandStatus readRecipe(FILE *f, const char *name, RecipeLine **lines,
+    char ***sources, unsigned long *numSources)
+{
+    char line[COMMAND_BUFSIZE], *words[COMMAND_MAXWORDS], *copy;
+    char **specs, **more;
+    unsigned long lineNum = 0, maxSources = 0, i;
+    RecipeLine *l, **tail = lines;
+    int numWords, j;
+
+    *lines = NULL;
+    *sources = NULL;
+    *numSources = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        lineNum++;
+        if (strchr(line, '\n') == NULL && !feof(f)) {
+            fprintf(stderr, "%s:%lu: Line too long\n", name, lineNum);
+            command_errno = COMMANDERROR_INVALIDRECIPE;
+            return COMMANDSTATUS_FAILURE;
+        }
+
+        /* The words of the line are kept with it, so split a copy */
+        if ((copy = eadfArenaAlloc(strlen(line) + 1)) == NULL) {
+            command_errno = COMMANDERROR_NOMEMORY;
+            return COMMANDSTATUS_FAILURE;
+        }
+        strcpy(copy, line);
+
+        numWords = splitLine(copy, words, COMMAND_MAXWORDS);
+        if (numWords == 0)
+            continue;
+
+        if (numWords < 2) {
+            fprintf(stderr, "%s:%lu: Expected TRACKSPEC... SOURCE\n", name,
+                lineNum);
+            command_errno = COMMANDERROR_INVALIDRECIPE;
+            return COMMANDSTATUS_FAILURE;
+        }
+
+        for (i = 0; i < *numSources; i++) {
+            if (!strcmp((*sources)[i], words[numWords - 1]))
+                break;
+        }
+
+        if (i == *numSources) {
+            if (i == EADF_MAXTRACKS) {
+                fprintf(stderr, "%s:%lu: Too many sources\n", name, lineNum);
+                command_errno = COMMANDERROR_INVALIDRECIPE;
+                return COMMANDSTATUS_FAILURE;
+            }
+
+            if (i == maxSources) {
+                maxSources = maxSources ? 2 * maxSources : 16;
+                more = realloc(*sources, maxSources * sizeof(char *));
+                if (more == NULL) {
+                    command_errno = COMMANDERROR_NOMEMORY;
+                    return COMMANDSTATUS_FAILURE;
+                }
+                *sources = more;
+            }
+
+            (*sources)[i] = malloc(strlen(words[numWords - 1]) + 1);
+            if ((*sources)[i] == NULL) {
+                command_errno = COMMANDERROR_NOMEMORY;
+                return COMMANDSTATUS_FAILURE;
+            }
+            strcpy((*sources)[i], words[numWords - 1]);
+            (*numSources)++;
+        }
+
+        if (parseTrackSpecs(numWords - 1, words, 0, NULL, 0,
+                (EADFTrackSource)(EADFTRACKSOURCE_SOURCE1 + i))
+            != COMMANDSTATUS_SUCCESS)
+        {
+            fprintf(stderr, "%s:%lu: ", name, lineNum);
+            commandPrintErrorWithContext(NULL);
+            command_errno = COMMANDERROR_INVALIDRECIPE;
+            return COMMANDSTATUS_FAILURE;
+        }
+
+        l = eadfArenaAlloc(sizeof(RecipeLine));
+        specs = eadfArenaAlloc((numWords - 1) * sizeof(char *));
+        if (l == NULL || specs == NULL) {
+            command_errno = COMMANDERROR_NOMEMORY;
+            return COMMANDSTATUS_FAILURE;
+        }
+
+        for (j = 0; j < numWords - 1; j++) {
+            specs[j] = words[j];
+        }
+        l->source = i;
+        l->specs.argc = numWords - 1;
+        l->specs.argv = specs;
+        l->specs.start = 0;
+        l->next = NULL;
+        *tail = l;
+        tail = &l->next;
+    }
+
+    if (ferror(f)) {
+        perror(name);
+        command_errno = COMMANDERROR_READERROR;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    return COMMANDSTATUS_SUCCESS;
+}
+
+/*
+** Assemble an extended ADF file from the sources named in "sources",
+** taking each track from the source the recipe "lines" give for it.
+*/
+CommandStatus assembleFiles(unsigned long numSources, char **sources,
+    const char *dest, const RecipeLine *lines)
+{
+    EADFHeader *h, **hs;
+    EADFIO *io, **ios, out;
+    FILE **fs, *f;
+    EADFChecksums *sums = NULL;
+    EADFTrackSource *trackSources;
+    unsigned long numOpen, numTracks = 0, i;
+    CommandStatus status = COMMANDSTATUS_SUCCESS;
+    double start;
+
+    h = calloc(numSources, sizeof(EADFHeader));
+    hs = malloc(numSources * sizeof(EADFHeader *));
+    fs = malloc(numSources * sizeof(FILE *));
+    io = eadfArenaAlloc(numSources * sizeof(EADFIO));
+    ios = eadfArenaAlloc(numSources * sizeof(EADFIO *));
+    if (option_manifest)
+        sums = calloc(1, sizeof(EADFChecksums));
+    if (h == NULL || hs == NULL || fs == NULL || io == NULL || ios == NULL
+        || (option_manifest && sums == NULL))
+    {
+        free(h);
+        free(hs);
+        free(fs);
+        free(sums);
+        command_errno = COMMANDERROR_NOMEMORY;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    for (numOpen = 0; numOpen < numSources; numOpen++) {
+        hs[numOpen] = &h[numOpen];
+        if ((fs[numOpen] = openImage(sources[numOpen])) == NULL) {
+            command_errno = COMMANDERROR_CANNOTOPENFILE;
+            status = COMMANDSTATUS_FAILURE;
+            break;
+        }
+
+        if (eadfHeaderInitWithFile(hs[numOpen], fs[numOpen])
+            != EADFSTATUS_SUCCESS)
+        {
+            eadfPrintErrorWithContext(sources[numOpen]);
+            fclose(fs[numOpen]);
+            command_errno = COMMANDERROR_INVALIDFILE;
+            status = COMMANDSTATUS_FAILURE;
+            break;
+        }
+
+        ios[numOpen] = &io[numOpen];
+        eadfIOInitFile(ios[numOpen], fs[numOpen]);
+        if (hs[numOpen]->numTracks > numTracks)
+            numTracks = hs[numOpen]->numTracks;
+    }
+
+    if (status == COMMANDSTATUS_SUCCESS) {
+        start = statsClock();
+        trackSources = eadfArenaAlloc(numTracks * sizeof(EADFTrackSource));
+        if (trackSources == NULL) {
+            command_errno = COMMANDERROR_NOMEMORY;
+            status = COMMANDSTATUS_FAILURE;
+        } else {
+            for (i = 0; i < numTracks; i++) {
+                trackSources[i] = EADFTRACKSOURCE_NONE;
+            }
+            for (; lines != NULL; lines = lines->next) {
+                parseTrackSpecs(lines->specs.argc, lines->specs.argv,
+                    lines->specs.start, trackSources, numTracks,
+                    (EADFTrackSource)(EADFTRACKSOURCE_SOURCE1
+                                      + lines->source));
+            }
+        }
+        statsAddTime(EADFPHASE_PLANNING, start);
+    }
+
+    if (status == COMMANDSTATUS_SUCCESS) {
+        if ((f = fopen(dest, "wb")) == NULL) {
+            perror(dest);
+            command_errno = COMMANDERROR_CANNOTOPENFILE;
+            status = COMMANDSTATUS_FAILURE;
+        } else {
+            start = statsClock();
+            eadfIOInitFile(&out, f);
+            if (eadfAssembleFiles(numSources, hs, ios, &out, numTracks,
+                    trackSources, sums)
+                != EADFSTATUS_SUCCESS)
+            {
+                eadfPrintErrorWithContext(NULL);
+                command_errno = COMMANDERROR_MERGEERROR;
+                status = COMMANDSTATUS_FAILURE;
+            }
+            statsAddTime(EADFPHASE_COPY, start);
+            fclose(f);
+        }
+    }
+
+    for (i = 0; i < numOpen; i++) {
+        fclose(fs[i]);
+    }
+
+    if (status == COMMANDSTATUS_SUCCESS && sums != NULL)
+        status = writeManifest(dest, sums);
+
+    free(h);
+    free(hs);
+    free(fs);
+    free(sums);
+    return status;
+}
+
+CommandStatus executeAssembleCommand(int argc, char **argv)
+{
+    RecipeLine *lines;
+    char **sources;
+    unsigned long numSources = 0, i;
+    CommandStatus status;
+    FILE *f;
+    double start;
+
+    if (argc != 4) {
+        command_errno = COMMANDERROR_WRONGNUMBEROFARGS;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if (!strcmp(argv[2], "-")) {
+        f = stdin;
+    } else if ((f = fopen(argv[2], "r")) == NULL) {
+        perror(argv[2]);
+        command_errno = COMMANDERROR_CANNOTOPENFILE;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    start = statsClock();
+    status = readRecipe(f, argv[2], &lines, &sources, &numSources);
+    statsAddTime(EADFPHASE_PLANNING, start);
+    if (f != stdin)
+        fclose(f);
+
+    if (status == COMMANDSTATUS_SUCCESS && numSources == 0) {
+        fprintf(stderr, "%s: No tracks listed\n", argv[2]);
+        command_errno = COMMANDERROR_INVALIDRECIPE;
+        status = COMMANDSTATUS_FAILURE;
+    }
+
+    if (status == COMMANDSTATUS_SUCCESS)
+        status = assembleFiles(numSources, sources, argv[3], lines);
+
+    for (i = 0; i < numSources; i++) {
+        free(sources[i]);
+    }
+    free(sources);
+    return status;
+}
+
+/*
+** Compare the specified track of two extended ADF files.
+**
+** Sets *result to zero if the tracks are equal, or non-zero otherwise.
+*/
+CommandStatus compareTracks(int *result,
+    EADFHeader *h1, EADFIO *io1, const char *n1,
+    EADFHeader *h2, EADFIO *io2, const char *n2,
+    unsigned long track)
+{
+    unsigned char buf1[COMMAND_BUFSIZE], buf2[COMMAND_BUFSIZE];
+    unsigned long offset1, offset2;
+    long numBytes;
+
+    if (track >= h1->numTracks
+        || track >= h2->numTracks
+        || h1->trackType[track] != h2->trackType[track]
+        || h1->trackSizeBytes[track] != h2->trackSizeBytes[track]
+        || h1->trackSizeBits[track] != h2->trackSizeBits[track])
+    {
+        *result = 1;
+        return COMMANDSTATUS_SUCCESS;
+    }
+
+    offset1 = h1->trackOffset[track];
+    offset2 = h2->trackOffset[track];
+    numBytes = h1->trackSizeBytes[track];
+    for (; numBytes > 0; numBytes -= COMMAND_BUFSIZE) {
+        unsigned int count;
+        const char *failed = NULL;
+        count = (numBytes > COMMAND_BUFSIZE) ? COMMAND_BUFSIZE : numBytes;
+
+        if (io1->read(io1, offset1, buf1, count) != count) {
+            failed = n1;
+        } else if (io2->read(io2, offset2, buf2, count) != count) {
+            failed = n2;
+        }
+
+        if (failed != NULL) {
+            eadfPrintErrorWithContext(failed);
+            command_errno = COMMANDERROR_READERROR;
+            if (eadf_errno == EADFERROR_EOFERROR) {
+                command_errno = COMMANDERROR_EOFERROR;
+            } else if (eadf_errno == EADFERROR_SEEKERROR) {
+                command_errno = COMMANDERROR_SEEKERROR;
+            }
+            return COMMANDSTATUS_FAILURE;
+        }
+        offset1 += count;
+        offset2 += count;
+
+        if (memcmp(buf1, buf2, count) != 0) {
+            *result = 1;
+            return COMMANDSTATUS_SUCCESS;
+        }
+    }
+
+    *result = 0;
+    return COMMANDSTATUS_SUCCESS;
+}
+
+CommandStatus printComparison(EADFHeader *h1, FILE *f1, const char *n1,
+    EADFHeader *h2, FILE *f2, const char *n2)
+{
+    unsigned long numTracks;
+    unsigned long track;
+    EADFIO io1, io2;
+
+    eadfIOInitFile(&io1, f1);
+    eadfIOInitFile(&io2, f2);
+
+    fprintf(stdout, "       SOURCE1             SOURCE2\n"
+        "Track  Type Bytes   Bits   Type Bytes   Bits D\n");
+
+    numTracks = (h1->numTracks > h2->numTracks) ? h1->numTracks:h2->numTracks;
+    for (track = 0; track < numTracks; track++) {
+        EADFTrackType type1 = EADFTRACKTYPE_RAW, type2 = EADFTRACKTYPE_RAW;
+        long bytes1 = 0, bits1 = 0, bytes2 = 0, bits2 = 0;
+        CommandStatus status;
+        char diff = '*';
+        int cmp;
+        double start;
+
+        if (track < h1->numTracks) {
+            type1 = h1->trackType[track];
+            bytes1 = h1->trackSizeBytes[track];
+            bits1 = h1->trackSizeBits[track];
+        }
+
+        if (track < h2->numTracks) {
+            type2 = h2->trackType[track];
+            bytes2 = h2->trackSizeBytes[track];
+            bits2 = h2->trackSizeBits[track];
+        }
+
+        start = statsClock();
+        status = compareTracks(&cmp, h1, &io1, n1, h2, &io2, n2, track);
+        statsAddTime(EADFPHASE_COMPARE, start);
+        if (status != COMMANDSTATUS_SUCCESS) {
+            return COMMANDSTATUS_FAILURE;
+        }
+
+        if (cmp == 0) {
+            diff = ' ';
+        }
+
+        fprintf(stdout, "%5lu  %4s %5ld %6ld   %4s %5ld %6ld %c\n",
+            track,
+            EADFTRACKTYPE_NAMES[type1], bytes1, bits1,
+            EADFTRACKTYPE_NAMES[type2], bytes2, bits2,
+            diff);
+    }
+
+    return COMMANDSTATUS_SUCCESS;
+}
+
+/*
+** A job of a batch which an earlier run finished, recorded in its
+** journal by line number and the CRC-32 of the line.
+*/
+typedef struct {
+    unsigned long lineNum;
+    unsigned long crc;
+} BatchJob;
+
+int compareBatchJobs(const void *p1, const void *p2)
+{
+    const BatchJob *j1 = p1, *j2 = p2;
+
+    if (j1->lineNum != j2->lineNum)
+        return (j1->lineNum < j2->lineNum) ? -1 : 1;
+    if (j1->crc != j2->crc)
+        return (j1->crc < j2->crc) ? -1 : 1;
+    return 0;
+}
+
+/*
+** Read the jobs recorded in the journal "name" into a sorted array,
+** storing it in *jobs and its length in *numJobs. A journal which does
+** not exist yet holds no jobs.
+*/
+CommandStatus readJournal(const char *name, BatchJob **jobs,
+    unsigned long *numJobs)
+{
+    char line[COMMAND_BUFSIZE];
+    unsigned long maxJobs = 0;
+    BatchJob job, *more;
+    FILE *f;
+
+    *jobs = NULL;
+    *numJobs = 0;
+    if ((f = fopen(name, "r")) == NULL)
+        return COMMANDSTATUS_SUCCESS;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "%lu %lx", &job.lineNum, &job.crc) != 2)
+            continue;
+
+        if (*numJobs == maxJobs) {
+            maxJobs = maxJobs ? 2 * maxJobs : 64;
+            if ((more = realloc(*jobs, maxJobs * sizeof(BatchJob))) == NULL) {
+                fclose(f);
+                free(*jobs);
+                *jobs = NULL;
+                command_errno = COMMANDERROR_NOMEMORY;
+                return COMMANDSTATUS_FAILURE;
+            }
+            *jobs = more;
+        }
+        (*jobs)[(*numJobs)++] = job;
+    }
+
+    if (ferror(f)) {
+        perror(name);
+        fclose(f);
+        free(*jobs);
+        *jobs = NULL;
+        command_errno = COMMANDERROR_READERROR;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    fclose(f);
+    if (*numJobs > 0)
+        qsort(*jobs, *numJobs, sizeof(BatchJob), compareBatchJobs);
+    return COMMANDSTATUS_SUCCESS;
+}
+
+/*
+** Run one line of a batch, already split into "words", as a command.
+*/
+CommandStatus runBatchJob(int numWords, char **words, char *progName)
+{
+    char *args[COMMAND_MAXWORDS + 1];
+    Command which;
+    CommandStatus status;
+    int i;
+
+    if ((which = commandFromString(words[0])) == COMMAND_UNKNOWN)
+        return COMMANDSTATUS_FAILURE;
+
+    if (which == COMMAND_BATCH) {
+        command_errno = COMMANDERROR_INVALIDBATCH;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    args[0] = progName;
+    for (i = 0; i < numWords; i++) {
+        args[i + 1] = words[i];
+    }
+
+    status = dispatchCommand(which, numWords + 1, args);
+    eadfArenaFree();
+    return status;
+}
+
+CommandStatus executeBatchCommand(int argc, char **argv)
+{
+    char line[COMMAND_BUFSIZE], *words[COMMAND_MAXWORDS], *journalName;
+    unsigned long lineNum = 0, numJobs, numRun = 0, numSkipped = 0;
+    unsigned long numFailed = 0;
+    CommandStatus status = COMMANDSTATUS_SUCCESS;
+    BatchJob job, *jobs;
+    FILE *f, *journal;
+    int numWords;
+
+    if (argc != 3 && argc != 4) {
+        command_errno = COMMANDERROR_WRONGNUMBEROFARGS;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if (argc == 4) {
+        journalName = argv[3];
+    } else if ((journalName = malloc(strlen(argv[2]) + 9)) == NULL) {
+        command_errno = COMMANDERROR_NOMEMORY;
+        return COMMANDSTATUS_FAILURE;
+    } else {
+        sprintf(journalName, "%s.journal", argv[2]);
+    }
+
+    if (readJournal(journalName, &jobs, &numJobs) != COMMANDSTATUS_SUCCESS) {
+        if (argc == 3)
+            free(journalName);
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if ((f = fopen(argv[2], "r")) == NULL) {
+        perror(argv[2]);
+        free(jobs);
+        if (argc == 3)
+            free(journalName);
+        command_errno = COMMANDERROR_CANNOTOPENFILE;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if ((journal = fopen(journalName, "a")) == NULL) {
+        perror(journalName);
+        fclose(f);
+        free(jobs);
+        if (argc == 3)
+            free(journalName);
+        command_errno = COMMANDERROR_JOURNALERROR;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    while (status == COMMANDSTATUS_SUCCESS
+           && fgets(line, sizeof(line), f) != NULL)
+    {
+        lineNum++;
+        if (strchr(line, '\n') == NULL && !feof(f)) {
+            fprintf(stderr, "%s:%lu: Line too long\n", argv[2], lineNum);
+            command_errno = COMMANDERROR_INVALIDBATCH;
+            status = COMMANDSTATUS_FAILURE;
+            break;
+        }
+
+        job.lineNum = lineNum;
+        job.crc = crcFinal(crcUpdate(CRC_INIT, (unsigned char *)line,
+            strlen(line)));
+
+        numWords = splitLine(line, words, COMMAND_MAXWORDS);
+        if (numWords == 0)
+            continue;
+
+        if (numWords < 0) {
+            fprintf(stderr, "%s:%lu: Too many words\n", argv[2], lineNum);
+            numFailed++;
+            continue;
+        }
+
+        /* A job finished by an earlier run is only run again if edited */
+        if (numJobs > 0 && bsearch(&job, jobs, numJobs, sizeof(BatchJob),
+                compareBatchJobs) != NULL)
+        {
+            numSkipped++;
+            continue;
+        }
+
+        numRun++;
+        if (runBatchJob(numWords, words, argv[0]) != COMMANDSTATUS_SUCCESS) {
+            fprintf(stderr, "%s:%lu: ", argv[2], lineNum);
+            commandPrintErrorWithContext(words[0]);
+            numFailed++;
+            continue;
+        }
+
+        /* Record the job at once, so that it survives an interruption */
+        if (fprintf(journal, "%lu %08lx\n", job.lineNum, job.crc) < 0
+            || fflush(journal) != 0)
+        {
+            perror(journalName);
+            command_errno = COMMANDERROR_JOURNALERROR;
+            status = COMMANDSTATUS_FAILURE;
+        }
+    }
+
+    if (status == COMMANDSTATUS_SUCCESS && ferror(f)) {
+        perror(argv[2]);
+        command_errno = COMMANDERROR_READERROR;
+        status = COMMANDSTATUS_FAILURE;
+    }
+
+    fclose(f);
+    if (fclose(journal) != 0 && status == COMMANDSTATUS_SUCCESS) {
+        perror(journalName);
+        command_errno = COMMANDERROR_JOURNALERROR;
+        status = COMMANDSTATUS_FAILURE;
+    }
+    free(jobs);
+    if (argc == 3)
+        free(journalName);
+
+    fprintf(stdout, "%lu jobs run, %lu already done, %lu failed\n",
+        numRun, numSkipped, numFailed);
+
+    if (status == COMMANDSTATUS_SUCCESS && numFailed > 0) {
+        command_errno = COMMANDERROR_JOBSFAILED;
+        status = COMMANDSTATUS_FAILURE;
+    }
+
+    return status;
+}
+
+/*
+** An image to be added to a bundle, along with the file it is read
+** from.
+*/
+typedef struct {
+    EADFBundleEntry entry;
+    const char *path;
+} BundleImage;
+
+int compareBundleImages(const void *p1, const void *p2)
+{
+    const BundleImage *i1 = p1, *i2 = p2;
+
+    return strcmp(i1->entry.name, i2->entry.name);
+}
+
+/*
+** Return the name an image is given in a bundle: the name of its file
+** without any directory.
+*/
+const char *bundleImageName(const char *path)
+{
+    const char *name = path;
+
+    for (; *path != '\0'; path++) {
+        if (*path == '/' || *path == ':' || *path == '\\')
+            name = path + 1;
+    }
+
+    return name;
+}
+
+/*
+** Open the extended ADF file "name" for reading. If there is no such
+** file and "name" has the form BUNDLE#IMAGE, the image IMAGE of the
+** bundle BUNDLE is opened instead, once its header has been checked
+** against the bundle's index. Either way the file is left at the
+** start of the image, ready for eadfHeaderInitWithFile(). Errors are
+** reported to stderr.
+*/
+FILE *openImage(const char *name)
+{
+    EADFBundleEntry entry;
+    char *bundle, *image;
+    FILE *f;
+
+    if ((f = fopen(name, "rb")) != NULL || strchr(name, '#') == NULL) {
+        if (f == NULL)
+            perror(name);
+        return f;
+    }
+
+    if ((bundle = malloc(strlen(name) + 1)) == NULL) {
+        eadf_errno = EADFERROR_NOMEMORY;
+        eadfPrintErrorWithContext(name);
+        return NULL;
+    }
+    strcpy(bundle, name);
+    image = strrchr(bundle, '#');
+    *image++ = '\0';
+
+    if ((f = fopen(bundle, "rb")) == NULL) {
+        perror(bundle);
+    } else if (eadfBundleFind(f, image, &entry) != EADFSTATUS_SUCCESS
+               || eadfBundleCheckImage(f, &entry) != EADFSTATUS_SUCCESS)
+    {
+        eadfPrintErrorWithContext(name);
+        fclose(f);
+        f = NULL;
+    }
+
+    free(bundle);
+    return f;
+}
+
+/*
+** Return non-zero if openImage() finds "name" in a bundle rather than
+** opening a file of that name.
+*/
+int isBundledImage(const char *name)
+{
+    FILE *f;
+
+    if (strchr(name, '#') == NULL)
+        return 0;
+
+    if ((f = fopen(name, "rb")) == NULL)
+        return 1;
+
+    fclose(f);
+    return 0;
+}
+
+/*
+** Open the extended ADF file "name" as for openImage() and set up a
+** backend reading it, returning the file in *f. A name of "-" reads
+** the whole image from standard input into memory instead, since a
+** pipe cannot seek, and sets *f to NULL. Errors are reported to stderr.
+*/
+EADFStatus readImageIO(const char *name, EADFIO *io, FILE **f)
+{
+    unsigned char *buffer;
+    size_t n;
+
+    if (strcmp(name, "-")) {
+        if ((*f = openImage(name)) == NULL)
+            return EADFSTATUS_FAILURE;
+        eadfIOInitFile(io, *f);
+        return EADFSTATUS_SUCCESS;
+    }
+
+    *f = NULL;
+    eadfIOInitMemory(io, NULL, 0, 0);
+    if ((buffer = malloc(COMMAND_BUFSIZE)) == NULL) {
+        eadf_errno = EADFERROR_NOMEMORY;
+        eadfPrintErrorWithContext(name);
+        return EADFSTATUS_FAILURE;
+    }
+
+    while ((n = eadfRead(buffer, 1, COMMAND_BUFSIZE, stdin)) > 0) {
+        if (io->write(io, io->length, buffer, n) < n)
+            break;
+    }
+
+    if (ferror(stdin)) {
+        eadf_errno = EADFERROR_READERROR;
+    } else if (n == 0) {
+        free(buffer);
+        return EADFSTATUS_SUCCESS;
+    }
+
+    eadfPrintErrorWithContext(name);
+    free(buffer);
+    eadfIOFree(io);
+    return EADFSTATUS_FAILURE;
+}
+
+/*
+** Close an image opened by readImageIO().
+*/
+void closeImageIO(EADFIO *io, FILE *f)
+{
+    if (f != NULL)
+        fclose(f);
+    eadfIOFree(io);
+}
+
+/*
+** Write the bundle "dest" holding the extended ADF files named in
+** "paths". The files are read twice, once to build the index and once
+** to copy them, so that only one is open at a time.
+*/
+CommandStatus writeBundle(const char *dest, unsigned long numImages,
+    char **paths)
+{
+    BundleImage *images;
+    EADFBundleEntry *entries;
+    EADFHeader *h;
+    CommandStatus status = COMMANDSTATUS_SUCCESS;
+    unsigned long i;
+    const char *name;
+    long size;
+    FILE *f, *src;
+
+    h = calloc(1, sizeof(EADFHeader));
+    images = malloc(numImages * sizeof(BundleImage));
+    entries = malloc(numImages * sizeof(EADFBundleEntry));
+    if (h == NULL || images == NULL || entries == NULL) {
+        free(h);
+        free(images);
+        free(entries);
+        command_errno = COMMANDERROR_NOMEMORY;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    for (i = 0; i < numImages && status == COMMANDSTATUS_SUCCESS; i++) {
+        images[i].path = paths[i];
+        name = bundleImageName(paths[i]);
+        if (*name == '\0' || strlen(name) > EADFBUNDLE_NAMELEN) {
+            fprintf(stderr, "%s: Invalid name for an image in a bundle\n",
+                paths[i]);
+            command_errno = COMMANDERROR_BUNDLEERROR;
+            status = COMMANDSTATUS_FAILURE;
+            break;
+        }
+        strcpy(images[i].entry.name, name);
+
+        if ((src = fopen(paths[i], "rb")) == NULL) {
+            perror(paths[i]);
+            command_errno = COMMANDERROR_CANNOTOPENFILE;
+            status = COMMANDSTATUS_FAILURE;
+            break;
+        }
+
+        if (eadfHeaderInitWithFile(h, src) != EADFSTATUS_SUCCESS) {
+            eadfPrintErrorWithContext(paths[i]);
+            command_errno = COMMANDERROR_INVALIDFILE;
+            status = COMMANDSTATUS_FAILURE;
+        } else if ((size = eadfFileSize(src)) < 0) {
+            perror(paths[i]);
+            command_errno = COMMANDERROR_SEEKERROR;
+            status = COMMANDSTATUS_FAILURE;
+        } else {
+            images[i].entry.size = size;
+            images[i].entry.numTracks = h->numTracks;
+            images[i].entry.headerCrc = eadfHeaderCrc(h);
+        }
+        fclose(src);
+    }
+
+    if (status == COMMANDSTATUS_SUCCESS) {
+        qsort(images, numImages, sizeof(BundleImage), compareBundleImages);
+        for (i = 0; i < numImages; i++) {
+            if (i > 0
+                && !strcmp(images[i - 1].entry.name, images[i].entry.name))
+            {
+                fprintf(stderr, "%s: More than one image called %s\n",
+                    dest, images[i].entry.name);
+                command_errno = COMMANDERROR_BUNDLEERROR;
+                status = COMMANDSTATUS_FAILURE;
+                break;
+            }
+            entries[i] = images[i].entry;
+        }
+    }
+
+    if (status == COMMANDSTATUS_SUCCESS && (f = fopen(dest, "wb")) == NULL) {
+        perror(dest);
+        command_errno = COMMANDERROR_CANNOTOPENFILE;
+        status = COMMANDSTATUS_FAILURE;
+    } else if (status == COMMANDSTATUS_SUCCESS) {
+        if (eadfBundleWriteIndex(f, numImages, entries)
+            != EADFSTATUS_SUCCESS)
+        {
+            eadfPrintErrorWithContext(dest);
+            command_errno = COMMANDERROR_BUNDLEERROR;
+            status = COMMANDSTATUS_FAILURE;
+        }
+
+        for (i = 0; i < numImages && status == COMMANDSTATUS_SUCCESS; i++) {
+            if ((src = fopen(images[i].path, "rb")) == NULL) {
+                perror(images[i].path);
+                command_errno = COMMANDERROR_CANNOTOPENFILE;
+                status = COMMANDSTATUS_FAILURE;
+            } else {
+                if (eadfBundleWriteImage(f, src, &entries[i])
+                    != EADFSTATUS_SUCCESS)
+                {
+                    eadfPrintErrorWithContext(images[i].path);
+                    command_errno = COMMANDERROR_BUNDLEERROR;
+                    status = COMMANDSTATUS_FAILURE;
+                }
+                fclose(src);
+            }
+        }
+
+        if (fclose(f) != 0 && status == COMMANDSTATUS_SUCCESS) {
+            perror(dest);
+            command_errno = COMMANDERROR_BUNDLEERROR;
+            status = COMMANDSTATUS_FAILURE;
+        }
+    }
+
+    free(h);
+    free(images);
+    free(entries);
+    return status;
+}
+
+/*
+** Print the index of the bundle "name".
+*/
+CommandStatus listBundle(const char *name)
+{
+    EADFBundleEntry entry;
+    unsigned long numImages, i;
+    CommandStatus status = COMMANDSTATUS_SUCCESS;
+    FILE *f;
+
+    if ((f = fopen(name, "rb")) == NULL) {
+        perror(name);
+        command_errno = COMMANDERROR_CANNOTOPENFILE;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if (eadfBundleReadHeader(f, &numImages) != EADFSTATUS_SUCCESS) {
+        eadfPrintErrorWithContext(name);
+        fclose(f);
+        command_errno = COMMANDERROR_INVALIDFILE;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    fprintf(stdout, "Bundle name: %s\nNumber of images: %lu\n"
+        "Tracks      Size     Offset Name\n", name, numImages);
+
+    for (i = 0; i < numImages; i++) {
+        if (eadfBundleReadEntry(f, i, &entry) != EADFSTATUS_SUCCESS) {
+            eadfPrintErrorWithContext(name);
+            command_errno = COMMANDERROR_INVALIDFILE;
+            status = COMMANDSTATUS_FAILURE;
+            break;
+        }
+
+        fprintf(stdout, "%6lu %9lu %10lu %s\n", entry.numTracks, entry.size,
+            entry.offset, entry.name);
+    }
+
+    fclose(f);
+    return status;
+}
+
+/*
+** Read file names from "f", one per line, into a list which grows as
+** needed. Blank lines are skipped. The names and the list are freed
+** by freeNames(), also after a failure.
+*/
+CommandStatus readNames(FILE *f, char ***names, unsigned long *numNames)
+{
+    char line[COMMAND_BUFSIZE], **more;
+    unsigned long maxNames = 0;
+    size_t length;
+
+    *names = NULL;
+    *numNames = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        length = strlen(line);
+        while (length > 0 && (line[length - 1] == '\n'
+                              || line[length - 1] == '\r'))
+        {
+            line[--length] = '\0';
+        }
+        if (length == 0)
+            continue;
+
+        if (*numNames == maxNames) {
+            maxNames = (maxNames == 0) ? 64 : maxNames * 2;
+            if ((more = realloc(*names, maxNames * sizeof(char *))) == NULL) {
+                command_errno = COMMANDERROR_NOMEMORY;
+                return COMMANDSTATUS_FAILURE;
+            }
+            *names = more;
+        }
+
+        if (((*names)[*numNames] = malloc(length + 1)) == NULL) {
+            command_errno = COMMANDERROR_NOMEMORY;
+            return COMMANDSTATUS_FAILURE;
+        }
+        strcpy((*names)[(*numNames)++], line);
+    }
+
+    return COMMANDSTATUS_SUCCESS;
+}
+
+/*
+** Free a list of names read by readNames().
+*/
+void freeNames(char **names, unsigned long numNames)
+{
+    unsigned long i;
+
+    for (i = 0; i < numNames; i++) {
+        free(names[i]);
+    }
+    free(names);
+}
+
+CommandStatus executeBundleCommand(int argc, char **argv)
+{
+    char **paths;
+    unsigned long numPaths;
+    CommandStatus status;
+
+    if (argc < 3) {
+        command_errno = COMMANDERROR_WRONGNUMBEROFARGS;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if (argc == 3)
+        return listBundle(argv[2]);
+
+    if (argc > 4 || strcmp(argv[3], "-"))
+        return writeBundle(argv[2], argc - 3, argv + 3);
+
+    /* Read the file names from standard input */
+    status = readNames(stdin, &paths, &numPaths);
+    if (status == COMMANDSTATUS_SUCCESS && numPaths == 0) {
+        fprintf(stderr, "-: No file names given\n");
+        command_errno = COMMANDERROR_BUNDLEERROR;
+        status = COMMANDSTATUS_FAILURE;
+    }
+
+    if (status == COMMANDSTATUS_SUCCESS)
+        status = writeBundle(argv[2], numPaths, paths);
+
+    freeNames(paths, numPaths);
+    return status;
+}
+
+CommandStatus executeCanonicalizeCommand(int argc, char **argv)
+{
+    EADFHeader *h, *out;
+    FILE *f1, *f2;
+    EADFStatus status;
+    unsigned long track;
+    double start;
+
+    if (argc != 4) {
+        command_errno = COMMANDERROR_WRONGNUMBEROFARGS;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if ((h = calloc(2, sizeof(EADFHeader))) == NULL) {
+        command_errno = COMMANDERROR_NOMEMORY;
+        return COMMANDSTATUS_FAILURE;
+    }
+    out = h + 1;
+
+    if ((f1 = openImage(argv[2])) == NULL) {
+        free(h);
+        command_errno = COMMANDERROR_CANNOTOPENFILE;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if (eadfHeaderInitWithFile(h, f1) != EADFSTATUS_SUCCESS) {
+        eadfPrintErrorWithContext(argv[2]);
+        fclose(f1);
+        free(h);
+        command_errno = COMMANDERROR_INVALIDFILE;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if ((f2 = fopen(argv[3], "wb")) == NULL) {
+        perror(argv[3]);
+        fclose(f1);
+        free(h);
+        command_errno = COMMANDERROR_CANNOTOPENFILE;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    start = statsClock();
+    status = eadfCanonicalizeFile(h, f1, argv[2], out, f2);
+    statsAddTime(EADFPHASE_COPY, start);
+    fclose(f1);
+    fclose(f2);
+
+    if (status != EADFSTATUS_SUCCESS) {
+        eadfPrintErrorWithContext(argv[3]);
+        free(h);
+        command_errno = COMMANDERROR_MERGEERROR;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    fprintf(stdout, "Track Cyl Side  Before   After\n");
+    for (track = 0; track < h->numTracks; track++) {
+        if (h->trackType[track] != EADFTRACKTYPE_RAW
+            || h->trackSizeBytes[track] == 0)
+        {
+            continue;
+        }
+
+        fprintf(stdout, "%5lu %3lu %4lu %7lu %7lu\n", track, track / 2,
+            (track % 2) + 1, eadfTrackBits(h, track),
+            eadfTrackBits(out, track));
+    }
+
+    free(h);
+    return COMMANDSTATUS_SUCCESS;
+}
+
+/*
+** An image being catalogued: a view of it as a standard ADF image, a
+** flag per block so that a damaged disk whose directories loop is
+** still walked only once, and the path of the current entry.
+*/
+typedef struct {
+    EADFView view;
+    const char *name;
+    int ffs;
+    unsigned long numBad;
+    unsigned char visited[ADFS_NUMBLOCKS];
+    char path[COMMAND_BUFSIZE];
+} CatalogImage;
+
+/*
+** Print the name of a catalogued image to stderr ahead of a message,
+** followed by the path of the current entry unless it is the root.
+*/
+void catalogPrintContext(const CatalogImage *c)
+{
+    if (c->path[0] == '\0') {
+        fprintf(stderr, "%s: ", c->name);
+    } else {
+        fprintf(stderr, "%s:%s: ", c->name, c->path);
+    }
+}
+
+/*
+** Read block "block" of a catalogued image into "buf", checking that
+** it is of the given type and that its checksum is right. A block which
+** cannot be read is reported and counted as bad.
+*/
+CommandStatus catalogReadBlock(CatalogImage *c, unsigned long block,
+    unsigned long type, unsigned char *buf)
+{
+    unsigned long sum = 0;
+    int i;
+
+    if (block < 2 || block >= ADFS_NUMBLOCKS) {
+        catalogPrintContext(c);
+        fprintf(stderr, "Invalid block number %lu\n", block);
+        c->numBad++;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if (eadfViewReadBlock(&c->view, block, buf) != EADFSTATUS_SUCCESS) {
+        catalogPrintContext(c);
+        fprintf(stderr, "Block %lu: %s\n", block,
+            EADFERROR_MESSAGES[eadf_errno]);
+        c->numBad++;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    for (i = 0; i < ADF_SECTORSIZE; i += 4) {
+        sum += longFromBigEndianBytes(buf + i);
+    }
+
+    if (longFromBigEndianBytes(buf) != type || (sum & 0xffffffffUL) != 0) {
+        catalogPrintContext(c);
+        fprintf(stderr, "Block %lu is not a valid %s block\n", block,
+            (type == ADFS_T_HEADER) ? "header"
+            : (type == ADFS_T_DATA) ? "data" : "list");
+        c->numBad++;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    return COMMANDSTATUS_SUCCESS;
+}
+
+/*
+** Set *crc to the CRC-32 of the contents of the file whose header is
+** "header", reading its data blocks through the block tables of the
+** header and of any extension blocks which follow it.
+*/
+CommandStatus catalogFileCrc(CatalogImage *c, const unsigned char *header,
+    unsigned long *crc)
+{
+    unsigned char *list, *data;
+    unsigned long left, count, i, block, n, numLists = 0;
+    CommandStatus status = COMMANDSTATUS_SUCCESS;
+
+    list = malloc(2 * ADF_SECTORSIZE);
+    if (list == NULL) {
+        command_errno = COMMANDERROR_NOMEMORY;
+        return COMMANDSTATUS_FAILURE;
+    }
+    data = list + ADF_SECTORSIZE;
+    memcpy(list, header, ADF_SECTORSIZE);
+
+    *crc = CRC_INIT;
+    left = longFromBigEndianBytes(header + ADFS_FILESIZE);
+    while (left > 0 && status == COMMANDSTATUS_SUCCESS) {
+        count = longFromBigEndianBytes(list + ADFS_HIGHSEQ);
+        if (count > ADFS_HASHSIZE)
+            count = ADFS_HASHSIZE;
+
+        /* Blocks are listed from the end of the table backwards */
+        for (i = 0; i < count && left > 0; i++) {
+            block = longFromBigEndianBytes(list + ADFS_TABLE
+                + (ADFS_HASHSIZE - 1 - i) * 4);
+            if (c->ffs) {
+                if (block < 2 || block >= ADFS_NUMBLOCKS
+                    || eadfViewReadBlock(&c->view, block, data)
+                       != EADFSTATUS_SUCCESS)
+                {
+                    catalogPrintContext(c);
+                    fprintf(stderr, "Data block %lu is bad\n", block);
+                    c->numBad++;
+                    status = COMMANDSTATUS_FAILURE;
+                    break;
+                }
+
+                n = (left < ADF_SECTORSIZE) ? left : ADF_SECTORSIZE;
+                *crc = crcUpdate(*crc, data, n);
+            } else {
+                if (catalogReadBlock(c, block, ADFS_T_DATA, data)
+                    != COMMANDSTATUS_SUCCESS)
+                {
+                    status = COMMANDSTATUS_FAILURE;
+                    break;
+                }
+
+                n = longFromBigEndianBytes(data + ADFS_DATASIZE);
+                if (n > ADF_SECTORSIZE - ADFS_OFSDATA)
+                    n = ADF_SECTORSIZE - ADFS_OFSDATA;
+                if (n > left)
+                    n = left;
+                *crc = crcUpdate(*crc, data + ADFS_OFSDATA, n);
+            }
+            left -= n;
+        }
+
+        if (left == 0 || status != COMMANDSTATUS_SUCCESS)
+            break;
+
+        block = longFromBigEndianBytes(list + ADFS_EXTENSION);
+        if (++numLists > ADFS_NUMBLOCKS || count == 0
+            || catalogReadBlock(c, block, ADFS_T_LIST, list)
+               != COMMANDSTATUS_SUCCESS)
+        {
+            status = COMMANDSTATUS_FAILURE;
+        }
+    }
+
+    *crc = crcFinal(*crc);
+    free(list);
+    return status;
+}
+
+/*
+** List the entries of the directory whose header (or root) block is
+** "dir", following the hash chain of each slot of its hash table, and
+** then the contents of each subdirectory. "length" is the length of
+** the directory's path.
+*/
+CommandStatus catalogDirectory(CatalogImage *c, const unsigned char *dir,
+    size_t length, int depth)
+{
+    unsigned char *header;
+    unsigned long key, type, crc;
+    size_t nameLength;
+    int i;
+
+    if ((header = malloc(ADF_SECTORSIZE)) == NULL) {
+        command_errno = COMMANDERROR_NOMEMORY;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    for (i = 0; i < ADFS_HASHSIZE; i++) {
+        key = longFromBigEndianBytes(dir + ADFS_TABLE + i * 4);
+        for (; key != 0; key = longFromBigEndianBytes(header
+                 + ADFS_HASHCHAIN))
+        {
+            c->path[length] = '\0';
+            if (key >= ADFS_NUMBLOCKS || c->visited[key]
+                || catalogReadBlock(c, key, ADFS_T_HEADER, header)
+                   != COMMANDSTATUS_SUCCESS)
+            {
+                break;
+            }
+            c->visited[key] = 1;
+
+            nameLength = header[ADFS_NAME];
+            if (nameLength > ADFS_MAXNAME)
+                nameLength = ADFS_MAXNAME;
+            memcpy(c->path + length, header + ADFS_NAME + 1, nameLength);
+            c->path[length + nameLength] = '\0';
+
+            type = longFromBigEndianBytes(header + ADFS_SECTYPE);
+            if (type == ADFS_ST_FILE) {
+                if (catalogFileCrc(c, header, &crc)
+                    == COMMANDSTATUS_SUCCESS)
+                {
+                    fprintf(stdout, "%9lu %08lx  %s:%s\n",
+                        longFromBigEndianBytes(header + ADFS_FILESIZE),
+                        crc, c->name, c->path);
+                } else {
+                    fprintf(stdout, "%9lu %8s  %s:%s\n",
+                        longFromBigEndianBytes(header + ADFS_FILESIZE),
+                        "bad", c->name, c->path);
+                }
+            } else if (type == ADFS_ST_USERDIR) {
+                fprintf(stdout, "%9s %8s  %s:%s/\n", "-", "-", c->name,
+                    c->path);
+
+                /* Leave room for the longest name of the next level */
+                if (depth < ADFS_MAXDEPTH && length + nameLength + 1
+                    + ADFS_MAXNAME < sizeof(c->path))
+                {
+                    c->path[length + nameLength] = '/';
+                    catalogDirectory(c, header, length + nameLength + 1,
+                        depth + 1);
+                }
+            }
+        }
+    }
+
+    c->path[length] = '\0';
+    free(header);
+    return COMMANDSTATUS_SUCCESS;
+}
+
+/*
+** List every file of the AmigaDOS filesystem on the extended ADF file
+** "name" with its size and the CRC-32 of its contents, reading blocks
+** through the track cache "cache" so that only the tracks which hold
+** the filesystem's blocks are decoded.
+*/
+CommandStatus catalogImage(CatalogImage *c, EADFHeader *h, const char *name,
+    EADFTrackCache *cache)
+{
+    unsigned char *block;
+    CommandStatus status = COMMANDSTATUS_SUCCESS;
+    FILE *f;
+
+    if ((f = openImage(name)) == NULL) {
+        command_errno = COMMANDERROR_CANNOTOPENFILE;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if (eadfHeaderInitWithFile(h, f) != EADFSTATUS_SUCCESS) {
+        eadfPrintErrorWithContext(name);
+        fclose(f);
+        command_errno = COMMANDERROR_INVALIDFILE;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    block = malloc(ADF_SECTORSIZE);
+    if (block == NULL
+        || eadfViewInit(&c->view, h, f, name, cache) != EADFSTATUS_SUCCESS)
+    {
+        free(block);
+        fclose(f);
+        command_errno = COMMANDERROR_NOMEMORY;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    c->name = name;
+    c->numBad = 0;
+    c->path[0] = '\0';
+    memset(c->visited, 0, sizeof(c->visited));
+
+    if (eadfViewReadBlock(&c->view, 0, block) != EADFSTATUS_SUCCESS) {
+        eadfPrintErrorWithContext(name);
+        c->numBad++;
+    } else if (memcmp(block, "DOS", 3) != 0) {
+        fprintf(stdout, "%s: Not an AmigaDOS disk\n", name);
+    } else {
+        c->ffs = block[3] & 1;
+        if (catalogReadBlock(c, ADFS_ROOTBLOCK, ADFS_T_HEADER, block)
+            == COMMANDSTATUS_SUCCESS)
+        {
+            fprintf(stdout, "%s: %.*s (%s)\n", name,
+                (block[ADFS_NAME] > ADFS_MAXNAME) ? ADFS_MAXNAME
+                                                  : block[ADFS_NAME],
+                (const char *)block + ADFS_NAME + 1,
+                c->ffs ? "FFS" : "OFS");
+            status = catalogDirectory(c, block, 0, 0);
+        }
+    }
+
+    if (status == COMMANDSTATUS_SUCCESS && c->numBad > 0) {
+        command_errno = COMMANDERROR_BADSECTORS;
+        status = COMMANDSTATUS_FAILURE;
+    }
+
+    eadfViewFree(&c->view);
+    free(block);
+    fclose(f);
+    return status;
+}
+
+CommandStatus executeCatalogCommand(int argc, char **argv)
+{
+    EADFHeader *h;
+    EADFTrackCache cache;
+    CatalogImage *c;
+    CommandStatus status = COMMANDSTATUS_SUCCESS;
+    int i;
+
+    if (argc < 3) {
+        command_errno = COMMANDERROR_WRONGNUMBEROFARGS;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    h = calloc(1, sizeof(EADFHeader));
+    c = malloc(sizeof(CatalogImage));
+    if (h == NULL || c == NULL
+        || eadfTrackCacheInit(&cache, EADF_CACHETRACKS) != EADFSTATUS_SUCCESS)
+    {
+        free(h);
+        free(c);
+        command_errno = COMMANDERROR_NOMEMORY;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    /* One cache serves every image, so memory use does not grow */
+    for (i = 2; i < argc; i++) {
+        if (catalogImage(c, h, argv[i], &cache) != COMMANDSTATUS_SUCCESS)
+            status = COMMANDSTATUS_FAILURE;
+    }
+
+    eadfTrackCacheFree(&cache);
+    free(h);
+    free(c);
+    return status;
+}
+
+/*
+** Check the extended ADF file "name" for damage which can be seen from
+** its header and size alone, printing each problem found. Returns the
+** number of problems, or -1 if the file could not be read. The tracks
+** themselves are not read.
+*/
+long checkImage(EADFHeader *h, const char *name)
+{
+    unsigned long track, expected, bytes, bits;
+    long start, size, numProblems = 0;
+    FILE *f;
+
+    if ((f = openImage(name)) == NULL)
+        return -1;
+
+    start = ftell(f);
+    if (eadfHeaderInitWithFile(h, f) != EADFSTATUS_SUCCESS) {
+        eadfPrintErrorWithContext(name);
+        fclose(f);
+        return -1;
+    }
+
+    if ((size = eadfFileSize(f)) < 0) {
+        perror(name);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    for (track = 0; track < h->numTracks; track++) {
+        bytes = h->trackSizeBytes[track];
+        bits = h->trackSizeBits[track];
+        if (h->trackType[track] == EADFTRACKTYPE_DOS && bytes == 0) {
+            fprintf(stdout, "%s: Track %lu: DOS track with no data\n",
+                name, track);
+            numProblems++;
+        } else if (h->trackType[track] == EADFTRACKTYPE_DOS
+                   && bytes != ADF_TRACKSIZE)
+        {
+            fprintf(stdout, "%s: Track %lu: DOS track of %lu bytes\n",
+                name, track, bytes);
+            numProblems++;
+        } else if (bits > bytes * 8) {
+            fprintf(stdout, "%s: Track %lu: %lu bits in %lu bytes\n",
+                name, track, bits, bytes);
+            numProblems++;
+        }
+    }
+
+    /* An image in a bundle is followed by the next one */
+    expected = start + eadfExpectedSize(h);
+    if ((unsigned long)size < expected) {
+        fprintf(stdout, "%s: Truncated, %lu bytes missing\n", name,
+            expected - size);
+        numProblems++;
+    } else if ((unsigned long)size > expected && start == 0) {
+        fprintf(stdout, "%s: %lu bytes of trailing data\n", name,
+            size - expected);
+        numProblems++;
+    }
+
+    return numProblems;
+}
+
+CommandStatus executeCheckCommand(int argc, char **argv)
+{
+    EADFHeader *h;
+    unsigned long numBad = 0;
+    long numProblems;
+    double start;
+    int i;
+
+    if (argc < 3) {
+        command_errno = COMMANDERROR_WRONGNUMBEROFARGS;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if ((h = calloc(1, sizeof(EADFHeader))) == NULL) {
+        command_errno = COMMANDERROR_NOMEMORY;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    start = statsClock();
+    for (i = 2; i < argc; i++) {
+        if ((numProblems = checkImage(h, argv[i])) != 0)
+            numBad++;
+    }
+    statsAddTime(EADFPHASE_COMPARE, start);
+
+    fprintf(stdout, "%d images checked, %lu with problems\n", argc - 2,
+        numBad);
+
+    free(h);
+    if (numBad > 0) {
+        command_errno = COMMANDERROR_CHECKFAILED;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    return COMMANDSTATUS_SUCCESS;
+}
+
+CommandStatus executeCompareCommand(int argc, char **argv)
+{
+    EADFHeader *h;
+    FILE *f1, *f2;
+    CommandStatus status;
+
+    if (argc != 4) {
+        command_errno = COMMANDERROR_WRONGNUMBEROFARGS;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if ((h = calloc(2, sizeof(EADFHeader))) == NULL) {
+        command_errno = COMMANDERROR_NOMEMORY;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if ((f1 = openImage(argv[2])) == NULL) {
+        free(h);
+        command_errno = COMMANDERROR_CANNOTOPENFILE;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if (eadfHeaderInitWithFile(h, f1) != EADFSTATUS_SUCCESS) {
+        free(h);
+        fclose(f1);
+        eadfPrintErrorWithContext(argv[2]);
+        command_errno = COMMANDERROR_INVALIDFILE;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if ((f2 = openImage(argv[3])) == NULL) {
+        free(h);
+        fclose(f1);
+        command_errno = COMMANDERROR_CANNOTOPENFILE;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if (eadfHeaderInitWithFile(h + 1, f2) != EADFSTATUS_SUCCESS) {
+        free(h);
+        fclose(f1);
+        fclose(f2);
+        eadfPrintErrorWithContext(argv[3]);
+        command_errno = COMMANDERROR_INVALIDFILE;
+        return COMMANDSTATUS_FAILURE;
+    }
+ 
+    status = printComparison(h, f1, argv[2], h + 1, f2, argv[3]);
+
+    free(h);
+    fclose(f1);
+    fclose(f2);
+
+    return status;
+}
+
+CommandStatus executeConsensusCommand(int argc, char **argv)
+{
+    EADFHeader *hs;
+    FILE **fs, *dest;
+    unsigned long numSources, numOpen, numTracks = 0, i, track, *confidence;
+    CommandStatus status = COMMANDSTATUS_SUCCESS;
+    double start;
+
+    if (argc < 5) {
+        command_errno = COMMANDERROR_WRONGNUMBEROFARGS;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    numSources = argc - 3;
+    hs = calloc(numSources, sizeof(EADFHeader));
+    fs = malloc(numSources * sizeof(FILE *));
+    if (hs == NULL || fs == NULL) {
+        free(hs);
+        free(fs);
+        command_errno = COMMANDERROR_NOMEMORY;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    for (numOpen = 0; numOpen < numSources; numOpen++) {
+        const char *name = argv[numOpen + 3];
+
+        if ((fs[numOpen] = openImage(name)) == NULL) {
+            command_errno = COMMANDERROR_CANNOTOPENFILE;
+            status = COMMANDSTATUS_FAILURE;
+            break;
+        }
+
+        if (eadfHeaderInitWithFile(&hs[numOpen], fs[numOpen])
+            != EADFSTATUS_SUCCESS)
+        {
+            eadfPrintErrorWithContext(name);
+            fclose(fs[numOpen]);
+            command_errno = COMMANDERROR_INVALIDFILE;
+            status = COMMANDSTATUS_FAILURE;
+            break;
+        }
+
+        if (hs[numOpen].numTracks > numTracks)
+            numTracks = hs[numOpen].numTracks;
+    }
+
+    if (status == COMMANDSTATUS_SUCCESS
+        && (confidence = eadfArenaAlloc(numTracks * sizeof(unsigned long)))
+            == NULL)
+    {
+        command_errno = COMMANDERROR_NOMEMORY;
+        status = COMMANDSTATUS_FAILURE;
+    }
+
+    if (status == COMMANDSTATUS_SUCCESS) {
+        if ((dest = fopen(argv[2], "wb")) == NULL) {
+            perror(argv[2]);
+            command_errno = COMMANDERROR_CANNOTOPENFILE;
+            status = COMMANDSTATUS_FAILURE;
+        } else {
+            start = statsClock();
+            if (eadfConsensusFiles(numSources, hs, fs, argv + 3, dest,
+                    confidence) != EADFSTATUS_SUCCESS)
+            {
+                eadfPrintErrorWithContext(argv[2]);
+                command_errno = COMMANDERROR_MERGEERROR;
+                status = COMMANDSTATUS_FAILURE;
+            }
+            statsAddTime(EADFPHASE_COPY, start);
+            fclose(dest);
+        }
+    }
+
+    if (status == COMMANDSTATUS_SUCCESS) {
+        fprintf(stdout, "Track Cyl Side Confidence\n");
+        for (track = 0; track < numTracks; track++) {
+            fprintf(stdout, "%5lu %3lu %4lu %9lu%%\n", track, track / 2,
+                (track % 2) + 1, confidence[track]);
+        }
+    }
+
+    for (i = 0; i < numOpen; i++) {
+        fclose(fs[i]);
+    }
+
+    free(hs);
+    free(fs);
+    return status;
+}
+
+CommandStatus executeDiffCommand(int argc, char **argv)
+{
+    EADFHeader *h;
+    FILE *f1, *f2, *f3;
+    EADFStatus status;
+    double start;
+
+    if (argc != 5) {
+        command_errno = COMMANDERROR_WRONGNUMBEROFARGS;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if ((h = calloc(2, sizeof(EADFHeader))) == NULL) {
+        command_errno = COMMANDERROR_NOMEMORY;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if ((f1 = openImage(argv[2])) == NULL) {
+        free(h);
+        command_errno = COMMANDERROR_CANNOTOPENFILE;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if (eadfHeaderInitWithFile(h, f1) != EADFSTATUS_SUCCESS) {
+        free(h);
+        fclose(f1);
+        eadfPrintErrorWithContext(argv[2]);
+        command_errno = COMMANDERROR_INVALIDFILE;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if ((f2 = openImage(argv[3])) == NULL) {
+        free(h);
+        fclose(f1);
+        command_errno = COMMANDERROR_CANNOTOPENFILE;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if (eadfHeaderInitWithFile(h + 1, f2) != EADFSTATUS_SUCCESS) {
+        free(h);
+        fclose(f1);
+        fclose(f2);
+        eadfPrintErrorWithContext(argv[3]);
+        command_errno = COMMANDERROR_INVALIDFILE;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if ((f3 = fopen(argv[4], "wb")) == NULL) {
+        perror(argv[4]);
+        free(h);
+        fclose(f1);
+        fclose(f2);
+        command_errno = COMMANDERROR_CANNOTOPENFILE;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    start = statsClock();
+    status = eadfDiffFiles(h, f1, argv[2], h + 1, f2, argv[3], f3);
+    statsAddTime(EADFPHASE_COMPARE, start);
+
+    free(h);
+    fclose(f1);
+    fclose(f2);
+    if (fclose(f3) != 0 && status == EADFSTATUS_SUCCESS) {
+        eadf_errno = EADFERROR_WRITEERROR;
+        status = EADFSTATUS_FAILURE;
+    }
+
+    if (status != EADFSTATUS_SUCCESS) {
+        eadfPrintErrorWithContext(argv[4]);
+        command_errno = COMMANDERROR_DIFFERROR;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    return COMMANDSTATUS_SUCCESS;
+}
+
+/*
+** Merge two extended ADF files.
+**
+** Arguments "src1" and "src2" are the names of the two source files,
+** "dest" is the name of the destination file and "callback" is a
+** pointer to a function which will populate the trackSources array.
+** The "data" argument is passed unchanged to "callback".
+*/
+CommandStatus mergeFiles(const char *src1, const char *src2,
+    const char *dest, CommandTrackSourceCallback callback, void *data)
+{
+    FILE *f1, *f2, *f3;
+    EADFIO io1, io2, io3;
+    EADFHeader *h1, *h2;
+    EADFTrackSource *trackSources;
+    EADFChecksums *sums = NULL;
+    EADFStatus status;
+    CommandStatus cbStatus;
+    double start;
+
+    if ((h1 = calloc(2, sizeof(EADFHeader))) == NULL) {
+        command_errno = COMMANDERROR_NOMEMORY;
+        return COMMANDSTATUS_FAILURE;
+    }
+    h2 = h1 + 1;
+
+    if ((f1 = openImage(src1)) == NULL) {
+        free(h1);
+        command_errno = COMMANDERROR_CANNOTOPENFILE;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if ((f2 = openImage(src2)) == NULL) {
+        free(h1);
+        fclose(f1);
+        command_errno = COMMANDERROR_CANNOTOPENFILE;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if ((f3 = fopen(dest, "wb")) == NULL) {
+        perror(dest);
+        free(h1);
+        fclose(f1);
+        fclose(f2);
+        command_errno = COMMANDERROR_CANNOTOPENFILE;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if (eadfHeaderInitWithFile(h1, f1) != EADFSTATUS_SUCCESS) {
+        eadfPrintErrorWithContext(src1);
+        free(h1);
+        fclose(f1);
+        fclose(f2);
+        fclose(f3);
+        command_errno = COMMANDERROR_INVALIDFILE;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if (eadfHeaderInitWithFile(h2, f2) != EADFSTATUS_SUCCESS) {
+        eadfPrintErrorWithContext(src2);
+        free(h1);
+        fclose(f1);
+        fclose(f2);
+        fclose(f3);
+        command_errno = COMMANDERROR_INVALIDFILE;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    trackSources = eadfArenaAlloc(((h1->numTracks > h2->numTracks)
+        ? h1->numTracks : h2->numTracks) * sizeof(EADFTrackSource));
+    if (trackSources == NULL) {
+        free(h1);
+        fclose(f1);
+        fclose(f2);
+        fclose(f3);
+        command_errno = COMMANDERROR_NOMEMORY;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    start = statsClock();
+    cbStatus = callback(trackSources, h1, h2, data);
+    statsAddTime(EADFPHASE_PLANNING, start);
+    if (cbStatus == COMMANDSTATUS_FAILURE) {
+        free(h1);
+        fclose(f1);
+        fclose(f2);
+        fclose(f3);
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if (option_manifest && (sums = calloc(1, sizeof(EADFChecksums))) == NULL) {
+        free(h1);
+        fclose(f1);
+        fclose(f2);
+        fclose(f3);
+        command_errno = COMMANDERROR_NOMEMORY;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    start = statsClock();
+    eadfIOInitFile(&io1, f1);
+    eadfIOInitFile(&io2, f2);
+    eadfIOInitFile(&io3, f3);
+    status = eadfMergeFiles(h1, &io1, h2, &io2, &io3, trackSources, sums);
+    statsAddTime(EADFPHASE_COPY, start);
+    free(h1);
+    fclose(f1);
+    fclose(f2);
+    fclose(f3);
+
+    if (status != EADFSTATUS_SUCCESS) {
+        free(sums);
+        eadfPrintErrorWithContext(NULL);
+        command_errno = COMMANDERROR_MERGEERROR;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if (sums != NULL) {
+        CommandStatus st = writeManifest(dest, sums);
+        free(sums);
+        return st;
+    }
+
+    return COMMANDSTATUS_SUCCESS;
+}
+
+/*
+** Split an extended ADF file into one or more others in a single pass.
+**
+** Argument "src" is the name of the source file and "dests" holds the
+** names of the "numDests" destination files. The tracks given by the
+** TRACKSPECs specs[i] are copied to dests[i].
+*/
+CommandStatus splitFiles(const char *src, unsigned long numDests,
+    char **dests, const CommandTrackSpecs *specs)
+{
+    FILE *f, **fs;
+    EADFIO io, *dio, **dios;
+    EADFHeader *h;
+    EADFChecksums **sums;
+    EADFTrackSource **trackSources;
+    unsigned long numOpen = 0, i, track;
+    CommandStatus status = COMMANDSTATUS_SUCCESS;
+    double start;
+
+    h = calloc(1, sizeof(EADFHeader));
+    fs = malloc(numDests * sizeof(FILE *));
+    sums = malloc(numDests * sizeof(EADFChecksums *));
+    dio = eadfArenaAlloc(numDests * sizeof(EADFIO));
+    dios = eadfArenaAlloc(numDests * sizeof(EADFIO *));
+    trackSources = eadfArenaAlloc(numDests * sizeof(EADFTrackSource *));
+    if (h == NULL || fs == NULL || sums == NULL || dio == NULL
+        || dios == NULL || trackSources == NULL)
+    {
+        free(h);
+        free(fs);
+        free(sums);
+        command_errno = COMMANDERROR_NOMEMORY;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    for (i = 0; i < numDests; i++) {
+        sums[i] = NULL;
+        if (option_manifest && (sums[i] = calloc(1, sizeof(EADFChecksums)))
+            == NULL)
+        {
+            command_errno = COMMANDERROR_NOMEMORY;
+            status = COMMANDSTATUS_FAILURE;
+        }
+    }
+
+    if (status == COMMANDSTATUS_SUCCESS
+        && readImageIO(src, &io, &f) != EADFSTATUS_SUCCESS)
+    {
+        command_errno = COMMANDERROR_CANNOTOPENFILE;
+        status = COMMANDSTATUS_FAILURE;
+    } else if (status == COMMANDSTATUS_SUCCESS) {
+        if (eadfHeaderInitWithIO(h, &io, (io.position < 0) ? 0 : io.position)
+            != EADFSTATUS_SUCCESS)
+        {
+            eadfPrintErrorWithContext(src);
+            command_errno = COMMANDERROR_INVALIDFILE;
+            status = COMMANDSTATUS_FAILURE;
+        }
+
+        for (i = 0; i < numDests && status == COMMANDSTATUS_SUCCESS; i++) {
+            trackSources[i] = eadfArenaAlloc(h->numTracks
+                * sizeof(EADFTrackSource));
+            if (trackSources[i] == NULL) {
+                command_errno = COMMANDERROR_NOMEMORY;
+                status = COMMANDSTATUS_FAILURE;
+                break;
+            }
+
+            for (track = 0; track < h->numTracks; track++) {
+                trackSources[i][track] = EADFTRACKSOURCE_NONE;
+            }
+            parseTrackSpecs(specs[i].argc, specs[i].argv, specs[i].start,
+                trackSources[i], h->numTracks, EADFTRACKSOURCE_SOURCE1);
+        }
+
+        for (; numOpen < numDests && status == COMMANDSTATUS_SUCCESS;
+             numOpen++)
+        {
+            if ((fs[numOpen] = fopen(dests[numOpen], "wb")) == NULL) {
+                perror(dests[numOpen]);
+                command_errno = COMMANDERROR_CANNOTOPENFILE;
+                status = COMMANDSTATUS_FAILURE;
+                break;
+            }
+
+            dios[numOpen] = &dio[numOpen];
+            eadfIOInitFile(dios[numOpen], fs[numOpen]);
+        }
+
+        if (status == COMMANDSTATUS_SUCCESS) {
+            start = statsClock();
+            if (eadfSplitFiles(h, &io, numDests, dios, trackSources, sums)
+                != EADFSTATUS_SUCCESS)
+            {
+                eadfPrintErrorWithContext(NULL);
+                command_errno = COMMANDERROR_MERGEERROR;
+                status = COMMANDSTATUS_FAILURE;
+            }
+            statsAddTime(EADFPHASE_COPY, start);
+        }
+
+        for (i = 0; i < numOpen; i++) {
+            fclose(fs[i]);
+        }
+        closeImageIO(&io, f);
+    }
+
+    for (i = 0; i < numDests; i++) {
+        if (status == COMMANDSTATUS_SUCCESS && sums[i] != NULL)
+            status = writeManifest(dests[i], sums[i]);
+        free(sums[i]);
+    }
+
+    free(h);
+    free(fs);
+    free(sums);
+    return status;
+}
+
+/*
+** Write the checksums of the extended ADF file "dest" to a manifest
+** named after it with ".crc" appended.
+**
+** The manifest is a text file with one "file" line giving the size
+** and CRC-32 of the whole file followed by a "track" line giving the
+** size and CRC-32 of the data of each track.
+*/
+CommandStatus writeManifest(const char *dest, const EADFChecksums *sums)
+{
+    char *name;
+    FILE *f;
+    unsigned long track;
+    int failed;
+
+    if ((name = malloc(strlen(dest) + 5)) == NULL) {
+        command_errno = COMMANDERROR_NOMEMORY;
+        return COMMANDSTATUS_FAILURE;
+    }
+    sprintf(name, "%s.crc", dest);
+
+    if ((f = fopen(name, "w")) == NULL) {
+        perror(name);
+        free(name);
+        command_errno = COMMANDERROR_MANIFESTERROR;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    fprintf(f, "; CRC-32 manifest written by rawadf " VERSION "\n");
+    fprintf(f, "file %s %lu %08lx\n", dest, sums->fileSize, sums->fileCrc);
+    for (track = 0; track < sums->numTracks; track++) {
+        fprintf(f, "track %lu %lu %08lx\n", track,
+            (unsigned long)sums->trackSizeBytes[track],
+            (unsigned long)sums->trackCrc[track]);
+    }
+
+    failed = ferror(f);
+    if (fclose(f) != 0 || failed) {
+        perror(name);
+        free(name);
+        command_errno = COMMANDERROR_MANIFESTERROR;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    free(name);
+    return COMMANDSTATUS_SUCCESS;
+}
+
+/*
+** Populate an EADFTrackSource array using source1 for each track unless
+** it is a non-DOS track and the corresponding track from source2 is
+** a DOS track.
+*/
+CommandStatus dosMergeTrackSourceCallback(EADFTrackSource *trackSources,
+    EADFHeader *h1, EADFHeader *h2, void *data)
+{
+    unsigned long track, numTracks;
+
+    (void) data; /* prevent compiler issuing unused variable warnings */
+
+    numTracks = (h1->numTracks > h2->numTracks) ? h1->numTracks:h2->numTracks;
+    for (track = 0; track < numTracks; track++) {
+        if (track >= h2->numTracks
+            || (track < h1->numTracks
+                && (h1->trackType[track] == EADFTRACKTYPE_DOS
+                    || h2->trackType[track] == EADFTRACKTYPE_RAW)))
+        {
+            trackSources[track] = EADFTRACKSOURCE_SOURCE1;
+        } else {
+            trackSources[track] = EADFTRACKSOURCE_SOURCE2;
+        }
+    }
+
+    return COMMANDSTATUS_SUCCESS;
+}
+
+CommandStatus executeDosMergeCommand(int argc, char **argv)
+{
+    if (argc != 5) {
+        command_errno = COMMANDERROR_WRONGNUMBEROFARGS;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    return mergeFiles(argv[2], argv[3], argv[4], dosMergeTrackSourceCallback,
+        NULL);
+}
+
+/*
+** Copy the tracks of "h" selected in "trackSources" out of "f". Each
+** track is written to a file of its own named DEST.NNN, where NNN is
+** the track number, or if "concat" is set the tracks are written one
+** after another to the file "dest" and listed with their offsets in
+** DEST.lst. The source is read once, in track order.
+*/
+CommandStatus extractTracks(EADFHeader *h, FILE *f, const char *n,
+    const EADFTrackSource *trackSources, const char *dest, int concat)
+{
+    unsigned char *buffer;
+    char *name;
+    unsigned long track, first, last, offset = 0;
+    FILE *out = NULL, *list = stdout;
+    EADFIO src, dio;
+    CommandStatus status = COMMANDSTATUS_SUCCESS;
+    double start;
+
+    buffer = malloc(EADF_COPYBUFSIZE);
+    name = malloc(strlen(dest) + 12);
+    if (buffer == NULL || name == NULL) {
+        free(buffer);
+        free(name);
+        command_errno = COMMANDERROR_NOMEMORY;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if (concat) {
+        sprintf(name, "%s.lst", dest);
+        if ((out = fopen(dest, "wb")) == NULL) {
+            perror(dest);
+        } else if ((list = fopen(name, "w")) == NULL) {
+            perror(name);
+            fclose(out);
+        }
+
+        if (out == NULL || list == NULL) {
+            free(buffer);
+            free(name);
+            command_errno = COMMANDERROR_CANNOTOPENFILE;
+            return COMMANDSTATUS_FAILURE;
+        }
+    }
+
+    fprintf(list, "Track Cyl Side Type  Length    Bits %s\n",
+        concat ? " Offset" : "File");
+
+    start = statsClock();
+    eadfIOInitFile(&src, f);
+    if (concat)
+        eadfIOInitFile(&dio, out);
+    for (first = 0; first < h->numTracks; first = last + 1) {
+        last = first;
+        if (trackSources[first] == EADFTRACKSOURCE_NONE)
+            continue;
+
+        /* Runs of adjacent tracks go into the stream in one piece */
+        if (concat) {
+            while (last + 1 < h->numTracks
+                   && trackSources[last + 1] != EADFTRACKSOURCE_NONE)
+            {
+                last++;
+            }
+        } else {
+            sprintf(name, "%s.%03lu", dest, first);
+            if ((out = fopen(name, "wb")) == NULL) {
+                perror(name);
+                command_errno = COMMANDERROR_CANNOTOPENFILE;
+                status = COMMANDSTATUS_FAILURE;
+                break;
+            }
+            eadfIOInitFile(&dio, out);
+        }
+
+        if (eadfCopyTracks(h, &src, &dio, concat ? offset : 0, first, last,
+                buffer, EADF_COPYBUFSIZE, NULL, NULL) != EADFSTATUS_SUCCESS)
+        {
+            eadfPrintErrorWithContext((eadf_errno == EADFERROR_WRITEERROR)
+                ? (concat ? dest : name) : n);
+            command_errno = COMMANDERROR_EXTRACTERROR;
+            status = COMMANDSTATUS_FAILURE;
+        }
+
+        if (!concat && fclose(out) != 0 && status == COMMANDSTATUS_SUCCESS) {
+            perror(name);
+            command_errno = COMMANDERROR_EXTRACTERROR;
+            status = COMMANDSTATUS_FAILURE;
+        }
+
+        if (status != COMMANDSTATUS_SUCCESS)
+            break;
+
+        for (track = first; track <= last; track++) {
+            fprintf(list, "%5lu %3lu %4lu %4s %7lu %7lu ",
+                track,
+                track / 2,
+                (track % 2) + 1,
+                EADFTRACKTYPE_NAMES[h->trackType[track]],
+                (unsigned long)h->trackSizeBytes[track],
+                (unsigned long)h->trackSizeBits[track]);
+            if (concat) {
+                fprintf(list, "%7lu\n", offset);
+                offset += h->trackSizeBytes[track];
+            } else {
+                fprintf(list, "%s\n", name);
+            }
+        }
+    }
+    statsAddTime(EADFPHASE_COPY, start);
+
+    if (concat) {
+        if (fclose(out) != 0 && status == COMMANDSTATUS_SUCCESS) {
+            perror(dest);
+            command_errno = COMMANDERROR_EXTRACTERROR;
+            status = COMMANDSTATUS_FAILURE;
+        }
+
+        sprintf(name, "%s.lst", dest);
+        if (fclose(list) != 0 && status == COMMANDSTATUS_SUCCESS) {
+            perror(name);
+            command_errno = COMMANDERROR_EXTRACTERROR;
+            status = COMMANDSTATUS_FAILURE;
+        }
+    }
+
+    free(buffer);
+    free(name);
+    return status;
+}
+
+CommandStatus executeExtractCommand(int argc, char **argv)
+{
+    EADFHeader *h;
+    EADFTrackSource *trackSources;
+    CommandStatus status;
+    unsigned long track;
+    int concat, first;
+    FILE *f;
+
+    concat = (argc > 2 && !strcmp(argv[2], "-c"));
+    first = concat ? 3 : 2;
+    if (argc < first + 3) {
+        command_errno = COMMANDERROR_WRONGNUMBEROFARGS;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if (parseTrackSpecs(argc, argv, first + 2, NULL, 0,
+            EADFTRACKSOURCE_SOURCE1) != COMMANDSTATUS_SUCCESS)
+    {
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if ((h = calloc(1, sizeof(EADFHeader))) == NULL) {
+        command_errno = COMMANDERROR_NOMEMORY;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if ((f = openImage(argv[first])) == NULL) {
+        free(h);
+        command_errno = COMMANDERROR_CANNOTOPENFILE;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if (eadfHeaderInitWithFile(h, f) != EADFSTATUS_SUCCESS) {
+        eadfPrintErrorWithContext(argv[first]);
+        command_errno = COMMANDERROR_INVALIDFILE;
+        status = COMMANDSTATUS_FAILURE;
+    } else if ((trackSources = eadfArenaAlloc(h->numTracks
+                    * sizeof(EADFTrackSource))) == NULL)
+    {
+        command_errno = COMMANDERROR_NOMEMORY;
+        status = COMMANDSTATUS_FAILURE;
+    } else {
+        for (track = 0; track < h->numTracks; track++) {
+            trackSources[track] = EADFTRACKSOURCE_NONE;
+        }
+        parseTrackSpecs(argc, argv, first + 2, trackSources, h->numTracks,
+            EADFTRACKSOURCE_SOURCE1);
+        status = extractTracks(h, f, argv[first], trackSources,
+            argv[first + 1], concat);
+    }
+
+    fclose(f);
+    free(h);
+    return status;
+}
+
+CommandStatus executeFromAdfCommand(int argc, char **argv)
+{
+    EADFTrackType type = EADFTRACKTYPE_DOS;
+    FILE *f1, *f2;
+    EADFStatus status;
+    long size;
+    double start;
+
+    if (argc != 4 && argc != 5) {
+        command_errno = COMMANDERROR_WRONGNUMBEROFARGS;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if (argc == 5) {
+        if (!strcmp(argv[4], EADFTRACKTYPE_NAMES[EADFTRACKTYPE_RAW])) {
+            type = EADFTRACKTYPE_RAW;
+        } else if (strcmp(argv[4], EADFTRACKTYPE_NAMES[EADFTRACKTYPE_DOS])) {
+            command_errno = COMMANDERROR_INVALIDTRACKTYPE;
+            return COMMANDSTATUS_FAILURE;
+        }
+    }
+
+    if ((f1 = fopen(argv[2], "rb")) == NULL) {
+        perror(argv[2]);
+        command_errno = COMMANDERROR_CANNOTOPENFILE;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if (eadfSeek(f1, 0, SEEK_END) < 0 || (size = ftell(f1)) < 0
+        || eadfSeek(f1, 0, SEEK_SET) < 0)
+    {
+        perror(argv[2]);
+        fclose(f1);
+        command_errno = COMMANDERROR_SEEKERROR;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if ((f2 = fopen(argv[3], "wb")) == NULL) {
+        perror(argv[3]);
+        fclose(f1);
+        command_errno = COMMANDERROR_CANNOTOPENFILE;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    start = statsClock();
+    status = eadfFromAdf(f1, size, f2, type);
+    statsAddTime(EADFPHASE_COPY, start);
+    fclose(f1);
+    fclose(f2);
+
+    if (status != EADFSTATUS_SUCCESS) {
+        eadfPrintErrorWithContext(argv[2]);
+        command_errno = COMMANDERROR_INVALIDFILE;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    return COMMANDSTATUS_SUCCESS;
+}
+
+void printHelpForCommand(const char *cmd)
+{
+    Command which = commandFromString(cmd);
+
+    if (which == COMMAND_UNKNOWN) {
+        commandPrintErrorWithContext(cmd);
+        return;
+    }
+
+    fprintf(stdout, "%s\n", COMMAND_HELPTEXT[which]);
+}
+
+CommandStatus executeHelpCommand(int argc, char **argv)
+{
+    int i, j;
+
+    if (argc > 2) {
+        printHelpForCommand(argv[2]);
+
+        for (i = 3; i < argc; i++) {
+            fprintf(stdout, "\n");
+            printHelpForCommand(argv[i]);
+        }
+        return COMMANDSTATUS_SUCCESS;
+    }
+
+    fprintf(stdout, "%s\n   %s", COMMAND_BASICHELP, COMMAND_ALIASES[0]);
+    for (i = 1, j = 0; i < COMMAND_NUMALIASES; i++) {
+        if (COMMAND_ALIASMAP[i] == COMMAND_ALIASMAP[j])
+            continue;
+
+        if (j == i-1) {
+            j = i;
+            fprintf(stdout, "\n   %s", COMMAND_ALIASES[j]);
+            continue;
+        }
+
+        fprintf(stdout, " (%s", COMMAND_ALIASES[j+1]);
+        for (j = j+2; j < i; j++) {
+            fprintf(stdout, ", %s", COMMAND_ALIASES[j]);
+        }
+        fprintf(stdout, ")\n   %s", COMMAND_ALIASES[j]);
+    }
+    fprintf(stdout, "\n\n%s\n", COMMAND_OPTIONSHELP);
+
+    return COMMANDSTATUS_SUCCESS;
+}
+
+/*
+** A database of the signatures of known tracks, loaded from a text
+** file by loadSignatures(). Signatures are kept in an open addressing
+** hash table, and a Bloom filter in front of it rules out most tracks
+** which are not in the database by testing a few bits of a much
+** smaller array.
+*/
+typedef struct {
+    unsigned long crc;
+    unsigned long size;
+    char *label;
+} Signature;
+
+typedef struct {
+    unsigned long numSignatures;
+    unsigned long tableMask;
+    Signature *table;
+    unsigned long bloomMask;
+    unsigned char *bloom;
+} SignatureDatabase;
+
+unsigned long signatureHash(unsigned long crc, unsigned long size)
+{
+    return hashMix(crc ^ hashMix(size));
+}
+
+/*
+** Return the label of the track with the signature "crc" and "size",
+** or NULL if it is not in the database.
+*/
+const char *findSignature(const SignatureDatabase *db, unsigned long crc,
+    unsigned long size)
+{
+    unsigned long hash, step, bit, slot;
+    int i;
+
+    hash = signatureHash(crc, size);
+    step = hashMix(hash) | 1;
+    for (i = 0, bit = hash; i < COMMAND_BLOOMHASHES; i++, bit += step) {
+        if (!(db->bloom[(bit & db->bloomMask) >> 3] & (1 << (bit & 7))))
+            return NULL;
+    }
+
+    for (slot = hash & db->tableMask; db->table[slot].label != NULL;
+         slot = (slot + 1) & db->tableMask)
+    {
+        if (db->table[slot].crc == crc && db->table[slot].size == size)
+            return db->table[slot].label;
+    }
+
+    return NULL;
+}
+
+/*
+** Add a signature to the database, replacing the label of any earlier
+** signature which is the same. The table must have a free slot.
+*/
+void addSignature(SignatureDatabase *db, unsigned long crc,
+    unsigned long size, char *label)
+{
+    unsigned long hash, step, bit, slot;
+    int i;
+
+    hash = signatureHash(crc, size);
+    step = hashMix(hash) | 1;
+    for (i = 0, bit = hash; i < COMMAND_BLOOMHASHES; i++, bit += step) {
+        db->bloom[(bit & db->bloomMask) >> 3] |= 1 << (bit & 7);
+    }
+
+    for (slot = hash & db->tableMask; db->table[slot].label != NULL;
+         slot = (slot + 1) & db->tableMask)
+    {
+        if (db->table[slot].crc == crc && db->table[slot].size == size) {
+            free(db->table[slot].label);
+            db->table[slot].label = label;
+            return;
+        }
+    }
+
+    db->table[slot].crc = crc;
+    db->table[slot].size = size;
+    db->table[slot].label = label;
+    db->numSignatures++;
+}
+
+void freeSignatures(SignatureDatabase *db)
+{
+    unsigned long slot;
+
+    if (db->table != NULL) {
+        for (slot = 0; slot <= db->tableMask; slot++) {
+            free(db->table[slot].label);
+        }
+    }
+    free(db->table);
+    free(db->bloom);
+}
+
+/*
+** Load the signature database "name", a text file with one known track
+** per line in the form "CRC SIZE LABEL", as printed by identify -s.
+** Lines starting with ';' are ignored.
+*/
+CommandStatus loadSignatures(const char *name, SignatureDatabase *db)
+{
+    char line[COMMAND_BUFSIZE], *label;
+    unsigned long numLines = 0, numEntries = 0, crc, size, length;
+    int numChars;
+    FILE *f;
+
+    db->table = NULL;
+    db->bloom = NULL;
+    db->numSignatures = 0;
+
+    if ((f = fopen(name, "r")) == NULL) {
+        perror(name);
+        command_errno = COMMANDERROR_CANNOTOPENFILE;
+        return COMMANDSTATUS_FAILURE;
+    }
 
-    for (track = 0; track < numTracks; track++) {
-        FILE *src;
-        long numBytes;
+    /* Size the table and filter from the number of lines */
+    while (fgets(line, sizeof(line), f) != NULL) {
+        numLines++;
+    }
+
+    for (db->tableMask = 15; db->tableMask < numLines * 2;
+         db->tableMask = db->tableMask * 2 + 1)
+    {
+    }
+    for (db->bloomMask = 127; db->bloomMask < numLines * 16;
+         db->bloomMask = db->bloomMask * 2 + 1)
+    {
+    }
 
-        if (trackSources[track] == EADFTRACKSOURCE_SOURCE1)
+    db->table = calloc(db->tableMask + 1, sizeof(Signature));
+    db->bloom = calloc((db->bloomMask + 1) / 8, 1);
+    if (db->table == NULL || db->bloom == NULL) {
+        fclose(f);
+        freeSignatures(db);
+        command_errno = COMMANDERROR_NOMEMORY;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    rewind(f);
+    while (numEntries < numLines && fgets(line, sizeof(line), f) != NULL) {
+        numEntries++;
+        length = strlen(line);
+        while (length > 0 && (line[length - 1] == '\n'
+                              || line[length - 1] == '\r'))
         {
-            src = f1;
-            numBytes = h1->trackSizeBytes[track];
-            if (fseek(f1, h1->trackOffset[track], SEEK_SET) < 0) {
-                perror(n1);
-                eadf_errno = EADFERROR_SEEKERROR;
-                return EADFSTATUS_FAILURE;
-            }
-        } else if (trackSources[track] == EADFTRACKSOURCE_SOURCE2) {
-            src = f2;
-            numBytes = h2->trackSizeBytes[track];
-            if (fseek(f2, h2->trackOffset[track], SEEK_SET) < 0) {
-                perror(n2);
-                eadf_errno = EADFERROR_SEEKERROR;
-                return EADFSTATUS_FAILURE;
-            }
-        } else { /* trackSources[track] == EADFTRACKSOURCE_NONE */
-            continue;
+            line[--length] = '\0';
         }
+        if (length == 0 || line[0] == ';')
+            continue;
 
-        for (; numBytes > 0; numBytes -= EADF_BUFSIZE) {
-            unsigned int count;
-            count = (numBytes > EADF_BUFSIZE) ? EADF_BUFSIZE : numBytes;
-
-            if (fread(buffer, 1, count, src) < count) {
-                eadf_errno = EADFERROR_UNKNOWNERROR;
-                if (feof(src)) {
-                    eadf_errno = EADFERROR_EOFERROR;
-                } else if (ferror(src)) {
-                    eadf_errno = EADFERROR_READERROR;
-                }
-                return EADFSTATUS_FAILURE;
-            }
+        numChars = 0;
+        if (sscanf(line, "%lx %lu %n", &crc, &size, &numChars) < 2
+            || numChars == 0 || line[numChars] == '\0')
+        {
+            fprintf(stderr, "%s:%lu: Invalid signature\n", name, numEntries);
+            fclose(f);
+            freeSignatures(db);
+            command_errno = COMMANDERROR_INVALIDSIGNATURES;
+            return COMMANDSTATUS_FAILURE;
+        }
 
-            if (fwrite(buffer, 1, count, dest) < count) {
-                eadf_errno = EADFERROR_WRITEERROR;
-                return EADFSTATUS_FAILURE;
-            }
+        if ((label = malloc(length - numChars + 1)) == NULL) {
+            fclose(f);
+            freeSignatures(db);
+            command_errno = COMMANDERROR_NOMEMORY;
+            return COMMANDSTATUS_FAILURE;
         }
+        strcpy(label, line + numChars);
+        addSignature(db, crc & 0xffffffffUL, size, label);
     }
 
-    return EADFSTATUS_SUCCESS;
+    fclose(f);
+    return COMMANDSTATUS_SUCCESS;
 }
 
-EADFStatus eadfSplitFile(EADFHeader *h, FILE *f, const char *n, FILE *dest,
-    const EADFTrackSource *trackSources)
+/*
+** Print the label from "db" of each track of an extended ADF file, or
+** if "db" is NULL print the signature of each track in the form read
+** by loadSignatures(), labelled with the file name and track number.
+*/
+CommandStatus identifyTracks(const SignatureDatabase *db, const char *name)
 {
-    unsigned char buffer[EADF_BUFSIZE], *upto;
-    unsigned long track, bufLength;
+    EADFHeader *h;
+    unsigned char *buffer, *work;
+    unsigned long track, bufSize, crc, size, numKnown = 0, numTracks = 0;
+    const char *label;
+    CommandStatus status = COMMANDSTATUS_SUCCESS;
+    double start;
+    FILE *f;
 
-    strncpy((char *)buffer, EADF_MAGIC, EADF_MAGICLEN);
+    if ((h = calloc(1, sizeof(EADFHeader))) == NULL) {
+        command_errno = COMMANDERROR_NOMEMORY;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if ((f = openImage(name)) == NULL) {
+        free(h);
+        command_errno = COMMANDERROR_CANNOTOPENFILE;
+        return COMMANDSTATUS_FAILURE;
+    }
 
-    bigEndianBytesFromLong(buffer + EADF_MAGICLEN, h->numTracks);
+    if (eadfHeaderInitWithFile(h, f) != EADFSTATUS_SUCCESS) {
+        eadfPrintErrorWithContext(name);
+        fclose(f);
+        free(h);
+        command_errno = COMMANDERROR_INVALIDFILE;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    bufSize = eadfMaxTrackSize(h);
+    if (bufSize < ADF_TRACKSIZE)
+        bufSize = ADF_TRACKSIZE;
+    buffer = malloc(bufSize);
+    work = malloc(bufSize);
+    if (buffer == NULL || work == NULL) {
+        free(buffer);
+        free(work);
+        fclose(f);
+        free(h);
+        command_errno = COMMANDERROR_NOMEMORY;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if (db != NULL) {
+        fprintf(stdout, "File name: %s\nNumber of tracks: %lu\n"
+            "Track Cyl Side Type Signature   Size Label\n",
+            name, h->numTracks);
+    }
 
-    upto = buffer + EADF_MAGICLEN + 4;
     for (track = 0; track < h->numTracks; track++) {
-        if (trackSources[track] == EADFTRACKSOURCE_SOURCE1)
+        start = statsClock();
+        if (eadfTrackSignature(h, f, name, track, buffer, work, &crc, &size)
+            != EADFSTATUS_SUCCESS)
         {
-            bigEndianBytesFromLong(upto, h->trackType[track]);
-            bigEndianBytesFromLong(upto + 4, h->trackSizeBytes[track]);
-            bigEndianBytesFromLong(upto + 8, h->trackSizeBits[track]);
-        } else {
-            bigEndianBytesFromLong(upto, EADFTRACKTYPE_RAW);
-            bigEndianBytesFromLong(upto + 4, 0);
-            bigEndianBytesFromLong(upto + 8, 0);
+            statsAddTime(EADFPHASE_COMPARE, start);
+            eadfPrintErrorWithContext(name);
+            command_errno = COMMANDERROR_INVALIDFILE;
+            status = COMMANDSTATUS_FAILURE;
+            break;
         }
-        upto += EADF_BYTESPERRECORD;
+        statsAddTime(EADFPHASE_COMPARE, start);
 
-        bufLength = upto - buffer;
-        if (bufLength > (EADF_BUFSIZE - EADF_BYTESPERRECORD)) {
-            if (fwrite(buffer, 1, bufLength, dest) < bufLength) {
-                eadf_errno = EADFERROR_WRITEERROR;
-                return EADFSTATUS_FAILURE;
-            }
-            upto = buffer;
+        if (size == 0)
+            continue;
+
+        if (db == NULL) {
+            fprintf(stdout, "%08lx %lu %s:%lu\n", crc, size, name, track);
+            continue;
         }
+
+        numTracks++;
+        if ((label = findSignature(db, crc, size)) != NULL)
+            numKnown++;
+
+        fprintf(stdout, "%5lu %3lu %4lu %4s  %08lx %6lu %s\n",
+            track,
+            track / 2,
+            (track % 2) + 1,
+            EADFTRACKTYPE_NAMES[h->trackType[track]],
+            crc,
+            size,
+            (label != NULL) ? label : "-");
     }
 
-    bufLength = upto - buffer;
-    if (fwrite(buffer, 1, bufLength, dest) < bufLength) {
-        eadf_errno = EADFERROR_WRITEERROR;
-        return EADFSTATUS_FAILURE;
+    if (db != NULL && status == COMMANDSTATUS_SUCCESS) {
+        fprintf(stdout, "Identified %lu of %lu tracks\n", numKnown,
+            numTracks);
+    }
+
+    free(buffer);
+    free(work);
+    fclose(f);
+    free(h);
+    return status;
+}
+
+CommandStatus executeIdentifyCommand(int argc, char **argv)
+{
+    SignatureDatabase db;
+    CommandStatus status = COMMANDSTATUS_SUCCESS;
+    int i;
+
+    if (argc < 4) {
+        command_errno = COMMANDERROR_WRONGNUMBEROFARGS;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if (!strcmp(argv[2], "-s")) {
+        for (i = 3; i < argc; i++) {
+            if (identifyTracks(NULL, argv[i]) != COMMANDSTATUS_SUCCESS)
+                status = COMMANDSTATUS_FAILURE;
+        }
+        return status;
+    }
+
+    if (loadSignatures(argv[2], &db) != COMMANDSTATUS_SUCCESS)
+        return COMMANDSTATUS_FAILURE;
+
+    for (i = 3; i < argc; i++) {
+        if (identifyTracks(&db, argv[i]) != COMMANDSTATUS_SUCCESS)
+            status = COMMANDSTATUS_FAILURE;
+    }
+
+    freeSignatures(&db);
+    return status;
+}
+
+/*
+** Write the layouts of the tracks of the extended ADF file "name" to
+** its sync index, NAME.idx. The size and header checksum of the file
+** are recorded so that readSyncIndex() can tell when it has changed.
+** If "quiet" is non-zero a failure is not reported and leaves
+** command_errno alone, for callers which write the index in passing.
+*/
+CommandStatus writeSyncIndex(const char *name, EADFHeader *h, long size,
+    const EADFTrackLayout *layouts, int quiet)
+{
+    char *idxName;
+    FILE *f;
+    unsigned long track, i;
+    int failed;
+
+    if ((idxName = malloc(strlen(name) + 5)) == NULL) {
+        if (!quiet)
+            command_errno = COMMANDERROR_NOMEMORY;
+        return COMMANDSTATUS_FAILURE;
+    }
+    sprintf(idxName, "%s.idx", name);
+
+    if ((f = fopen(idxName, "w")) == NULL) {
+        if (!quiet) {
+            perror(idxName);
+            command_errno = COMMANDERROR_INDEXERROR;
+        }
+        free(idxName);
+        return COMMANDSTATUS_FAILURE;
     }
 
+    fprintf(f, "; Sync index written by rawadf " VERSION "\n");
+    fprintf(f, "image %ld %08lx\n", size, eadfHeaderCrc(h));
     for (track = 0; track < h->numTracks; track++) {
-        long numBytes;
+        const EADFTrackLayout *l = &layouts[track];
 
-        if (trackSources[track] != EADFTRACKSOURCE_SOURCE1)
+        if (h->trackSizeBytes[track] == 0)
             continue;
 
-        numBytes = h->trackSizeBytes[track];
-        if (fseek(f, h->trackOffset[track], SEEK_SET) < 0) {
-            perror(n);
-            eadf_errno = EADFERROR_SEEKERROR;
-            return EADFSTATUS_FAILURE;
+        fprintf(f, "track %lu %s %lu %lu %lu", track,
+            EADFTRACKCLASS_NAMES[l->trackClass], l->numSyncs, l->numSectors,
+            l->maxGap);
+        for (i = 0; i < l->numSyncs && i < EADF_MAXSYNCS; i++) {
+            fprintf(f, " %lu", l->syncPos[i]);
         }
+        fprintf(f, "\n");
+    }
 
-        for (; numBytes > 0; numBytes -= EADF_BUFSIZE) {
-            unsigned int count;
-            count = (numBytes > EADF_BUFSIZE) ? EADF_BUFSIZE : numBytes;
+    failed = ferror(f);
+    if (fclose(f) != 0 || failed) {
+        if (!quiet) {
+            perror(idxName);
+            command_errno = COMMANDERROR_INDEXERROR;
+        }
+        remove(idxName);
+        free(idxName);
+        return COMMANDSTATUS_FAILURE;
+    }
 
-            if (fread(buffer, 1, count, f) < count) {
-                eadf_errno = EADFERROR_UNKNOWNERROR;
-                if (feof(f)) {
-                    eadf_errno = EADFERROR_EOFERROR;
-                } else if (ferror(f)) {
-                    eadf_errno = EADFERROR_READERROR;
-                }
-                return EADFSTATUS_FAILURE;
-            }
+    free(idxName);
+    return COMMANDSTATUS_SUCCESS;
+}
 
-            if (fwrite(buffer, 1, count, dest) < count) {
-                eadf_errno = EADFERROR_WRITEERROR;
-                return EADFSTATUS_FAILURE;
-            }
+/*
+** Read the sync index of the extended ADF file "name" into "layouts".
+** Returns zero if there is no index, or it does not match the file.
+*/
+int readSyncIndex(const char *name, EADFHeader *h, long size,
+    EADFTrackLayout *layouts)
+{
+    char *idxName, line[COMMAND_BUFSIZE], className[16], *upto, *endptr;
+    unsigned long track, i, crc;
+    long indexSize;
+    int matched = 0, valid = 1, numChars;
+    FILE *f;
+
+    if ((idxName = malloc(strlen(name) + 5)) == NULL)
+        return 0;
+    sprintf(idxName, "%s.idx", name);
+    f = fopen(idxName, "r");
+    free(idxName);
+    if (f == NULL)
+        return 0;
+
+    memset(layouts, 0, h->numTracks * sizeof(EADFTrackLayout));
+    while (valid && fgets(line, sizeof(line), f) != NULL) {
+        EADFTrackLayout l;
+
+        if (line[0] == ';')
+            continue;
+
+        if (!matched) {
+            matched = sscanf(line, "image %ld %lx", &indexSize, &crc) == 2
+                && indexSize == size && crc == eadfHeaderCrc(h);
+            valid = matched;
+            continue;
+        }
+
+        numChars = 0;
+        valid = sscanf(line, "track %lu %15s %lu %lu %lu%n", &track,
+                className, &l.numSyncs, &l.numSectors, &l.maxGap, &numChars)
+                == 5
+            && track < h->numTracks;
+
+        for (i = 0; valid && i < EADFTRACKCLASS_NUMCLASSES; i++) {
+            if (!strcmp(className, EADFTRACKCLASS_NAMES[i]))
+                break;
         }
+        valid = valid && i < EADFTRACKCLASS_NUMCLASSES;
+        l.trackClass = (EADFTrackClass)i;
+
+        upto = line + numChars;
+        for (i = 0; valid && i < l.numSyncs && i < EADF_MAXSYNCS; i++) {
+            l.syncPos[i] = strtoul(upto, &endptr, 10);
+            valid = endptr != upto;
+            upto = endptr;
+        }
+
+        if (valid)
+            layouts[track] = l;
     }
 
-    return EADFSTATUS_SUCCESS;
+    fclose(f);
+    return matched && valid;
 }
+
 /*
-** End of EADF stuff
+** Fill in "layouts" for each track of an extended ADF file, from its
+** sync index if that is up to date or else by scanning the file. If
+** "save" is non-zero the result of a scan is written to the index so
+** the next call can use it; failing to write it is not an error.
+** Images in bundles have no index, as it would sit beside the bundle
+** and go out of date whenever any of its images changed.
 */
+CommandStatus loadLayouts(EADFHeader *h, FILE *f, const char *name,
+    EADFTrackLayout *layouts, int save)
+{
+    long size;
+    int bundled;
+
+    if ((size = eadfFileSize(f)) < 0) {
+        perror(name);
+        command_errno = COMMANDERROR_SEEKERROR;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    bundled = isBundledImage(name);
+    if (!bundled && readSyncIndex(name, h, size, layouts))
+        return COMMANDSTATUS_SUCCESS;
+
+    if (eadfScanLayouts(h, f, name, layouts) != EADFSTATUS_SUCCESS) {
+        eadfPrintErrorWithContext(name);
+        command_errno = COMMANDERROR_READERROR;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if (save && !bundled)
+        writeSyncIndex(name, h, size, layouts, 1);
+    return COMMANDSTATUS_SUCCESS;
+}
 
 /*
-** Compare the specified track of two extended ADF files.
-**
-** Sets *result to zero if the tracks are equal, or non-zero otherwise.
+** Set *classes to an array from the arena holding the class of each
+** track of the extended ADF file "name", from its sync index if that
+** is up to date.
 */
-CommandStatus compareTracks(int *result,
-    EADFHeader *h1, FILE *f1, const char *n1,
-    EADFHeader *h2, FILE *f2, const char *n2,
-    unsigned long track)
+CommandStatus loadClasses(const char *name, EADFTrackClass **classes)
 {
-    unsigned char buf1[COMMAND_BUFSIZE], buf2[COMMAND_BUFSIZE];
-    long numBytes;
+    EADFHeader *h;
+    EADFTrackLayout *layouts = NULL;
+    CommandStatus status;
+    unsigned long track;
+    FILE *f;
+
+    if ((h = calloc(1, sizeof(EADFHeader))) == NULL) {
+        command_errno = COMMANDERROR_NOMEMORY;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if ((f = openImage(name)) == NULL) {
+        free(h);
+        command_errno = COMMANDERROR_CANNOTOPENFILE;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if (eadfHeaderInitWithFile(h, f) != EADFSTATUS_SUCCESS) {
+        eadfPrintErrorWithContext(name);
+        command_errno = COMMANDERROR_INVALIDFILE;
+        status = COMMANDSTATUS_FAILURE;
+    } else if ((layouts = malloc((h->numTracks + 1)
+                    * sizeof(EADFTrackLayout))) == NULL
+               || (*classes = eadfArenaAlloc(h->numTracks
+                    * sizeof(EADFTrackClass))) == NULL)
+    {
+        command_errno = COMMANDERROR_NOMEMORY;
+        status = COMMANDSTATUS_FAILURE;
+    } else {
+        status = loadLayouts(h, f, name, layouts, 0);
+        for (track = 0; track < h->numTracks; track++) {
+            (*classes)[track] = layouts[track].trackClass;
+        }
+    }
+
+    fclose(f);
+    free(h);
+    free(layouts);
+    return status;
+}
+
+CommandStatus executeIndexCommand(int argc, char **argv)
+{
+    EADFHeader *h;
+    CommandStatus status = COMMANDSTATUS_SUCCESS;
+    long size;
+    int i;
+
+    if (argc < 3) {
+        command_errno = COMMANDERROR_WRONGNUMBEROFARGS;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if ((h = calloc(1, sizeof(EADFHeader))) == NULL) {
+        command_errno = COMMANDERROR_NOMEMORY;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    for (i = 2; i < argc; i++) {
+        EADFTrackLayout *layouts = NULL;
+        FILE *f;
+
+        if (isBundledImage(argv[i])) {
+            fprintf(stderr, "%s: Images in bundles are not indexed\n",
+                argv[i]);
+            command_errno = COMMANDERROR_INDEXERROR;
+            status = COMMANDSTATUS_FAILURE;
+            continue;
+        }
+
+        if ((f = openImage(argv[i])) == NULL) {
+            command_errno = COMMANDERROR_CANNOTOPENFILE;
+            status = COMMANDSTATUS_FAILURE;
+            continue;
+        }
+
+        if (eadfHeaderInitWithFile(h, f) != EADFSTATUS_SUCCESS) {
+            eadfPrintErrorWithContext(argv[i]);
+            command_errno = COMMANDERROR_INVALIDFILE;
+            status = COMMANDSTATUS_FAILURE;
+        } else if ((layouts = malloc((h->numTracks + 1)
+                        * sizeof(EADFTrackLayout))) == NULL)
+        {
+            command_errno = COMMANDERROR_NOMEMORY;
+            status = COMMANDSTATUS_FAILURE;
+        } else if ((size = eadfFileSize(f)) < 0) {
+            perror(argv[i]);
+            command_errno = COMMANDERROR_SEEKERROR;
+            status = COMMANDSTATUS_FAILURE;
+        } else if (eadfScanLayouts(h, f, argv[i], layouts)
+                   != EADFSTATUS_SUCCESS)
+        {
+            eadfPrintErrorWithContext(argv[i]);
+            command_errno = COMMANDERROR_READERROR;
+            status = COMMANDSTATUS_FAILURE;
+        } else if (writeSyncIndex(argv[i], h, size, layouts, 0)
+                   != COMMANDSTATUS_SUCCESS)
+        {
+            status = COMMANDSTATUS_FAILURE;
+        }
+
+        fclose(f);
+        free(layouts);
+    }
+
+    free(h);
+    return status;
+}
+
+void displayInfo(EADFHeader *h, const char *name,
+    const EADFTrackLayout *layouts)
+{
+    unsigned int track;
+
+    fprintf(stdout, "File name: %s\nNumber of tracks: %lu\n"
+        "Track Cyl Side Type  Length    Bits  Offset Class     Syncs"
+        " Sectors    Gap Long\n", name, h->numTracks);
+
+    for (track = 0; track < h->numTracks; track++) {
+        fprintf(stdout, "%5u %3u %4u %4s %7lu %7lu %7lu %-9s",
+            track,
+            track / 2,
+            (track % 2) + 1,
+            EADFTRACKTYPE_NAMES[h->trackType[track]],
+            (unsigned long)h->trackSizeBytes[track],
+            (unsigned long)h->trackSizeBits[track],
+            (unsigned long)h->trackOffset[track],
+            EADFTRACKCLASS_NAMES[layouts[track].trackClass]);
 
-    if (track > h1->numTracks
-        || track > h2->numTracks
-        || h1->trackType[track] != h2->trackType[track]
-        || h1->trackSizeBytes[track] != h2->trackSizeBytes[track]
-        || h1->trackSizeBits[track] != h2->trackSizeBits[track])
-    {
-        *result = 1;
-        return COMMANDSTATUS_SUCCESS;
+        if (h->trackType[track] == EADFTRACKTYPE_RAW
+            && h->trackSizeBytes[track] > 0)
+        {
+            fprintf(stdout, " %5lu %7lu %6lu %4s\n",
+                layouts[track].numSyncs,
+                layouts[track].numSectors,
+                layouts[track].maxGap,
+                (eadfTrackBits(h, track) > EADF_LONGTRACKBITS) ? "*" : "");
+        } else {
+            fprintf(stdout, "     -       -      -\n");
+        }
     }
+}
 
-    if (fseek(f1, h1->trackOffset[track], SEEK_SET) < 0) {
-        perror(n1);
-        command_errno = COMMANDERROR_SEEKERROR;
+CommandStatus executeInfoCommand(int argc, char **argv)
+{
+    EADFHeader *h;
+    int i;
+    CommandStatus status = COMMANDSTATUS_SUCCESS;
+
+    if (argc < 3) {
+        command_errno = COMMANDERROR_WRONGNUMBEROFARGS;
         return COMMANDSTATUS_FAILURE;
     }
 
-    if (fseek(f2, h2->trackOffset[track], SEEK_SET) < 0) {
-        perror(n2);
-        command_errno = COMMANDERROR_SEEKERROR;
+    if ((h = calloc(1, sizeof(EADFHeader))) == NULL) {
+        command_errno = COMMANDERROR_NOMEMORY;
         return COMMANDSTATUS_FAILURE;
     }
 
-    numBytes = h1->trackSizeBytes[track];
-    for (; numBytes > 0; numBytes -= COMMAND_BUFSIZE) {
-        unsigned int count;
-        count = (numBytes > COMMAND_BUFSIZE) ? COMMAND_BUFSIZE : numBytes;
+    for (i = 2; i < argc; i++) {
+        EADFTrackLayout *layouts = NULL;
+        FILE *f;
 
-        if (fread(buf1, 1, count, f1) != count) {
-            command_errno = COMMANDERROR_INVALIDFILE;
-            if (feof(f1)) {
-                command_errno = COMMANDERROR_EOFERROR;
-            } else if (ferror(f1)) {
-                command_errno = COMMANDERROR_READERROR;
-            }
-            return COMMANDSTATUS_FAILURE;
+        if ((f = openImage(argv[i])) == NULL) {
+            command_errno = COMMANDERROR_CANNOTOPENFILE;
+            status = COMMANDSTATUS_FAILURE;
+            continue;
         }
 
-        if (fread(buf2, 1, count, f2) != count) {
+        if (eadfHeaderInitWithFile(h, f) != EADFSTATUS_SUCCESS) {
+            eadfPrintErrorWithContext(argv[i]);
             command_errno = COMMANDERROR_INVALIDFILE;
-            if (feof(f2)) {
-                command_errno = COMMANDERROR_EOFERROR;
-            } else if (ferror(f2)) {
-                command_errno = COMMANDERROR_READERROR;
-            }
-            return COMMANDSTATUS_FAILURE;
+            status = COMMANDSTATUS_FAILURE;
+        } else if ((layouts = malloc((h->numTracks + 1)
+                        * sizeof(EADFTrackLayout))) == NULL)
+        {
+            command_errno = COMMANDERROR_NOMEMORY;
+            status = COMMANDSTATUS_FAILURE;
+        } else if (loadLayouts(h, f, argv[i], layouts, 1)
+                   != COMMANDSTATUS_SUCCESS)
+        {
+            status = COMMANDSTATUS_FAILURE;
+        } else {
+            displayInfo(h, argv[i], layouts);
         }
 
-        if (memcmp(buf1, buf2, count) != 0) {
-            *result = 1;
-            return COMMANDSTATUS_SUCCESS;
-        }
+        fclose(f);
+        free(layouts);
     }
 
-    *result = 0;
-    return COMMANDSTATUS_SUCCESS;
+    free(h);
+    return status;
 }
 
-CommandStatus printComparison(EADFHeader *h1, FILE *f1, const char *n1,
-    EADFHeader *h2, FILE *f2, const char *n2)
+/*
+** Populate an EADFTrackSource array using source1 for each track unless
+** the corresponding track in source2 is in a better class (for example
+** data where source1's track is empty or noise). The supplied data
+** holds two pointers, to the classes of the tracks of source1 and to
+** those of source2.
+*/
+CommandStatus mergeTrackSourceCallback(EADFTrackSource *trackSources,
+    EADFHeader *h1, EADFHeader *h2, void *data)
 {
-    unsigned long numTracks;
-    unsigned long track;
-
-    fprintf(stdout, "       SOURCE1             SOURCE2\n"
-        "Track  Type Bytes   Bits   Type Bytes   Bits D\n");
+    unsigned long track, numTracks;
+    EADFTrackClass **classes = (EADFTrackClass **)data;
 
     numTracks = (h1->numTracks > h2->numTracks) ? h1->numTracks:h2->numTracks;
     for (track = 0; track < numTracks; track++) {
-        EADFTrackType type1 = EADFTRACKTYPE_RAW, type2 = EADFTRACKTYPE_RAW;
-        long bytes1 = 0, bits1 = 0, bytes2 = 0, bits2 = 0;
-        CommandStatus status;
-        char diff = '*';
-        int cmp;
-
-        if (track < h1->numTracks) {
-            type1 = h1->trackType[track];
-            bytes1 = h1->trackSizeBytes[track];
-            bits1 = h1->trackSizeBits[track];
+        if (track >= h2->numTracks
+            || (track < h1->numTracks
+                && classes[0][track] >= classes[1][track]))
+        {
+            trackSources[track] = EADFTRACKSOURCE_SOURCE1;
+        } else {
+            trackSources[track] = EADFTRACKSOURCE_SOURCE2;
         }
+    }
 
-        if (track < h2->numTracks) {
-            type2 = h2->trackType[track];
-            bytes2 = h2->trackSizeBytes[track];
-            bits2 = h2->trackSizeBits[track];
-        }
+    return COMMANDSTATUS_SUCCESS;
+}
 
-        status = compareTracks(&cmp, h1, f1, n1, h2, f2, n2, track);
-        if (status != COMMANDSTATUS_SUCCESS) {
-            return COMMANDSTATUS_FAILURE;
-        }
+CommandStatus executeMergeCommand(int argc, char **argv)
+{
+    EADFTrackClass *classes[2];
+    CommandStatus status;
 
-        if (cmp == 0) {
-            diff = ' ';
-        }
+    if (argc != 5) {
+        command_errno = COMMANDERROR_WRONGNUMBEROFARGS;
+        return COMMANDSTATUS_FAILURE;
+    }
 
-        fprintf(stdout, "%5lu  %4s %5ld %6ld   %4s %5ld %6ld %c\n",
-            track,
-            EADFTRACKTYPE_NAMES[type1], bytes1, bits1,
-            EADFTRACKTYPE_NAMES[type2], bytes2, bits2,
-            diff);
+    status = loadClasses(argv[2], &classes[0]);
+    if (status == COMMANDSTATUS_SUCCESS)
+        status = loadClasses(argv[3], &classes[1]);
+    if (status == COMMANDSTATUS_SUCCESS) {
+        status = mergeFiles(argv[2], argv[3], argv[4],
+            mergeTrackSourceCallback, (void *)classes);
     }
 
-    return COMMANDSTATUS_SUCCESS;
+    return status;
 }
 
-CommandStatus executeCompareCommand(int argc, char **argv)
+CommandStatus executePatchCommand(int argc, char **argv)
 {
     EADFHeader *h;
-    FILE *f1, *f2;
-    CommandStatus status;
+    FILE *f1, *f2, *f3;
+    EADFChecksums *sums = NULL;
+    EADFStatus status;
+    double start;
 
-    if (argc != 4) {
+    if (argc != 5) {
         command_errno = COMMANDERROR_WRONGNUMBEROFARGS;
         return COMMANDSTATUS_FAILURE;
     }
 
-    if ((h = malloc(2 * sizeof(EADFHeader))) == NULL) {
+    if ((h = calloc(1, sizeof(EADFHeader))) == NULL) {
         command_errno = COMMANDERROR_NOMEMORY;
         return COMMANDSTATUS_FAILURE;
     }
 
-    if ((f1 = fopen(argv[2], "rb")) == NULL) {
-        perror(argv[2]);
+    if (option_manifest && (sums = calloc(1, sizeof(EADFChecksums))) == NULL) {
         free(h);
+        command_errno = COMMANDERROR_NOMEMORY;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if ((f1 = openImage(argv[2])) == NULL) {
+        free(h);
+        free(sums);
         command_errno = COMMANDERROR_CANNOTOPENFILE;
         return COMMANDSTATUS_FAILURE;
     }
 
     if (eadfHeaderInitWithFile(h, f1) != EADFSTATUS_SUCCESS) {
+        eadfPrintErrorWithContext(argv[2]);
         free(h);
+        free(sums);
         fclose(f1);
-        eadfPrintErrorWithContext(argv[2]);
         command_errno = COMMANDERROR_INVALIDFILE;
         return COMMANDSTATUS_FAILURE;
     }
@@ -811,479 +8211,1239 @@ CommandStatus executeCompareCommand(int argc, char **argv)
     if ((f2 = fopen(argv[3], "rb")) == NULL) {
         perror(argv[3]);
         free(h);
+        free(sums);
         fclose(f1);
         command_errno = COMMANDERROR_CANNOTOPENFILE;
         return COMMANDSTATUS_FAILURE;
     }
 
-    if (eadfHeaderInitWithFile(h + 1, f2) != EADFSTATUS_SUCCESS) {
+    if ((f3 = fopen(argv[4], "wb")) == NULL) {
+        perror(argv[4]);
         free(h);
+        free(sums);
         fclose(f1);
         fclose(f2);
-        eadfPrintErrorWithContext(argv[3]);
-        command_errno = COMMANDERROR_INVALIDFILE;
+        command_errno = COMMANDERROR_CANNOTOPENFILE;
         return COMMANDSTATUS_FAILURE;
     }
- 
-    status = printComparison(h, f1, argv[2], h + 1, f2, argv[3]);
 
+    start = statsClock();
+    status = eadfPatchFile(h, f1, argv[2], f2, f3, sums);
+    statsAddTime(EADFPHASE_COPY, start);
     free(h);
     fclose(f1);
     fclose(f2);
+    fclose(f3);
 
-    return status;
+    if (status != EADFSTATUS_SUCCESS) {
+        free(sums);
+        eadfPrintErrorWithContext(argv[3]);
+        command_errno = COMMANDERROR_PATCHERROR;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if (sums != NULL) {
+        CommandStatus st = writeManifest(argv[4], sums);
+        free(sums);
+        return st;
+    }
+
+    return COMMANDSTATUS_SUCCESS;
 }
 
 /*
-** Merge two extended ADF files.
-**
-** Arguments "src1" and "src2" are the names of the two source files,
-** "dest" is the name of the destination file and "callback" is a
-** pointer to a function which will populate the trackSources array.
-** The "data" argument is passed unchanged to "callback".
+** An image named in a pipeline: either a source file, or the result of
+** a step, held as the header it would be written with and the image
+** each of its tracks is copied from. No step moves a track to another
+** position, so a track of any result is always the same track of one
+** of the source files.
 */
-CommandStatus mergeFiles(const char *src1, const char *src2,
-    const char *dest, CommandTrackSourceCallback callback, void *data)
+typedef struct {
+    char *name;
+    FILE *f;                        /* NULL for the result of a step */
+    int consumed;                   /* used as a source by a later step */
+    EADFHeader h;
+    int *origin;                    /* a source file image, or -1 */
+    int classified;                 /* trackClass has been filled in */
+    EADFTrackClass *trackClass;
+} PipelineImage;
+
+/*
+** Return the index of the image a step uses as a source, opening it and
+** reading its header the first time a source file is named. Returns -1
+** on failure.
+*/
+long pipelineSource(PipelineImage *images, unsigned long *numImages,
+    const char *name)
 {
-    FILE *f1, *f2, *f3;
-    EADFHeader *h1, *h2;
-    EADFTrackSource trackSources[EADF_MAXTRACKS];
-    EADFStatus status;
+    PipelineImage *image;
+    unsigned long i, track;
+
+    for (i = 0; i < *numImages; i++) {
+        if (!strcmp(images[i].name, name)) {
+            if (images[i].f == NULL)
+                images[i].consumed = 1;
+            return i;
+        }
+    }
 
-    if ((h1 = malloc(2 * sizeof(EADFHeader))) == NULL) {
+    if (*numImages == COMMAND_MAXIMAGES) {
+        fprintf(stderr, "%s: Too many images\n", name);
+        command_errno = COMMANDERROR_INVALIDPIPELINE;
+        return -1;
+    }
+
+    image = &images[*numImages];
+    if ((image->name = malloc(strlen(name) + 1)) == NULL) {
         command_errno = COMMANDERROR_NOMEMORY;
-        return COMMANDSTATUS_FAILURE;
+        return -1;
     }
-    h2 = h1 + 1;
+    strcpy(image->name, name);
 
-    if ((f1 = fopen(src1, "rb")) == NULL) {
-        perror(src1);
-        free(h1);
+    if ((image->f = openImage(name)) == NULL) {
+        free(image->name);
         command_errno = COMMANDERROR_CANNOTOPENFILE;
-        return COMMANDSTATUS_FAILURE;
+        return -1;
     }
 
-    if ((f2 = fopen(src2, "rb")) == NULL) {
-        perror(src2);
-        free(h1);
-        fclose(f1);
-        command_errno = COMMANDERROR_CANNOTOPENFILE;
+    if (eadfHeaderInitWithFile(&image->h, image->f) != EADFSTATUS_SUCCESS) {
+        eadfPrintErrorWithContext(name);
+        fclose(image->f);
+        free(image->name);
+        command_errno = COMMANDERROR_INVALIDFILE;
+        return -1;
+    }
+
+    image->origin = eadfArenaAlloc((image->h.numTracks + 1) * sizeof(int));
+    if (image->origin == NULL) {
+        fclose(image->f);
+        free(image->name);
+        command_errno = COMMANDERROR_NOMEMORY;
+        return -1;
+    }
+
+    image->consumed = 0;
+    image->classified = 0;
+    for (track = 0; track < image->h.numTracks; track++) {
+        image->origin[track] = *numImages;
+    }
+
+    return (*numImages)++;
+}
+
+/*
+** Add the result of a step to the pipeline, taking each of its tracks
+** from image "in1" or "in2" as given by "trackSources" in the same way
+** as eadfMergeFiles(). Returns the index of the new image, or -1 on
+** failure.
+*/
+long pipelineResult(PipelineImage *images, unsigned long *numImages,
+    const char *name, unsigned long in1, unsigned long in2,
+    const EADFTrackSource *trackSources)
+{
+    PipelineImage *image;
+    EADFHeader *hs[2];
+    unsigned long i, track, numTracks;
+    double start;
+
+    for (i = 0; i < *numImages; i++) {
+        if (!strcmp(images[i].name, name)) {
+            fprintf(stderr, "%s: Already used earlier in the pipeline\n",
+                name);
+            command_errno = COMMANDERROR_INVALIDPIPELINE;
+            return -1;
+        }
+    }
+
+    if (*numImages == COMMAND_MAXIMAGES) {
+        fprintf(stderr, "%s: Too many images\n", name);
+        command_errno = COMMANDERROR_INVALIDPIPELINE;
+        return -1;
+    }
+
+    image = &images[*numImages];
+    if ((image->name = malloc(strlen(name) + 1)) == NULL) {
+        command_errno = COMMANDERROR_NOMEMORY;
+        return -1;
+    }
+    strcpy(image->name, name);
+    image->f = NULL;
+    image->consumed = 0;
+    image->classified = 0;
+
+    start = statsClock();
+    hs[0] = &images[in1].h;
+    hs[1] = &images[in2].h;
+    numTracks = (hs[0]->numTracks > hs[1]->numTracks)
+        ? hs[0]->numTracks : hs[1]->numTracks;
+    image->origin = eadfArenaAlloc((numTracks + 1) * sizeof(int));
+    if (image->origin == NULL
+        || eadfHeaderAlloc(&image->h, numTracks) != EADFSTATUS_SUCCESS)
+    {
+        free(image->name);
+        command_errno = COMMANDERROR_NOMEMORY;
+        return -1;
+    }
+
+    for (track = 0; track < image->h.numTracks; track++) {
+        long source = eadfTrackSourceIndex(2, hs, trackSources, track);
+        EADFHeader *from;
+
+        image->origin[track] = -1;
+        if (source >= 0)
+            image->origin[track] = images[source ? in2 : in1].origin[track];
+
+        if (image->origin[track] >= 0) {
+            from = &images[image->origin[track]].h;
+            image->h.trackType[track] = from->trackType[track];
+            image->h.trackSizeBytes[track] = from->trackSizeBytes[track];
+            image->h.trackSizeBits[track] = from->trackSizeBits[track];
+        } else {
+            image->h.trackType[track] = EADFTRACKTYPE_RAW;
+            image->h.trackSizeBytes[track] = 0;
+            image->h.trackSizeBits[track] = 0;
+        }
+        image->h.trackOffset[track] = 0;
+    }
+    statsAddTime(EADFPHASE_PLANNING, start);
+
+    return (*numImages)++;
+}
+
+/*
+** Set *classes to an array from the arena holding the class of each
+** track of a pipeline image, classifying the source files its tracks
+** come from the first time they are needed.
+*/
+CommandStatus pipelineClasses(PipelineImage *images, unsigned long index,
+    EADFTrackClass **classes)
+{
+    PipelineImage *image = &images[index], *from;
+    EADFTrackLayout *layouts;
+    unsigned long track, i;
+
+    *classes = eadfArenaAlloc(image->h.numTracks * sizeof(EADFTrackClass));
+    if (*classes == NULL) {
+        command_errno = COMMANDERROR_NOMEMORY;
         return COMMANDSTATUS_FAILURE;
     }
 
-    if ((f3 = fopen(dest, "wb")) == NULL) {
-        perror(dest);
-        free(h1);
-        fclose(f1);
-        fclose(f2);
-        command_errno = COMMANDERROR_CANNOTOPENFILE;
+    for (track = 0; track < image->h.numTracks; track++) {
+        (*classes)[track] = EADFTRACKCLASS_EMPTY;
+        if (image->origin[track] < 0)
+            continue;
+
+        from = &images[image->origin[track]];
+        if (!from->classified) {
+            layouts = malloc((from->h.numTracks + 1)
+                * sizeof(EADFTrackLayout));
+            from->trackClass = eadfArenaAlloc((from->h.numTracks + 1)
+                * sizeof(EADFTrackClass));
+            if (layouts == NULL || from->trackClass == NULL) {
+                free(layouts);
+                command_errno = COMMANDERROR_NOMEMORY;
+                return COMMANDSTATUS_FAILURE;
+            }
+
+            if (loadLayouts(&from->h, from->f, from->name, layouts, 0)
+                != COMMANDSTATUS_SUCCESS)
+            {
+                free(layouts);
+                return COMMANDSTATUS_FAILURE;
+            }
+
+            for (i = 0; i < from->h.numTracks; i++) {
+                from->trackClass[i] = layouts[i].trackClass;
+            }
+            from->classified = 1;
+            free(layouts);
+        }
+
+        (*classes)[track] = from->trackClass[track];
+    }
+
+    return COMMANDSTATUS_SUCCESS;
+}
+
+/*
+** Plan one line of a pipeline, already split into "words", adding the
+** images it names and produces to "images".
+*/
+CommandStatus pipelineStep(int numWords, char **words,
+    PipelineImage *images, unsigned long *numImages)
+{
+    EADFTrackSource *trackSources;
+    EADFTrackClass *classes[2];
+    CommandTrackSpecs specs;
+    CommandTrackSourceCallback callback = NULL;
+    void *data = NULL;
+    Command which = commandFromString(words[0]);
+    CommandStatus st;
+    unsigned long numTracks, track;
+    long in1, in2;
+    int numDests, i;
+
+    if (which == COMMAND_SPLIT) {
+        if (numWords < 3 || (numWords < 4 && strchr(words[2], '=') == NULL)) {
+            command_errno = COMMANDERROR_WRONGNUMBEROFARGS;
+            return COMMANDSTATUS_FAILURE;
+        }
+
+        if ((in1 = pipelineSource(images, numImages, words[1])) < 0)
+            return COMMANDSTATUS_FAILURE;
+
+        numTracks = images[in1].h.numTracks;
+        trackSources = eadfArenaAlloc(numTracks * sizeof(EADFTrackSource));
+        if (trackSources == NULL) {
+            command_errno = COMMANDERROR_NOMEMORY;
+            return COMMANDSTATUS_FAILURE;
+        }
+
+        /* Each destination of a split is a separate result */
+        numDests = (strchr(words[2], '=') == NULL) ? 1 : numWords - 2;
+        for (i = 2; i < numDests + 2; i++) {
+            for (track = 0; track < numTracks; track++) {
+                trackSources[track] = EADFTRACKSOURCE_NONE;
+            }
+
+            if (numDests == 1 && strchr(words[2], '=') == NULL) {
+                st = parseTrackSpecs(numWords, words, 3, trackSources,
+                    numTracks, EADFTRACKSOURCE_SOURCE1);
+            } else if ((st = parseSplitDestination(words[i], &specs))
+                       == COMMANDSTATUS_SUCCESS)
+            {
+                st = parseTrackSpecs(specs.argc, specs.argv, specs.start,
+                    trackSources, numTracks, EADFTRACKSOURCE_SOURCE1);
+            }
+
+            if (st != COMMANDSTATUS_SUCCESS
+                || pipelineResult(images, numImages, words[i], in1, in1,
+                       trackSources) < 0)
+            {
+                return COMMANDSTATUS_FAILURE;
+            }
+        }
+
+        return COMMANDSTATUS_SUCCESS;
+    }
+
+    if (which == COMMAND_MERGE || which == COMMAND_DOSMERGE) {
+        if (numWords != 4) {
+            command_errno = COMMANDERROR_WRONGNUMBEROFARGS;
+            return COMMANDSTATUS_FAILURE;
+        }
+        callback = (which == COMMAND_MERGE) ? mergeTrackSourceCallback
+            : dosMergeTrackSourceCallback;
+    } else if (which == COMMAND_REPLACE) {
+        if (numWords < 5) {
+            command_errno = COMMANDERROR_WRONGNUMBEROFARGS;
+            return COMMANDSTATUS_FAILURE;
+        }
+        callback = replaceTrackSourceCallback;
+    } else {
+        fprintf(stderr, "%s: Not allowed in a pipeline\n", words[0]);
+        command_errno = COMMANDERROR_INVALIDPIPELINE;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if ((in1 = pipelineSource(images, numImages, words[1])) < 0
+        || (in2 = pipelineSource(images, numImages, words[2])) < 0)
+    {
         return COMMANDSTATUS_FAILURE;
     }
 
-    if (eadfHeaderInitWithFile(h1, f1) != EADFSTATUS_SUCCESS) {
-        eadfPrintErrorWithContext(src1);
-        free(h1);
-        fclose(f1);
-        fclose(f2);
-        fclose(f3);
-        command_errno = COMMANDERROR_INVALIDFILE;
+    numTracks = (images[in1].h.numTracks > images[in2].h.numTracks)
+        ? images[in1].h.numTracks : images[in2].h.numTracks;
+    trackSources = eadfArenaAlloc(numTracks * sizeof(EADFTrackSource));
+    if (trackSources == NULL) {
+        command_errno = COMMANDERROR_NOMEMORY;
         return COMMANDSTATUS_FAILURE;
     }
 
-    if (eadfHeaderInitWithFile(h2, f2) != EADFSTATUS_SUCCESS) {
-        eadfPrintErrorWithContext(src2);
-        free(h1);
-        fclose(f1);
-        fclose(f2);
-        fclose(f3);
-        command_errno = COMMANDERROR_INVALIDFILE;
+    if (which == COMMAND_REPLACE) {
+        specs.argc = numWords;
+        specs.argv = words;
+        specs.start = 4;
+        data = (void *)&specs;
+    } else if (which == COMMAND_MERGE) {
+        if (pipelineClasses(images, in1, &classes[0])
+                != COMMANDSTATUS_SUCCESS
+            || pipelineClasses(images, in2, &classes[1])
+               != COMMANDSTATUS_SUCCESS)
+        {
+            return COMMANDSTATUS_FAILURE;
+        }
+        data = (void *)classes;
+    }
+
+    if (callback(trackSources, &images[in1].h, &images[in2].h, data)
+        != COMMANDSTATUS_SUCCESS)
+    {
         return COMMANDSTATUS_FAILURE;
     }
 
-    if (callback(trackSources, h1, h2, data) == COMMANDSTATUS_FAILURE) {
-        free(h1);
-        fclose(f1);
-        fclose(f2);
-        fclose(f3);
+    if (pipelineResult(images, numImages, words[3], in1, in2,
+            trackSources) < 0)
+    {
         return COMMANDSTATUS_FAILURE;
     }
 
-    status = eadfMergeFiles(h1, f1, src1, h2, f2, src2, f3, trackSources);
-    free(h1);
-    fclose(f1);
-    fclose(f2);
-    fclose(f3);
+    return COMMANDSTATUS_SUCCESS;
+}
 
-    if (status != EADFSTATUS_SUCCESS) {
-        eadfPrintErrorWithContext(NULL);
-        command_errno = COMMANDERROR_MERGEERROR;
+/*
+** Read a pipeline from "f", planning each line in turn.
+*/
+CommandStatus readPipeline(FILE *f, const char *name,
+    PipelineImage *images, unsigned long *numImages)
+{
+    char line[COMMAND_BUFSIZE], *words[COMMAND_MAXWORDS];
+    unsigned long lineNum = 0;
+    int numWords;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        lineNum++;
+        if (strchr(line, '\n') == NULL && !feof(f)) {
+            fprintf(stderr, "%s:%lu: Line too long\n", name, lineNum);
+            command_errno = COMMANDERROR_INVALIDPIPELINE;
+            return COMMANDSTATUS_FAILURE;
+        }
+
+        numWords = splitLine(line, words, COMMAND_MAXWORDS);
+        if (numWords == 0)
+            continue;
+
+        if (numWords < 0) {
+            fprintf(stderr, "%s:%lu: Too many words\n", name, lineNum);
+            command_errno = COMMANDERROR_INVALIDPIPELINE;
+            return COMMANDSTATUS_FAILURE;
+        }
+
+        if (pipelineStep(numWords, words, images, numImages)
+            != COMMANDSTATUS_SUCCESS)
+        {
+            fprintf(stderr, "%s:%lu: ", name, lineNum);
+            commandPrintErrorWithContext(NULL);
+            command_errno = COMMANDERROR_INVALIDPIPELINE;
+            return COMMANDSTATUS_FAILURE;
+        }
+    }
+
+    if (ferror(f)) {
+        perror(name);
+        command_errno = COMMANDERROR_READERROR;
         return COMMANDSTATUS_FAILURE;
     }
 
     return COMMANDSTATUS_SUCCESS;
 }
 
-CommandStatus splitFile(const char *src, const char *dest,
-    CommandTrackSourceCallback callback, void *data)
+/*
+** Write the result of a pipeline step, copying each track straight from
+** the source file it originates from.
+*/
+CommandStatus writePipelineImage(PipelineImage *images,
+    unsigned long numImages, PipelineImage *image)
 {
-    FILE *f1, *f2;
-    EADFHeader *h;
-    EADFTrackSource trackSources[EADF_MAXTRACKS];
-    EADFStatus status;
-
-    if ((h = malloc(sizeof(EADFHeader))) == NULL) {
+    EADFTrackSource *trackSources;
+    EADFHeader **hs;
+    EADFIO *io, **ios, out;
+    FILE *f;
+    EADFChecksums *sums = NULL;
+    CommandStatus status = COMMANDSTATUS_SUCCESS;
+    unsigned long i, track;
+    double start;
+
+    hs = malloc(numImages * sizeof(EADFHeader *));
+    io = eadfArenaAlloc(numImages * sizeof(EADFIO));
+    ios = eadfArenaAlloc(numImages * sizeof(EADFIO *));
+    trackSources = eadfArenaAlloc(image->h.numTracks
+        * sizeof(EADFTrackSource));
+    if (option_manifest)
+        sums = calloc(1, sizeof(EADFChecksums));
+    if (hs == NULL || io == NULL || ios == NULL || trackSources == NULL
+        || (option_manifest && sums == NULL))
+    {
+        free(hs);
+        free(sums);
         command_errno = COMMANDERROR_NOMEMORY;
         return COMMANDSTATUS_FAILURE;
     }
 
-    if ((f1 = fopen(src, "rb")) == NULL) {
-        perror(src);
-        free(h);
-        command_errno = COMMANDERROR_CANNOTOPENFILE;
-        return COMMANDSTATUS_FAILURE;
+    /* Only loaded images have a file, and every origin is one of them */
+    for (i = 0; i < numImages; i++) {
+        hs[i] = &images[i].h;
+        ios[i] = &io[i];
+        if (images[i].f != NULL)
+            eadfIOInitFile(ios[i], images[i].f);
     }
 
-    if ((f2 = fopen(dest, "wb")) == NULL) {
-        perror(dest);
-        free(h);
-        fclose(f1);
+    for (track = 0; track < image->h.numTracks; track++) {
+        trackSources[track] = (image->origin[track] < 0)
+            ? EADFTRACKSOURCE_NONE
+            : (EADFTrackSource)(EADFTRACKSOURCE_SOURCE1
+                                + image->origin[track]);
+    }
+
+    if ((f = fopen(image->name, "wb")) == NULL) {
+        perror(image->name);
         command_errno = COMMANDERROR_CANNOTOPENFILE;
+        status = COMMANDSTATUS_FAILURE;
+    } else {
+        start = statsClock();
+        eadfIOInitFile(&out, f);
+        if (eadfAssembleFiles(numImages, hs, ios, &out, image->h.numTracks,
+                trackSources, sums)
+            != EADFSTATUS_SUCCESS)
+        {
+            eadfPrintErrorWithContext(NULL);
+            command_errno = COMMANDERROR_MERGEERROR;
+            status = COMMANDSTATUS_FAILURE;
+        }
+        statsAddTime(EADFPHASE_COPY, start);
+        fclose(f);
+    }
+
+    if (status == COMMANDSTATUS_SUCCESS && sums != NULL)
+        status = writeManifest(image->name, sums);
+
+    free(hs);
+    free(sums);
+    return status;
+}
+
+CommandStatus executePipelineCommand(int argc, char **argv)
+{
+    PipelineImage *images;
+    unsigned long numImages = 0, numWritten = 0, i;
+    CommandStatus status;
+    FILE *f;
+
+    if (argc != 3) {
+        command_errno = COMMANDERROR_WRONGNUMBEROFARGS;
         return COMMANDSTATUS_FAILURE;
     }
 
-    if (eadfHeaderInitWithFile(h, f1) != EADFSTATUS_SUCCESS) {
-        eadfPrintErrorWithContext(src);
-        free(h);
-        fclose(f1);
-        fclose(f2);
-        command_errno = COMMANDERROR_INVALIDFILE;
+    if ((images = calloc(COMMAND_MAXIMAGES, sizeof(PipelineImage))) == NULL) {
+        command_errno = COMMANDERROR_NOMEMORY;
         return COMMANDSTATUS_FAILURE;
     }
 
-    if (callback(trackSources, h, NULL, data) == COMMANDSTATUS_FAILURE) {
-        free(h);
-        fclose(f1);
-        fclose(f2);
+    if (!strcmp(argv[2], "-")) {
+        f = stdin;
+    } else if ((f = fopen(argv[2], "r")) == NULL) {
+        perror(argv[2]);
+        free(images);
+        command_errno = COMMANDERROR_CANNOTOPENFILE;
         return COMMANDSTATUS_FAILURE;
     }
 
-    status = eadfSplitFile(h, f1, src, f2, trackSources);
-    free(h);
-    fclose(f1);
-    fclose(f2);
+    status = readPipeline(f, argv[2], images, &numImages);
+    if (f != stdin)
+        fclose(f);
 
-    if (status != EADFSTATUS_SUCCESS) {
-        eadfPrintErrorWithContext(NULL);
-        command_errno = COMMANDERROR_MERGEERROR;
-        return COMMANDSTATUS_FAILURE;
+    /* Only results which no later step uses are written */
+    for (i = 0; i < numImages && status == COMMANDSTATUS_SUCCESS; i++) {
+        if (images[i].f == NULL && !images[i].consumed) {
+            status = writePipelineImage(images, numImages, &images[i]);
+            numWritten++;
+        }
     }
 
-    return COMMANDSTATUS_SUCCESS;
+    if (status == COMMANDSTATUS_SUCCESS && numWritten == 0) {
+        fprintf(stderr, "%s: Nothing to write\n", argv[2]);
+        command_errno = COMMANDERROR_INVALIDPIPELINE;
+        status = COMMANDSTATUS_FAILURE;
+    }
+
+    for (i = 0; i < numImages; i++) {
+        if (images[i].f != NULL)
+            fclose(images[i].f);
+        free(images[i].name);
+    }
+    free(images);
+    return status;
 }
 
 /*
-** Populate an EADFTrackSource array using source1 for each track unless
-** it is a non-DOS track and the corresponding track from source2 is
-** a DOS track.
+** Populate an EADFTrackSource array using the supplied data (which should
+** be a pointer to a CommandTrackSpecs listing the tracks to take from
+** source2).
 */
-CommandStatus dosMergeTrackSourceCallback(EADFTrackSource *trackSources,
+CommandStatus replaceTrackSourceCallback(EADFTrackSource *trackSources,
     EADFHeader *h1, EADFHeader *h2, void *data)
 {
     unsigned long track, numTracks;
-
-    (void) data; /* prevent compiler issuing unused variable warnings */
+    const CommandTrackSpecs *specs = (const CommandTrackSpecs *)data;
 
     numTracks = (h1->numTracks > h2->numTracks) ? h1->numTracks:h2->numTracks;
     for (track = 0; track < numTracks; track++) {
-        if (track >= h2->numTracks
-            || (track < h1->numTracks
-                && (h1->trackType[track] == EADFTRACKTYPE_DOS
-                    || h2->trackType[track] == EADFTRACKTYPE_RAW)))
+        trackSources[track] = EADFTRACKSOURCE_SOURCE1;
+    }
+
+    return parseTrackSpecs(specs->argc, specs->argv, specs->start,
+        trackSources, numTracks, EADFTRACKSOURCE_SOURCE2);
+}
+
+/*
+** Set trackSources[track] to "value" for each track given by the
+** TRACKSPECs argv[start] to argv[argc - 1]. Every TRACKSPEC is checked
+** but only the first "numTracks" entries are set, so a list can be
+** checked before the image it applies to is open by passing zero.
+*/
+CommandStatus parseTrackSpecs(int argc, char **argv, int start,
+    EADFTrackSource *trackSources, unsigned long numTracks,
+    EADFTrackSource value)
+{
+    long track, limit = (long)numTracks;
+    int i;
+
+    for (i = start; i < argc; i++) {
+        char *endptr;
+        long val1, val2;
+
+        /* side1 and side2 are the even and odd numbered tracks */
+        if (strcmp(argv[i], "side1") == 0 || strcmp(argv[i], "side2") == 0) {
+            track = argv[i][4] - '1';
+            for (; track < limit; track += 2) {
+                trackSources[track] = value;
+            }
+            continue;
+        }
+
+        /* cA and cA-B are cylinders, each of which holds two tracks */
+        if (argv[i][0] == 'c') {
+            val1 = strtol(argv[i] + 1, &endptr, 10);
+            val2 = val1;
+            if (endptr != argv[i] + 1 && endptr[0] == '-')
+                val2 = strtol(endptr + 1, &endptr, 10);
+            if (endptr == argv[i] + 1 || endptr[0] != '\0'
+                || val1 < 0 || val2 < val1 || val2 >= EADF_MAXTRACKS / 2)
+            {
+                command_errno = COMMANDERROR_INVALIDTRACKSPEC;
+                return COMMANDSTATUS_FAILURE;
+            }
+
+            for (track = 2 * val1; track <= 2 * val2 + 1 && track < limit;
+                 track++)
+            {
+                trackSources[track] = value;
+            }
+            continue;
+        }
+
+        val1 = strtol(argv[i], &endptr, 10);
+        if ((endptr[0] != '\0' && endptr[0] != '-')
+            || val1 < 0
+            || val1 >= EADF_MAXTRACKS)
         {
-            trackSources[track] = EADFTRACKSOURCE_SOURCE1;
-        } else {
-            trackSources[track] = EADFTRACKSOURCE_SOURCE2;
+            command_errno = COMMANDERROR_INVALIDTRACKSPEC;
+            return COMMANDSTATUS_FAILURE;
+        }
+
+        if (endptr[0] == '\0') {
+            if (val1 < limit)
+                trackSources[val1] = value;
+            continue;
+        }
+
+        val2 = strtol(endptr + 1, &endptr, 10);
+        if (endptr[0] != '\0' || val2 < val1 || val2 >= EADF_MAXTRACKS) {
+            command_errno = COMMANDERROR_INVALIDTRACKSPEC;
+            return COMMANDSTATUS_FAILURE;
+        }
+ 
+        for (track = val1; track <= val2 && track < limit; track++) {
+            trackSources[track] = value;
         }
     }
 
     return COMMANDSTATUS_SUCCESS;
 }
 
-CommandStatus executeDosMergeCommand(int argc, char **argv)
+CommandStatus executeReplaceCommand(int argc, char **argv)
 {
-    if (argc != 5) {
+    CommandTrackSpecs specs;
+    CommandStatus st;
+
+    if (argc < 6) {
         command_errno = COMMANDERROR_WRONGNUMBEROFARGS;
         return COMMANDSTATUS_FAILURE;
     }
 
-    return mergeFiles(argv[2], argv[3], argv[4], dosMergeTrackSourceCallback,
-        NULL);
+    st = parseTrackSpecs(argc, argv, 5, NULL, 0, EADFTRACKSOURCE_SOURCE2);
+    if (st == COMMANDSTATUS_FAILURE)
+        return COMMANDSTATUS_FAILURE;
+
+    specs.argc = argc;
+    specs.argv = argv;
+    specs.start = 5;
+    return mergeFiles(argv[2], argv[3], argv[4], replaceTrackSourceCallback,
+        (void *)&specs);
 }
 
-void printHelpForCommand(const char *cmd)
+CommandStatus executeSectorMergeCommand(int argc, char **argv)
 {
-    Command which = commandFromString(cmd);
+    EADFHeader *hs;
+    FILE **fs, *dest;
+    unsigned long numSources, numOpen, numTracks = 0, i, track, sector;
+    unsigned long count, *found;
+    CommandStatus status = COMMANDSTATUS_SUCCESS;
+    double start;
 
-    if (which == COMMAND_UNKNOWN) {
-        commandPrintErrorWithContext(cmd);
-        return;
+    if (argc < 5) {
+        command_errno = COMMANDERROR_WRONGNUMBEROFARGS;
+        return COMMANDSTATUS_FAILURE;
     }
 
-    fprintf(stdout, "%s\n", COMMAND_HELPTEXT[which]);
+    numSources = argc - 3;
+    hs = calloc(numSources, sizeof(EADFHeader));
+    fs = malloc(numSources * sizeof(FILE *));
+    if (hs == NULL || fs == NULL) {
+        free(hs);
+        free(fs);
+        command_errno = COMMANDERROR_NOMEMORY;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    for (numOpen = 0; numOpen < numSources; numOpen++) {
+        const char *name = argv[numOpen + 3];
+
+        if ((fs[numOpen] = openImage(name)) == NULL) {
+            command_errno = COMMANDERROR_CANNOTOPENFILE;
+            status = COMMANDSTATUS_FAILURE;
+            break;
+        }
+
+        if (eadfHeaderInitWithFile(&hs[numOpen], fs[numOpen])
+            != EADFSTATUS_SUCCESS)
+        {
+            eadfPrintErrorWithContext(name);
+            fclose(fs[numOpen]);
+            command_errno = COMMANDERROR_INVALIDFILE;
+            status = COMMANDSTATUS_FAILURE;
+            break;
+        }
+
+        if (hs[numOpen].numTracks > numTracks)
+            numTracks = hs[numOpen].numTracks;
+    }
+
+    if (status == COMMANDSTATUS_SUCCESS
+        && (found = eadfArenaAlloc(numTracks * sizeof(unsigned long)))
+            == NULL)
+    {
+        command_errno = COMMANDERROR_NOMEMORY;
+        status = COMMANDSTATUS_FAILURE;
+    }
+
+    if (status == COMMANDSTATUS_SUCCESS) {
+        if ((dest = fopen(argv[2], "wb")) == NULL) {
+            perror(argv[2]);
+            command_errno = COMMANDERROR_CANNOTOPENFILE;
+            status = COMMANDSTATUS_FAILURE;
+        } else {
+            start = statsClock();
+            if (eadfSectorMergeFiles(numSources, hs, fs, argv + 3, dest,
+                    found) != EADFSTATUS_SUCCESS)
+            {
+                eadfPrintErrorWithContext(argv[2]);
+                command_errno = COMMANDERROR_MERGEERROR;
+                status = COMMANDSTATUS_FAILURE;
+            }
+            statsAddTime(EADFPHASE_COPY, start);
+            fclose(dest);
+        }
+    }
+
+    if (status == COMMANDSTATUS_SUCCESS) {
+        fprintf(stdout, "Track Cyl Side Sectors Missing\n");
+        for (track = 0; track < numTracks; track++) {
+            count = 0;
+            for (sector = 0; sector < ADF_SECTORSPERTRACK; sector++) {
+                if (found[track] & (1UL << sector))
+                    count++;
+            }
+
+            fprintf(stdout, "%5lu %3lu %4lu %7lu", track, track / 2,
+                (track % 2) + 1, count);
+            for (sector = 0; sector < ADF_SECTORSPERTRACK; sector++) {
+                if (!(found[track] & (1UL << sector)))
+                    fprintf(stdout, " %lu", sector);
+            }
+            fprintf(stdout, "\n");
+        }
+    }
+
+    for (i = 0; i < numOpen; i++) {
+        fclose(fs[i]);
+    }
+
+    free(hs);
+    free(fs);
+    return status;
 }
 
-CommandStatus executeHelpCommand(int argc, char **argv)
+/*
+** An entry in the locality sensitive hashing table used by the similar
+** command: the hash of one band of an image's MinHash signature.
+*/
+typedef struct {
+    unsigned long key;
+    unsigned long band;
+    unsigned long image;
+} SimilarBucketEntry;
+
+int compareSimilarBucketEntries(const void *p1, const void *p2)
 {
-    int i, j;
+    const SimilarBucketEntry *e1 = p1, *e2 = p2;
+
+    if (e1->band != e2->band)
+        return (e1->band < e2->band) ? -1 : 1;
+    if (e1->key != e2->key)
+        return (e1->key < e2->key) ? -1 : 1;
+    if (e1->image != e2->image)
+        return (e1->image < e2->image) ? -1 : 1;
+    return 0;
+}
 
-    if (argc > 2) {
-        printHelpForCommand(argv[2]);
+/*
+** Find the representative of an image's group, shortening the path
+** to it as we go.
+*/
+unsigned long similarGroupOf(unsigned long *group, unsigned long image)
+{
+    while (group[image] != image) {
+        group[image] = group[group[image]];
+        image = group[image];
+    }
 
-        for (i = 3; i < argc; i++) {
-            fprintf(stdout, "\n");
-            printHelpForCommand(argv[i]);
+    return image;
+}
+
+/*
+** Group images whose signatures share a band and are at least
+** EADF_MINHASHSIMILARITY percent similar, then print the groups.
+*/
+void printSimilarGroups(unsigned long numImages, char **names,
+    const unsigned long *sigs, const int *valid,
+    SimilarBucketEntry *entries, unsigned long *group)
+{
+    unsigned long i, j, k, band, numEntries = 0, groupNum = 0;
+
+    for (i = 0; i < numImages; i++) {
+        group[i] = i;
+        if (!valid[i])
+            continue;
+
+        for (band = 0; band < EADF_MINHASHBANDS; band++) {
+            const unsigned long *rows = sigs + i * EADF_MINHASHES
+                + band * EADF_MINHASHROWS;
+            unsigned long key = 0, row;
+
+            for (row = 0; row < EADF_MINHASHROWS; row++) {
+                key = hashMix(key ^ rows[row]);
+            }
+
+            entries[numEntries].key = key;
+            entries[numEntries].band = band;
+            entries[numEntries].image = i;
+            numEntries++;
+        }
+    }
+
+    qsort(entries, numEntries, sizeof(SimilarBucketEntry),
+        compareSimilarBucketEntries);
+
+    /*
+    ** Join each image in a bucket to the group of the first earlier
+    ** image in it which it is similar to. Images already in the same
+    ** group are not compared again.
+    */
+    for (i = 0; i < numEntries; i = j) {
+        for (j = i + 1; j < numEntries
+             && entries[j].band == entries[i].band
+             && entries[j].key == entries[i].key; j++)
+        {
+            unsigned long other = entries[j].image;
+
+            for (k = i; k < j; k++) {
+                unsigned long g1, g2;
+
+                g1 = similarGroupOf(group, entries[k].image);
+                g2 = similarGroupOf(group, other);
+                if (g1 == g2
+                    || minHashSimilarity(
+                           sigs + entries[k].image * EADF_MINHASHES,
+                           sigs + other * EADF_MINHASHES)
+                       < EADF_MINHASHSIMILARITY)
+                {
+                    continue;
+                }
+
+                if (g1 < g2) {
+                    group[g2] = g1;
+                } else {
+                    group[g1] = g2;
+                }
+                break;
+            }
         }
-        return COMMANDSTATUS_SUCCESS;
     }
 
-    fprintf(stdout, "%s\n   %s", COMMAND_BASICHELP, COMMAND_ALIASES[0]);
-    for (i = 1, j = 0; i < COMMAND_NUMALIASES; i++) {
-        if (COMMAND_ALIASMAP[i] == COMMAND_ALIASMAP[j])
-            continue;
-
-        if (j == i-1) {
-            j = i;
-            fprintf(stdout, "\n   %s", COMMAND_ALIASES[j]);
+    /*
+    ** Sort the images by group, reusing the table. Groups are
+    ** represented by their first image, which sorts first in its group.
+    */
+    numEntries = 0;
+    for (i = 0; i < numImages; i++) {
+        if (!valid[i])
             continue;
-        }
 
-        fprintf(stdout, " (%s", COMMAND_ALIASES[j+1]);
-        for (j = j+2; j < i; j++) {
-            fprintf(stdout, ", %s", COMMAND_ALIASES[j]);
-        }
-        fprintf(stdout, ")\n   %s", COMMAND_ALIASES[j]);
+        entries[numEntries].key = similarGroupOf(group, i);
+        entries[numEntries].band = 0;
+        entries[numEntries].image = i;
+        numEntries++;
     }
-    fprintf(stdout, "\n");
 
-    return COMMANDSTATUS_SUCCESS;
-}
+    qsort(entries, numEntries, sizeof(SimilarBucketEntry),
+        compareSimilarBucketEntries);
 
-void displayInfo(EADFHeader *h, const char *name)
-{
-    unsigned int track;
+    for (i = 0; i < numEntries; i = j) {
+        unsigned long first = entries[i].image;
 
-    fprintf(stdout, "File name: %s\nNumber of tracks: %lu\n"
-        "Track Cyl Side Type  Length    Bits  Offset\n", name, h->numTracks);
+        for (j = i + 1; j < numEntries && entries[j].key == entries[i].key;
+             j++)
+        {
+            if (j == i + 1) {
+                fprintf(stdout, "Group %lu:\n  %s\n", ++groupNum,
+                    names[first]);
+            }
+            fprintf(stdout, "  %s (%lu%%)\n", names[entries[j].image],
+                minHashSimilarity(sigs + first * EADF_MINHASHES,
+                    sigs + entries[j].image * EADF_MINHASHES));
+        }
+    }
 
-    for (track = 0; track < h->numTracks; track++) {
-        fprintf(stdout, "%5u %3u %4u %4s %7lu %7lu %7lu\n",
-            track,
-            track / 2,
-            (track % 2) + 1,
-            EADFTRACKTYPE_NAMES[h->trackType[track]],
-            h->trackSizeBytes[track],
-            h->trackSizeBits[track],
-            h->trackOffset[track]);
+    if (groupNum == 0) {
+        fprintf(stdout, "No similar images found.\n");
     }
 }
 
-CommandStatus executeInfoCommand(int argc, char **argv)
+/*
+** Find and print the groups of similar images among "names".
+*/
+CommandStatus similarImages(unsigned long numImages, char **names)
 {
     EADFHeader *h;
-    int i;
+    unsigned long i, *sigs, *group;
+    int *valid;
+    SimilarBucketEntry *entries;
     CommandStatus status = COMMANDSTATUS_SUCCESS;
 
-    if (argc < 3) {
-        command_errno = COMMANDERROR_WRONGNUMBEROFARGS;
-        return COMMANDSTATUS_FAILURE;
-    }
-
-    if ((h = malloc(sizeof(EADFHeader))) == NULL) {
+    h = calloc(1, sizeof(EADFHeader));
+    sigs = malloc(numImages * EADF_MINHASHES * sizeof(unsigned long));
+    group = malloc(numImages * sizeof(unsigned long));
+    valid = malloc(numImages * sizeof(int));
+    entries = malloc(numImages * EADF_MINHASHBANDS
+        * sizeof(SimilarBucketEntry));
+    if (h == NULL || sigs == NULL || group == NULL || valid == NULL
+        || entries == NULL)
+    {
+        free(h);
+        free(sigs);
+        free(group);
+        free(valid);
+        free(entries);
         command_errno = COMMANDERROR_NOMEMORY;
         return COMMANDSTATUS_FAILURE;
     }
 
-    for (i = 2; i < argc; i++) {
+    for (i = 0; i < numImages; i++) {
+        const char *name = names[i];
+        unsigned long *sig = sigs + i * EADF_MINHASHES;
+        unsigned long slot;
+        double start;
         FILE *f;
 
-        if ((f = fopen(argv[i], "rb")) == NULL) {
-            perror(argv[i]);
+        valid[i] = 0;
+
+        if ((f = openImage(name)) == NULL) {
             command_errno = COMMANDERROR_CANNOTOPENFILE;
             status = COMMANDSTATUS_FAILURE;
             continue;
         }
 
-        if (eadfHeaderInitWithFile(h, f) != EADFSTATUS_SUCCESS) {
-            eadfPrintErrorWithContext(argv[i]);
+        start = statsClock();
+        if (eadfHeaderInitWithFile(h, f) != EADFSTATUS_SUCCESS
+            || eadfMinHashRawTracks(h, f, name, sig) != EADFSTATUS_SUCCESS)
+        {
+            statsAddTime(EADFPHASE_COMPARE, start);
+            eadfPrintErrorWithContext(name);
             command_errno = COMMANDERROR_INVALIDFILE;
             status = COMMANDSTATUS_FAILURE;
-        } else {
-            displayInfo(h, argv[i]);
+            fclose(f);
+            continue;
         }
-
+        statsAddTime(EADFPHASE_COMPARE, start);
         fclose(f);
+
+        for (slot = 0; slot < EADF_MINHASHES; slot++) {
+            if (sig[slot] != EADF_MINHASHEMPTY)
+                valid[i] = 1;
+        }
     }
 
+    printSimilarGroups(numImages, names, sigs, valid, entries, group);
+
     free(h);
+    free(sigs);
+    free(group);
+    free(valid);
+    free(entries);
     return status;
 }
 
-/*
-** Populate an EADFTrackSource array using source1 for each track unless
-** it is an empty (zero bytes in length) track and the corresponding track
-** in source2 is non-empty.
-*/
-CommandStatus mergeTrackSourceCallback(EADFTrackSource *trackSources,
-    EADFHeader *h1, EADFHeader *h2, void *data)
+CommandStatus executeSimilarCommand(int argc, char **argv)
 {
-    unsigned long track, numTracks;
-
-    (void) data; /* prevent compiler issuing unused variable warnings */
+    char **names;
+    unsigned long numNames;
+    CommandStatus status;
 
-    numTracks = (h1->numTracks > h2->numTracks) ? h1->numTracks:h2->numTracks;
-    for (track = 0; track < numTracks; track++) {
-        if (track >= h2->numTracks
-            || (track < h1->numTracks && h1->trackSizeBytes[track] > 0)
-            || (track < h1->numTracks && h2->trackSizeBytes[track] == 0))
-        {
-            trackSources[track] = EADFTRACKSOURCE_SOURCE1;
-        } else {
-            trackSources[track] = EADFTRACKSOURCE_SOURCE2;
+    if (argc == 3 && !strcmp(argv[2], "-")) {
+        status = readNames(stdin, &names, &numNames);
+        if (status == COMMANDSTATUS_SUCCESS && numNames < 2) {
+            command_errno = COMMANDERROR_WRONGNUMBEROFARGS;
+            status = COMMANDSTATUS_FAILURE;
         }
-    }
 
-    return COMMANDSTATUS_SUCCESS;
-}
+        if (status == COMMANDSTATUS_SUCCESS)
+            status = similarImages(numNames, names);
 
-CommandStatus executeMergeCommand(int argc, char **argv)
-{
-    if (argc != 5) {
+        freeNames(names, numNames);
+        return status;
+    }
+
+    if (argc < 4) {
         command_errno = COMMANDERROR_WRONGNUMBEROFARGS;
         return COMMANDSTATUS_FAILURE;
     }
 
-    return mergeFiles(argv[2], argv[3], argv[4], mergeTrackSourceCallback,
-        NULL);
+    return similarImages(argc - 2, argv + 2);
 }
 
 /*
-** Populate an EADFTrackSource array using the supplied data (which should
-** be a pointer to an EADFTrackSource array).
+** Parse a split destination of the form DESTINATION=TRACKSPEC[,...],
+** replacing the '=' and ',' with '\0' so "arg" holds just the file name,
+** and check the TRACKSPECs, listing them in "specs".
 */
-CommandStatus replaceTrackSourceCallback(EADFTrackSource *trackSources,
-    EADFHeader *h1, EADFHeader *h2, void *data)
+CommandStatus parseSplitDestination(char *arg, CommandTrackSpecs *specs)
 {
-    long track, numTracks;
-    EADFTrackSource *replacements = (EADFTrackSource *)data;
+    char **words, *upto;
+    int numSpecs = 0;
 
-    numTracks = (h1->numTracks > h2->numTracks) ? h1->numTracks:h2->numTracks;
-    for (track = 0; track < numTracks; track++) {
-        trackSources[track] = replacements[track];
+    if ((words = eadfArenaAlloc(COMMAND_MAXWORDS * sizeof(char *))) == NULL) {
+        command_errno = COMMANDERROR_NOMEMORY;
+        return COMMANDSTATUS_FAILURE;
     }
 
-    return COMMANDSTATUS_SUCCESS;
+    if ((upto = strrchr(arg, '=')) == NULL || upto == arg) {
+        command_errno = COMMANDERROR_INVALIDTRACKSPEC;
+        return COMMANDSTATUS_FAILURE;
+    }
+    *upto++ = '\0';
+
+    for (;;) {
+        if (numSpecs == COMMAND_MAXWORDS) {
+            command_errno = COMMANDERROR_INVALIDTRACKSPEC;
+            return COMMANDSTATUS_FAILURE;
+        }
+        words[numSpecs++] = upto;
+
+        if ((upto = strchr(upto, ',')) == NULL)
+            break;
+        *upto++ = '\0';
+    }
+
+    specs->argc = numSpecs;
+    specs->argv = words;
+    specs->start = 0;
+    return parseTrackSpecs(numSpecs, words, 0, NULL, 0,
+        EADFTRACKSOURCE_SOURCE1);
 }
 
-CommandStatus parseTrackSpecs(int argc, char **argv, int start,
-    EADFTrackSource *trackSources, EADFTrackSource value)
+CommandStatus executeSplitCommand(int argc, char **argv)
 {
-    int i, track;
+    CommandTrackSpecs *specs;
+    char **dests;
+    unsigned long numDests, i;
+    CommandStatus st = COMMANDSTATUS_SUCCESS;
 
-    for (i = start; i < argc; i++) {
-        char *endptr;
-        long val1, val2;
+    if (argc < 4 || (argc < 5 && strchr(argv[3], '=') == NULL)) {
+        command_errno = COMMANDERROR_WRONGNUMBEROFARGS;
+        return COMMANDSTATUS_FAILURE;
+    }
 
-        val1 = strtol(argv[i], &endptr, 10);
-        if ((endptr[0] != '\0' && endptr[0] != '-')
-            || val1 < 0
-            || val1 >= EADF_MAXTRACKS)
-        {
-            command_errno = COMMANDERROR_INVALIDTRACKSPEC;
-            return COMMANDSTATUS_FAILURE;
-        }
+    /* The original form has one DESTINATION followed by TRACKSPECs */
+    numDests = (strchr(argv[3], '=') == NULL) ? 1 : argc - 3;
 
-        if (endptr[0] == '\0') {
-            trackSources[val1] = value;
-            continue;
-        }
+    specs = malloc(numDests * sizeof(CommandTrackSpecs));
+    dests = malloc(numDests * sizeof(char *));
+    if (specs == NULL || dests == NULL) {
+        free(specs);
+        free(dests);
+        command_errno = COMMANDERROR_NOMEMORY;
+        return COMMANDSTATUS_FAILURE;
+    }
 
-        val2 = strtol(endptr + 1, &endptr, 10);
-        if (endptr[0] != '\0' || val2 < val1 || val2 >= EADF_MAXTRACKS) {
-            command_errno = COMMANDERROR_INVALIDTRACKSPEC;
-            return COMMANDSTATUS_FAILURE;
-        }
- 
-        for (track = val1; track <= val2; track++) {
-            trackSources[track] = value;
+    for (i = 0; i < numDests; i++) {
+        dests[i] = argv[i + 3];
+    }
+
+    if (numDests == 1 && strchr(argv[3], '=') == NULL) {
+        specs[0].argc = argc;
+        specs[0].argv = argv;
+        specs[0].start = 4;
+        st = parseTrackSpecs(argc, argv, 4, NULL, 0,
+            EADFTRACKSOURCE_SOURCE1);
+    } else {
+        for (i = 0; i < numDests && st == COMMANDSTATUS_SUCCESS; i++) {
+            st = parseSplitDestination(dests[i], &specs[i]);
         }
     }
 
-    return COMMANDSTATUS_SUCCESS;
+    if (st == COMMANDSTATUS_SUCCESS)
+        st = splitFiles(argv[2], numDests, dests, specs);
+
+    free(specs);
+    free(dests);
+    return st;
 }
 
-CommandStatus executeReplaceCommand(int argc, char **argv)
+CommandStatus executeToAdfCommand(int argc, char **argv)
 {
-    EADFTrackSource replacements[EADF_MAXTRACKS];
-    CommandStatus st;
-    long track;
+    EADFHeader *h;
+    FILE *f1, *f2;
+    EADFStatus status;
+    unsigned long numBad;
+    double start;
 
-    if (argc < 6) {
+    if (argc != 4) {
         command_errno = COMMANDERROR_WRONGNUMBEROFARGS;
         return COMMANDSTATUS_FAILURE;
     }
 
-    for (track = 0; track < EADF_MAXTRACKS; track++) {
-        replacements[track] = EADFTRACKSOURCE_SOURCE1;
+    if ((h = calloc(1, sizeof(EADFHeader))) == NULL) {
+        command_errno = COMMANDERROR_NOMEMORY;
+        return COMMANDSTATUS_FAILURE;
     }
 
-    st = parseTrackSpecs(argc, argv, 5, replacements, EADFTRACKSOURCE_SOURCE2);
-    if (st == COMMANDSTATUS_FAILURE)
+    if ((f1 = openImage(argv[2])) == NULL) {
+        free(h);
+        command_errno = COMMANDERROR_CANNOTOPENFILE;
         return COMMANDSTATUS_FAILURE;
+    }
 
-    return mergeFiles(argv[2], argv[3], argv[4], replaceTrackSourceCallback,
-        (void *)replacements);
-}
+    if (eadfHeaderInitWithFile(h, f1) != EADFSTATUS_SUCCESS) {
+        eadfPrintErrorWithContext(argv[2]);
+        free(h);
+        fclose(f1);
+        command_errno = COMMANDERROR_INVALIDFILE;
+        return COMMANDSTATUS_FAILURE;
+    }
 
-/*
-** Populate an EADFTrackSource array using the supplied data (which should
-** be a pointer to an EADFTrackSource array).
-*/
-CommandStatus splitTrackSourceCallback(EADFTrackSource *trackSources,
-    EADFHeader *h1, EADFHeader *h2, void *data)
-{
-    unsigned long track;
-    EADFTrackSource *specified = (EADFTrackSource *)data;
+    if ((f2 = fopen(argv[3], "wb")) == NULL) {
+        perror(argv[3]);
+        free(h);
+        fclose(f1);
+        command_errno = COMMANDERROR_CANNOTOPENFILE;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    start = statsClock();
+    status = eadfWriteAdf(h, f1, argv[2], f2, &numBad);
+    statsAddTime(EADFPHASE_COPY, start);
+    free(h);
+    fclose(f1);
+    fclose(f2);
 
-    (void) h2; /* prevent compiler issuing unused variable warning */
+    if (status != EADFSTATUS_SUCCESS) {
+        eadfPrintErrorWithContext(NULL);
+        command_errno = COMMANDERROR_MERGEERROR;
+        return COMMANDSTATUS_FAILURE;
+    }
 
-    for (track = 0; track < h1->numTracks; track++) {
-        trackSources[track] = specified[track];
+    if (numBad > 0) {
+        command_errno = COMMANDERROR_BADSECTORS;
+        return COMMANDSTATUS_FAILURE;
     }
 
     return COMMANDSTATUS_SUCCESS;
 }
 
-CommandStatus executeSplitCommand(int argc, char **argv)
+/*
+** Convert SOURCE (argv[2]) to DESTINATION (argv[3]) with "write".
+*/
+CommandStatus executeExportCommand(int argc, char **argv,
+    CommandExportFunction write)
 {
-    EADFTrackSource specified[EADF_MAXTRACKS];
-    CommandStatus st;
-    long track;
+    EADFHeader *h;
+    EADFIO io;
+    FILE *f1, *f2;
+    EADFStatus status;
+    double start;
 
-    if (argc < 5) {
+    if (argc != 4) {
         command_errno = COMMANDERROR_WRONGNUMBEROFARGS;
         return COMMANDSTATUS_FAILURE;
     }
 
-    for (track = 0; track < EADF_MAXTRACKS; track++) {
-        specified[track] = EADFTRACKSOURCE_NONE;
+    if ((h = calloc(1, sizeof(EADFHeader))) == NULL) {
+        command_errno = COMMANDERROR_NOMEMORY;
+        return COMMANDSTATUS_FAILURE;
     }
 
-    st = parseTrackSpecs(argc, argv, 4, specified, EADFTRACKSOURCE_SOURCE1);
-    if (st == COMMANDSTATUS_FAILURE)
+    if ((f1 = openImage(argv[2])) == NULL) {
+        free(h);
+        command_errno = COMMANDERROR_CANNOTOPENFILE;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if (eadfHeaderInitWithFile(h, f1) != EADFSTATUS_SUCCESS) {
+        eadfPrintErrorWithContext(argv[2]);
+        free(h);
+        fclose(f1);
+        command_errno = COMMANDERROR_INVALIDFILE;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    if ((f2 = fopen(argv[3], "wb")) == NULL) {
+        perror(argv[3]);
+        free(h);
+        fclose(f1);
+        command_errno = COMMANDERROR_CANNOTOPENFILE;
+        return COMMANDSTATUS_FAILURE;
+    }
+
+    start = statsClock();
+    eadfIOInitFile(&io, f2);
+    status = write(h, f1, argv[2], &io);
+    statsAddTime(EADFPHASE_COPY, start);
+    free(h);
+    fclose(f1);
+    if (fclose(f2) != 0 && status == EADFSTATUS_SUCCESS) {
+        eadf_errno = EADFERROR_WRITEERROR;
+        status = EADFSTATUS_FAILURE;
+    }
+
+    if (status != EADFSTATUS_SUCCESS) {
+        eadfPrintErrorWithContext((eadf_errno == EADFERROR_WRITEERROR)
+            ? argv[3] : argv[2]);
+        command_errno = COMMANDERROR_EXPORTERROR;
         return COMMANDSTATUS_FAILURE;
+    }
 
-    return splitFile(argv[2], argv[3], splitTrackSourceCallback,
-        (void *)specified);
+    return COMMANDSTATUS_SUCCESS;
 }
 
 Command commandFromString(const char *s)
@@ -1323,27 +9483,84 @@ void commandPrintErrorWithContext(const char *context)
 CommandStatus dispatchCommand(Command which, int argc, char **argv)
 {
     switch (which) {
+    case COMMAND_ASSEMBLE:
+        return executeAssembleCommand(argc, argv);
+        break;
+    case COMMAND_BATCH:
+        return executeBatchCommand(argc, argv);
+        break;
+    case COMMAND_BUNDLE:
+        return executeBundleCommand(argc, argv);
+        break;
+    case COMMAND_CANONICALIZE:
+        return executeCanonicalizeCommand(argc, argv);
+        break;
+    case COMMAND_CATALOG:
+        return executeCatalogCommand(argc, argv);
+        break;
+    case COMMAND_CHECK:
+        return executeCheckCommand(argc, argv);
+        break;
     case COMMAND_COMPARE:
         return executeCompareCommand(argc, argv);
         break;
+    case COMMAND_CONSENSUS:
+        return executeConsensusCommand(argc, argv);
+        break;
+    case COMMAND_DIFF:
+        return executeDiffCommand(argc, argv);
+        break;
     case COMMAND_DOSMERGE:
         return executeDosMergeCommand(argc, argv);
         break;
+    case COMMAND_EXTRACT:
+        return executeExtractCommand(argc, argv);
+        break;
+    case COMMAND_FROMADF:
+        return executeFromAdfCommand(argc, argv);
+        break;
     case COMMAND_HELP:
         return executeHelpCommand(argc, argv);
         break;
+    case COMMAND_IDENTIFY:
+        return executeIdentifyCommand(argc, argv);
+        break;
+    case COMMAND_INDEX:
+        return executeIndexCommand(argc, argv);
+        break;
     case COMMAND_INFO:
         return executeInfoCommand(argc, argv);
         break;
     case COMMAND_MERGE:
         return executeMergeCommand(argc, argv);
         break;
+    case COMMAND_PATCH:
+        return executePatchCommand(argc, argv);
+        break;
+    case COMMAND_PIPELINE:
+        return executePipelineCommand(argc, argv);
+        break;
     case COMMAND_REPLACE:
         return executeReplaceCommand(argc, argv);
         break;
+    case COMMAND_SECTORMERGE:
+        return executeSectorMergeCommand(argc, argv);
+        break;
+    case COMMAND_SIMILAR:
+        return executeSimilarCommand(argc, argv);
+        break;
     case COMMAND_SPLIT:
         return executeSplitCommand(argc, argv);
         break;
+    case COMMAND_TOADF:
+        return executeToAdfCommand(argc, argv);
+        break;
+    case COMMAND_TOHFE:
+        return executeExportCommand(argc, argv, eadfWriteHfe);
+        break;
+    case COMMAND_TOSCP:
+        return executeExportCommand(argc, argv, eadfWriteScp);
+        break;
     case COMMAND_UNKNOWN:
         command_errno = COMMANDERROR_UNKNOWNCOMMMAND;
         return COMMANDSTATUS_FAILURE;
@@ -1355,24 +9572,79 @@ CommandStatus dispatchCommand(Command which, int argc, char **argv)
     return COMMANDSTATUS_FAILURE;   
 }
 
+/*
+** Print the contents of eadf_stats to stderr, either as text or as a
+** JSON object. "total" is the time the whole command took.
+*/
+void printStats(enum StatsFormat format, double total)
+{
+    int i;
+
+    if (format == STATSFORMAT_JSON) {
+        fprintf(stderr, "{\"bytesRead\": %lu, \"bytesWritten\": %lu, "
+            "\"reads\": %lu, \"writes\": %lu, \"seeks\": %lu, "
+            "\"seconds\": {",
+            eadf_stats.bytesRead, eadf_stats.bytesWritten,
+            eadf_stats.reads, eadf_stats.writes, eadf_stats.seeks);
+        for (i = 0; i < EADFPHASE_NUMPHASES; i++) {
+            fprintf(stderr, "\"%s\": %.6f, ", EADFPHASE_NAMES[i],
+                eadf_stats.phaseTime[i]);
+        }
+        fprintf(stderr, "\"total\": %.6f}}\n", total);
+        return;
+    }
+
+    fprintf(stderr, "Bytes read:    %10lu (%lu reads)\n"
+        "Bytes written: %10lu (%lu writes)\n"
+        "Seeks:         %10lu\n"
+        "Phase       Seconds\n",
+        eadf_stats.bytesRead, eadf_stats.reads,
+        eadf_stats.bytesWritten, eadf_stats.writes,
+        eadf_stats.seeks);
+    for (i = 0; i < EADFPHASE_NUMPHASES; i++) {
+        fprintf(stderr, "%-8s %10.6f\n", EADFPHASE_NAMES[i],
+            eadf_stats.phaseTime[i]);
+    }
+    fprintf(stderr, "%-8s %10.6f\n", "total", total);
+}
+
 int main(int argc, char **argv)
 {
     Command c;
+    CommandStatus status;
+    double start = statsClock();
 
     if (argc < 2) {
         usage();
         return EXIT_FAILURE;
     }
 
-    if (argv[1][0] == '-') {
+    while (argv[1][0] == '-') {
         if (!strcmp(argv[1], "--version")) {
             version();
             return EXIT_SUCCESS;
+        } else if (!strcmp(argv[1], "--manifest")) {
+            option_manifest = 1;
+        } else if (!strcmp(argv[1], "--stats")
+                   || !strcmp(argv[1], "--stats=text"))
+        {
+            option_stats = STATSFORMAT_TEXT;
+        } else if (!strcmp(argv[1], "--stats=json")) {
+            option_stats = STATSFORMAT_JSON;
+        } else {
+            fprintf(stderr, "invalid option: %s\n", argv[1]);
+            usage();
+            return EXIT_FAILURE;
         }
 
-        fprintf(stderr, "invalid option: %s\n", argv[1]);
-        usage();
-        return EXIT_FAILURE;
+        /* Drop the option so commands see their usual arguments */
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+        if (argc < 2) {
+            usage();
+            return EXIT_FAILURE;
+        }
     }
 
     if ((c = commandFromString(argv[1])) == COMMAND_UNKNOWN) {
@@ -1381,7 +9653,14 @@ int main(int argc, char **argv)
         return EXIT_FAILURE;
     }
     
-    if (dispatchCommand(c, argc, argv) == COMMANDSTATUS_FAILURE) {
+    status = dispatchCommand(c, argc, argv);
+    eadfArenaFree();
+
+    if (option_stats != STATSFORMAT_NONE) {
+        printStats(option_stats, statsClock() - start);
+    }
+
+    if (status == COMMANDSTATUS_FAILURE) {
         commandPrintErrorWithContext(commandNameFromCommand(c));
         return EXIT_FAILURE;
     }